@@ -0,0 +1,485 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Microbenchmarks of the simulation kernels on synthetic cells, over a
+// matrix of grid sizes, numbers of cells and thread counts. Every result is
+// one CSV line on stdout, so runs can be compared line by line.
+//
+// The kernels are those of kernels.cpp, which the simulation runs as well.
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <climits>
+#include <getopt.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "util.hpp"
+#include "cells.hpp"
+#include "cellsort.hpp"
+#include "grid.hpp"
+#include "diffusion.hpp"
+#include "rng.hpp"
+#include "snapshot.hpp"
+#include "metrics.hpp"
+#include "kernels.hpp"
+
+using namespace std;
+
+static const int BENCH_FORMAT = 1; // version of the output format
+
+enum bench_distribution
+{
+    BENCH_UNIFORM,   // cells uniformly distributed over the unit cube, of random type
+    BENCH_CLUSTERED, // cells in normally distributed clusters, the type alternating between clusters
+};
+
+static const char *distributionName(bench_distribution d)
+{
+    return d == BENCH_UNIFORM ? "uniform" : "clustered";
+}
+
+static const int      BENCH_CLUSTERS = 16;
+static const float    BENCH_SIGMA    = 0.05f; // standard deviation of the clusters
+static const uint64_t BENCH_SEED     = 12345;
+
+// places n cells, none of which will divide
+static void placeCells(CellStore &cells, int64_t n, bench_distribution d, unsigned divThreshold)
+{
+    float centres[BENCH_CLUSTERS][4];
+    for(int k = 0; k < BENCH_CLUSTERS; k++)
+        randomFloats4(BENCH_SEED, 0, k, 1, centres[k]);
+
+#pragma omp parallel for
+    for(int64_t c = 0; c < n; c++){
+        float r[4];
+        randomFloats4(BENCH_SEED, 1, c, 0, r);
+        float x = r[0], y = r[1], z = r[2];
+        int type = r[3] < 0.5f ? 1 : -1;
+        if(d == BENCH_CLUSTERED){
+            float g[4];
+            randomFloats4(BENCH_SEED, 2, c, 0, g);
+            const int k = (int)(r[3]*BENCH_CLUSTERS) % BENCH_CLUSTERS;
+            // Box-Muller: two pairs of uniform numbers give three normal ones
+            const float r0 = sqrtf(-2*logf(1 - g[0])), r1 = sqrtf(-2*logf(1 - g[2]));
+            x    = centres[k][0]*0.8f + 0.1f + BENCH_SIGMA*r0*cosf(2*M_PI*g[1]);
+            y    = centres[k][1]*0.8f + 0.1f + BENCH_SIGMA*r0*sinf(2*M_PI*g[1]);
+            z    = centres[k][2]*0.8f + 0.1f + BENCH_SIGMA*r1*cosf(2*M_PI*g[3]);
+            type = k % 2 ? 1 : -1;
+        }
+        cells.x[c]         = std::min(std::max(x, 0.0f), 1.0f);
+        cells.y[c]         = std::min(std::max(y, 0.0f), 1.0f);
+        cells.z[c]         = std::min(std::max(z, 0.0f), 1.0f);
+        cells.movX[c]      = 0;
+        cells.movY[c]      = 0;
+        cells.movZ[c]      = 0;
+        cells.path[c]      = 0;
+        cells.type[c]      = type;
+        cells.divisions[c] = divThreshold;
+        cells.id[c]        = (uint32_t)c;
+    }
+}
+
+// a kernel of the matrix and the items its throughput is counted in
+struct bench_kernel
+{
+    const char *name;
+    const char *unit; // what the throughput counts
+};
+
+static const bench_kernel benchKernels[] =
+{
+    {"produceSubstances",          "cells"},
+    {"runDiffusionStep",           "voxels"},
+    {"runDecayStep",               "voxels"},
+    {"runDiffusionDecayStep",      "voxels"},
+    {"cellMovementAndDuplication", "cells"},
+    {"runDiffusionClusterStep",    "cells"},
+    {"getEnergy",                  "cells"},
+    {"getCriterion",               "calls"},
+    {"sortCells",                  "cells"},
+    {"directionField",             "cells"}, // runDiffusionClusterStep per voxel
+    {"snapshotCapture",            "cells"}, // SnapshotWriter::capture of the cells and the write behind it
+};
+static const int BENCH_KERNELS = sizeof(benchKernels)/sizeof(benchKernels[0]);
+
+struct bench_case
+{
+    int64_t            L;
+    int64_t            n;
+    bench_distribution distribution;
+    cdc_params         params;
+    ConcentrationGrid *Conc;
+    ConcentrationGrid *nextConc;
+    CellStore         *cells;
+    CellStore         *initial; // the cells as placed, restored before the kernels that move them
+    vector<char>       grid;    // the grid the kernels start from, restored before those that change it
+    cluster_stats      stats;
+    SnapshotWriter    *snapshots;      // of snapshotCapture, created by its first call
+    char               snapshotPath[PATH_MAX];
+};
+
+// without production the substances decay into subnormal numbers after a few hundred
+// steps, which would slow down the grid kernels the longer they are repeated
+static void restoreGrid(bench_case &b)
+{
+    memcpy(b.Conc->raw(), b.grid.data(), b.grid.size());
+}
+
+static void restoreCells(bench_case &b)
+{
+    memcpy(b.cells->x,    b.initial->x,    b.n*sizeof(float));
+    memcpy(b.cells->y,    b.initial->y,    b.n*sizeof(float));
+    memcpy(b.cells->z,    b.initial->z,    b.n*sizeof(float));
+    memcpy(b.cells->path, b.initial->path, b.n*sizeof(float));
+    memcpy(b.cells->type, b.initial->type, b.n*sizeof(int));
+    memcpy(b.cells->id,   b.initial->id,   b.n*sizeof(uint32_t));
+}
+
+// creates an empty file for snapshots in $TMPDIR, or /tmp, and writes its name to path
+static void createSnapshotFile(char *path, size_t size)
+{
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, size, "%s/cell_clustering_bench.XXXXXX", dir && *dir ? dir : "/tmp");
+    const int fd = mkstemp(path);
+    if(fd < 0)
+        die("Could not create a snapshot file: %s\n", strerror(errno));
+    close(fd);
+}
+
+// Writes SNAPSHOT_KEYFRAME + 1 snapshots of the grid and of the cells as they
+// move, so that the file holds deltas and a second keyframe, reads them back
+// and dies unless every frame equals what was captured byte for byte. The
+// moves are replayed from the initial cells to check the frames.
+static void roundTripSnapshots(bench_case &b)
+{
+    const int frames = SNAPSHOT_KEYFRAME + 1;
+    char path[PATH_MAX];
+    createSnapshotFile(path, sizeof(path));
+
+    restoreCells(b);
+    {
+        SnapshotWriter w(path, 1, 1);
+        for(int f = 0; f < frames; f++){
+            if(!w.capture(1, f, *b.cells, b.n, *b.Conc))
+                die("Snapshot %d was dropped!\n", f);
+            w.flush();
+            cellMovementAndDuplication(*b.cells, b.params.pathThreshold, b.params.divThreshold, b.n, b.params.seed, f);
+        }
+    }
+
+    restoreCells(b);
+    SnapshotReader r(path);
+    snapshot_frame fr;
+    const int64_t L = b.L;
+    for(int f = 0; f < frames; f++){
+        bool same = r.next(fr) && fr.phase == 1 && fr.step == f && fr.n == b.n && fr.L == L && fr.gridL == L &&
+                    memcmp(fr.x.data(), b.cells->x, b.n*sizeof(float)) == 0 &&
+                    memcmp(fr.y.data(), b.cells->y, b.n*sizeof(float)) == 0 &&
+                    memcmp(fr.z.data(), b.cells->z, b.n*sizeof(float)) == 0 &&
+                    memcmp(fr.id.data(), b.cells->id, b.n*sizeof(uint32_t)) == 0;
+        for(int64_t c = 0; same && c < b.n; c++)
+            same = fr.type[c] == b.cells->type[c];
+        for(int s = 0; same && s < 2; s++)
+            for(int64_t i = 0; same && i < L; i++)
+                for(int64_t j = 0; same && j < L; j++)
+                    for(int64_t k = 0; same && k < L; k++){
+                        const float v = b.Conc->get(s, i, j, k);
+                        same = memcmp(&fr.grid[((s*L + i)*L + j)*L + k], &v, sizeof(v)) == 0;
+                    }
+        if(!same)
+            die("Snapshot %d of %s does not match the captured state!\n", f, path);
+        cellMovementAndDuplication(*b.cells, b.params.pathThreshold, b.params.divThreshold, b.n, b.params.seed, f);
+    }
+    if(r.next(fr))
+        die("Snapshot file %s has more than %d snapshots!\n", path, frames);
+    unlink(path);
+}
+
+// runs kernel k once and returns the number of items it processed
+static double runKernel(int k, bench_case &b, int64_t rep)
+{
+    const double voxels = 2.0*b.L*b.L*b.L;
+    switch(k){
+    case 0:
+        produceSubstances(*b.Conc, *b.cells, b.L, b.n);
+        return b.n;
+    case 1:
+        runDiffusionStep(*b.Conc, *b.nextConc, b.params.D);
+        return voxels;
+    case 2:
+        runDecayStep(*b.Conc, b.params.mu);
+        return voxels;
+    case 3:
+        runDiffusionDecayStep(*b.Conc, *b.nextConc, b.params, false);
+        return voxels;
+    case 4:
+        cellMovementAndDuplication(*b.cells, b.params.pathThreshold, b.params.divThreshold, b.n, b.params.seed, rep);
+        clampToUnitCube(*b.cells, b.n);
+        return b.n;
+    case 5:
+        gradientField = GRADIENT_FIELD_CELL;
+        runDiffusionClusterStep(*b.Conc, *b.cells, b.n, b.L, b.params.speed);
+        return b.n;
+    case 6:
+        b.stats = analyzeClustering(*b.cells, b.n, b.params.spatialRange, 0);
+        return b.n;
+    case 7:
+        b.stats.criterion = evaluateCriterion(b.stats, b.n);
+        return 1;
+    case 8:
+        sortCellsByMorton(*b.cells, b.n, b.L);
+        return b.n;
+    case 9:
+        gradientField = GRADIENT_FIELD_VOXEL;
+        runDiffusionClusterStep(*b.Conc, *b.cells, b.n, b.L, b.params.speed);
+        return b.n;
+    default:
+        if(!b.snapshots){
+            createSnapshotFile(b.snapshotPath, sizeof(b.snapshotPath));
+            b.snapshots = new SnapshotWriter(b.snapshotPath, 0, 1);
+        }
+        if(!b.snapshots->capture(1, rep, *b.cells, b.n, *b.Conc))
+            die("Snapshot %lld was dropped!\n", (long long int)rep);
+        b.snapshots->flush();
+        return b.n;
+    }
+}
+
+static vector<int64_t> parseList(const char *s)
+{
+    vector<int64_t> v;
+    char *end;
+    for(const char *p = s; *p; p = *end ? end + 1 : end){
+        v.push_back(strtoll(p, &end, 10));
+        if(end == p || v.back() < 1 || (*end && *end != ','))
+            die("Invalid list %s!\n", s);
+    }
+    return v;
+}
+
+static const char bench_usage[] =
+    "USAGE:\t%s [--L=<list>] [--n=<list>] [--threads=<list>] [--distribution=uniform|clustered|both]\n"
+    "\t\t[--kernels=<name>,...] [--min-time=<seconds>] [--verify]\n"
+    "\tRuns every kernel on every combination of grid size L, number of cells n and number of\n"
+    "\tthreads, repeating each until min-time has passed (at least 3 times), and prints the\n"
+    "\tmedian and minimum time per call as CSV. Lists are comma-separated.\n"
+    "\tWith --verify, nothing is timed: for every L, n and distribution, snapshots of the cells\n"
+    "\tand the grid are written and read back, and the run fails unless they match.\n";
+
+int main(int argc, char *argv[])
+{
+    vector<int64_t> Ls;
+    Ls.push_back(32);
+    Ls.push_back(64);
+    Ls.push_back(128);
+    vector<int64_t> ns;
+    ns.push_back(1 << 12);
+    ns.push_back(1 << 15);
+    ns.push_back(1 << 18);
+    vector<int64_t> threads;
+    threads.push_back(1);
+    if(omp_get_max_threads() > 1)
+        threads.push_back(omp_get_max_threads());
+    vector<bench_distribution> distributions;
+    distributions.push_back(BENCH_UNIFORM);
+    distributions.push_back(BENCH_CLUSTERED);
+    bool selected[BENCH_KERNELS];
+    for(int k = 0; k < BENCH_KERNELS; k++)
+        selected[k] = true;
+    double minTime = 0.2;
+    bool   verify  = false;
+
+    const option opts[] =
+    {
+        {"help",         no_argument,       0, 'h'},
+        {"L",            required_argument, 0, 'L'},
+        {"n",            required_argument, 0, 'n'},
+        {"threads",      required_argument, 0, 't'},
+        {"distribution", required_argument, 0, 'd'},
+        {"kernels",      required_argument, 0, 'k'},
+        {"min-time",     required_argument, 0, 'm'},
+        {"verify",       no_argument,       0, 'v'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "h", opts, 0)) != -1){
+        switch(opt){
+        case 'L':
+            Ls = parseList(optarg);
+            break;
+        case 'n':
+            ns = parseList(optarg);
+            break;
+        case 't':
+            threads = parseList(optarg);
+            break;
+        case 'd':
+            distributions.clear();
+            if(strcmp(optarg, "uniform") == 0 || strcmp(optarg, "both") == 0)
+                distributions.push_back(BENCH_UNIFORM);
+            if(strcmp(optarg, "clustered") == 0 || strcmp(optarg, "both") == 0)
+                distributions.push_back(BENCH_CLUSTERED);
+            if(distributions.empty())
+                die("Unknown distribution %s!\n", optarg);
+            break;
+        case 'k':
+            for(int k = 0; k < BENCH_KERNELS; k++)
+                selected[k] = false;
+            for(char *name = strtok(optarg, ","); name; name = strtok(0, ",")){
+                int k = 0;
+                while(k < BENCH_KERNELS && strcmp(benchKernels[k].name, name) != 0)
+                    k++;
+                if(k == BENCH_KERNELS)
+                    die("Unknown kernel %s!\n", name);
+                selected[k] = true;
+            }
+            break;
+        case 'm':
+            minTime = atof(optarg);
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            die(bench_usage, basename(argv[0]));
+        }
+    }
+    if(optind != argc)
+        die(bench_usage, basename(argv[0]));
+
+    quiet = 2;
+    selectDiffusionKernels(SIMD_AVX512);
+
+    // the parameters of small.cdc, apart from those that make the cells divide
+    cdc_params params;
+    memset(&params, 0, sizeof(params));
+    params.speed         = 0.01f;
+    params.D             = 0.3f;
+    params.mu            = 0.1f;
+    params.divThreshold  = 16;
+    params.spatialScale  = 5.0f;
+    params.pathThreshold = 2.0f;
+    params.seed          = BENCH_SEED;
+
+    printf("# cell_clustering kernel benchmarks, format %d\n", BENCH_FORMAT);
+    const key_values sys = sys_config();
+    for(size_t i = 0; i < sys.size(); i++)
+        printf("# %s = %s\n", sys[i].first.c_str(), sys[i].second.c_str());
+    printf("# SIMD_KERNELS = %s\n", simd_level_name(selectDiffusionKernels(SIMD_AVX512)));
+    if(verify)
+        printf("check,distribution,L,n,result\n");
+    else
+        printf("kernel,distribution,L,n,threads,reps,median_s,min_s,unit,per_s\n");
+    fflush(stdout);
+
+    for(size_t li = 0; li < Ls.size(); li++)
+    for(size_t ni = 0; ni < ns.size(); ni++)
+    for(size_t di = 0; di < distributions.size(); di++)
+    for(size_t ti = 0; ti < (verify ? 1 : threads.size()); ti++){
+        omp_set_num_threads((int)threads[ti]);
+
+        bench_case b;
+        b.L            = Ls[li];
+        b.n            = ns[ni];
+        b.distribution = distributions[di];
+        b.params       = params;
+        b.params.L            = b.L;
+        b.params.finalNumberCells = b.n;
+        b.params.spatialRange = params.spatialScale*powf(1.0f/b.n, 1.0f/3.0f);
+        b.snapshots    = 0;
+
+        ConcentrationGrid Conc(b.L), nextConc(b.L);
+        CellStore cells(b.n), initial(b.n);
+        placeCells(initial, b.n, b.distribution, b.params.divThreshold);
+        b.Conc     = &Conc;
+        b.nextConc = &nextConc;
+        b.cells    = &cells;
+        b.initial  = &initial;
+        memcpy(cells.type,      initial.type,      b.n*sizeof(int));
+        memcpy(cells.divisions, initial.divisions, b.n*sizeof(int));
+        memcpy(cells.id,        initial.id,        b.n*sizeof(uint32_t));
+        memcpy(cells.movX,      initial.movX,      b.n*sizeof(float));
+        memcpy(cells.movY,      initial.movY,      b.n*sizeof(float));
+        memcpy(cells.movZ,      initial.movZ,      b.n*sizeof(float));
+        restoreCells(b);
+
+        // a grid with gradients to follow: the cells produce and the substances spread for a while
+        for(int s = 0; s < 10; s++){
+            produceSubstances(Conc, cells, b.L, b.n);
+            runDiffusionDecayStep(Conc, nextConc, b.params, false);
+        }
+        b.stats = analyzeClustering(cells, b.n, b.params.spatialRange, 0);
+        b.grid.assign((const char*)Conc.raw(), (const char*)Conc.raw() + Conc.rawBytes());
+
+        if(verify){
+            roundTripSnapshots(b);
+            printf("snapshotRoundTrip,%s,%lld,%lld,ok\n", distributionName(b.distribution), (long long int)b.L, (long long int)b.n);
+            fflush(stdout);
+            continue;
+        }
+
+        for(int k = 0; k < BENCH_KERNELS; k++){
+            if(!selected[k])
+                continue;
+
+            vector<double> t;
+            double items = 0, total = 0;
+            runKernel(k, b, 0); // warm up
+            for(int64_t rep = 1; rep <= 3 || total < minTime; rep++){
+                if(k <= 3)
+                    restoreGrid(b);
+                if(k == 4 || k == 5 || k >= 8)
+                    restoreCells(b);
+                stopwatch sw;
+                sw.reset();
+                items = runKernel(k, b, rep);
+                t.push_back(sw.mark());
+                total += t.back();
+            }
+            restoreGrid(b);
+            restoreCells(b);
+            if(b.snapshots){
+                delete b.snapshots;
+                b.snapshots = 0;
+                unlink(b.snapshotPath);
+            }
+
+            const sample_stats st = summarize(t.data(), t.size());
+            printf("%s,%s,%lld,%lld,%lld,%lld,%.6e,%.6e,%s,%.6e\n", benchKernels[k].name, distributionName(b.distribution),
+                   (long long int)b.L, (long long int)b.n, (long long int)threads[ti], (long long int)st.count,
+                   st.median, st.min, benchKernels[k].unit, items/st.median);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
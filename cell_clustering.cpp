@@ -28,471 +28,456 @@
 */
 
 #include <cstring>
+#include <cerrno>
 #include <cstdlib>
 #include <ctime>
 #include <cmath>
+#include <climits>
+#include <algorithm>
 #include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "util.hpp"
+#include "cells.hpp"
+#include "cellsort.hpp"
+#include "grid.hpp"
+#include "diffusion.hpp"
+#include "spectral.hpp"
+#include "neighbors.hpp"
+#include "rng.hpp"
+#include "domain.hpp"
+#include "checkpoint.hpp"
+#include "snapshot.hpp"
+#include "insitu.hpp"
+#include "sweep.hpp"
+#include "metrics.hpp"
+#include "perf.hpp"
+#include "kernels.hpp"
 
 #include <omp.h>
 
 using namespace std;
 
-static int quiet = 0;
+static Domain domain; // slab of the grid and the cells held by this rank
 
-static inline float RandomFloatPos(){
-  float r = (float) rand();
-  r = r / RAND_MAX;
-  return r;
-}
-
-static inline float getNorm(float* currArray) {
-  // computes L2 norm of input array
-  float d, arraySum=0;
-
-  d = currArray[0] * currArray[0];
-  arraySum = arraySum + d;
+static stopwatch step_sw; // one time step of either phase
 
-  d = currArray[1] * currArray[1];
-  arraySum = arraySum + d;
+static const char     *metricsFile = 0; // where the metrics of the run are written to
+static metrics_report  metrics;
 
-  d = currArray[2] * currArray[2];
-  arraySum = arraySum + d;
+static bool perfReport = false; // count hardware events and report the kernels against the roofline
 
-  arraySum = sqrt(arraySum);
-
-  return arraySum;
+// the timed kernels, as they are reported
+static const struct
+{
+    const char *name;
+    stopwatch  *sw;
+} kernels[] =
+{
+    {"produceSubstances",          &produceSubstances_sw},
+    {"runDiffusionStep",           &runDiffusionStep_sw},
+    {"runDecayStep",               &runDecayStep_sw},
+    {"runDiffusionDecayStep",      &runDiffusionDecayStep_sw},
+    {"cellMovementAndDuplication", &cellMovementAndDuplication_sw},
+    {"runDiffusionClusterStep",    &runDiffusionClusterStep_sw},
+    {"analyzeClustering",          &analyzeClustering_sw},
+    {"sortCells",                  &sortCells_sw},
+    {"step",                       &step_sw},
+};
+
+// how diffusion and decay of the substances are computed in each time step
+enum grid_engine
+{
+    GRID_ENGINE_SEPARATE, // runDiffusionStep followed by runDecayStep
+    GRID_ENGINE_FUSED,    // runDiffusionDecayStep
+    GRID_ENGINE_BLOCKED,  // runDiffusionDecayStep on cache-sized tiles
+    GRID_ENGINE_TEMPORAL, // several steps per tile in phase 1, blocked in phase 2
+    GRID_ENGINE_ACTIVE,   // runDiffusionDecayStep on the blocks that hold substance
+    GRID_ENGINE_ADI,      // implicit diffusion, once every diffusionSubsteps time steps
+    GRID_ENGINE_SPECTRAL, // diffusionSubsteps explicit steps at once in the cosine basis
+};
+
+static grid_engine gridEngine        = GRID_ENGINE_FUSED;
+static int64_t     diffusionSubsteps = 1; // time steps of cell movement per diffusion step of the adi and spectral engines
+static SpectralPropagator *spectral  = 0; // of the spectral engine
+
+// whether the engine advances the grid by diffusionSubsteps steps at once
+static bool multiStepEngine(grid_engine engine)
+{
+    return engine == GRID_ENGINE_ADI || engine == GRID_ENGINE_SPECTRAL;
 }
 
-static float getL2Distance(float pos1x, float pos1y, float pos1z, float pos2x, float pos2y, float pos2z){
-  // returns distance (L2 norm) between two positions in 3D
-  float d, l2Norm = 0;
-  d = pos2x-pos1x;
-  d = d * d;
-  l2Norm = l2Norm + d;
-
-  d = pos2y-pos1y;
-  d = d * d;
-  l2Norm = l2Norm + d;
-
-  d = pos2z-pos1z;
-  d = d * d;
-  l2Norm = l2Norm + d;
-
-  l2Norm = sqrt(l2Norm);
-
-  return l2Norm;
+// the explicit engine the reference run of --precision-drift and of the adi and spectral engines uses
+static grid_engine referenceEngine()
+{
+    return multiStepEngine(gridEngine) ? GRID_ENGINE_FUSED : gridEngine;
 }
 
-static stopwatch produceSubstances_sw;
-static stopwatch runDiffusionStep_sw;
-static stopwatch runDecayStep_sw;
-static stopwatch cellMovementAndDuplication_sw;
-static stopwatch runDiffusionClusterStep_sw;
-static stopwatch getEnergy_sw;
-static stopwatch getCriterion_sw;
-
-static void produceSubstances(float**** Conc, float** posAll, int* typesAll, int L, int n){
-  produceSubstances_sw.reset();
-  // increases the concentration of substances at the location of the cells
-
-  float sideLength = 1/(float)L; // length of a side of a diffusion voxel
-
-  L--;
-
-  float *C;
-  int c, i1, i2, i3;
-#pragma ivdep
-#pragma omp parallel for
-  for(c=0; c< n; c++){
-    i1 = std::min((int)floor(posAll[c][0]/sideLength), L);
-    i2 = std::min((int)floor(posAll[c][1]/sideLength), L);
-    i3 = std::min((int)floor(posAll[c][2]/sideLength), L);
-
-    C = &Conc[(!(typesAll[c]==1))][i1][i2][i3];
-    *C = *C + 0.1;
+static grid_engine parseGridEngine(const char *name)
+{
+    if(strcmp(name, "separate") == 0)
+        return GRID_ENGINE_SEPARATE;
+    if(strcmp(name, "fused") == 0)
+        return GRID_ENGINE_FUSED;
+    if(strcmp(name, "blocked") == 0)
+        return GRID_ENGINE_BLOCKED;
+    if(strcmp(name, "temporal") == 0)
+        return GRID_ENGINE_TEMPORAL;
+    if(strcmp(name, "active") == 0)
+        return GRID_ENGINE_ACTIVE;
+    if(strcmp(name, "adi") == 0)
+        return GRID_ENGINE_ADI;
+    if(strcmp(name, "spectral") == 0)
+        return GRID_ENGINE_SPECTRAL;
+    die("Unknown grid engine %s!\n", name);
+    return GRID_ENGINE_FUSED;
+}
 
-    if(*C > 1) *C=1;
-  }
-  produceSubstances_sw.mark();
+static gradient_field parseGradientField(const char *name)
+{
+    if(strcmp(name, "auto") == 0)
+        return GRADIENT_FIELD_AUTO;
+    if(strcmp(name, "cell") == 0)
+        return GRADIENT_FIELD_CELL;
+    if(strcmp(name, "voxel") == 0)
+        return GRADIENT_FIELD_VOXEL;
+    die("Unknown gradient evaluation %s!\n", name);
+    return GRADIENT_FIELD_AUTO;
 }
 
-static void runDiffusionStep(float**** Conc, int L, float D){
-  runDiffusionStep_sw.reset();
-  // computes the changes in substance concentrations due to diffusion
-  int i1,i2,i3;
+static simd_level simdLevel = SIMD_AVX512; // widest kernels to use if the CPU supports them
 
-  float tempConc[2][L][L][L];
+static simd_level parseSimdLevel(const char *name)
+{
+    if(strcmp(name, "auto") == 0 || strcmp(name, "avx512") == 0)
+        return SIMD_AVX512;
+    if(strcmp(name, "avx2") == 0)
+        return SIMD_AVX2;
+    if(strcmp(name, "scalar") == 0)
+        return SIMD_SCALAR;
+    die("Unknown SIMD level %s!\n", name);
+    return SIMD_SCALAR;
+}
 
-  float ***Conc0 = Conc[0];
-  float ***Conc1 = Conc[1];
+static grid_precision gridPrecision = GRID_FP32; // storage of the concentrations
+static bool reportDrift = false;                 // also run with fp32 storage and an explicit engine and compare FINAL_ENERGY
 
-  float **Conc0_x, *Conc0_xy;
-  float **Conc1_x, *Conc1_xy;
+static grid_precision parseGridPrecision(const char *name)
+{
+    if(strcmp(name, "fp32") == 0)
+        return GRID_FP32;
+    if(strcmp(name, "fp16") == 0)
+        return GRID_FP16;
+    if(strcmp(name, "bf16") == 0)
+        return GRID_BF16;
+    die("Unknown grid precision %s!\n", name);
+    return GRID_FP32;
+}
 
-#pragma omp parallel for
-  for(i1 = 0; i1 < L; i1++){
-    Conc0_x = Conc0[i1];
-    Conc1_x = Conc1[i1];
-    for(i2 = 0; i2 < L; i2++){
-	Conc0_xy = Conc0_x[i2];
-	Conc1_xy = Conc1_x[i2];
-#pragma ivdep
-	for(i3 = 0; i3 < L; i3++){
-	  tempConc[0][i1][i2][i3] = Conc0_xy[i3];
-	  tempConc[1][i1][i2][i3] = Conc1_xy[i3];
-      }
+static int         checkpointPhase   = 0;     // phase (1 or 2) at a step of which a checkpoint is written, 0 for none
+static int64_t     checkpointStep    = 0;     // number of steps of that phase done when it is written
+static const char *checkpointFile    = "cell_clustering.ckpt";
+static bool        checkpointWritten = false;
+static const char *restartFile       = 0;     // checkpoint the run continues from
+
+static const char *sweepFile = 0; // parameter sets of phase 2 to branch into after phase 1
+static int         sweepJobs = 0; // sweep runs at a time, 0 for one per CPU
+static const char *sweepDir  = 0; // directory of the file phase 1 hands its state over in, 0 for $TMPDIR or /tmp
+static int         sweepPhase1Threads;
+
+static int64_t         snapshotEvery   = 0; // time steps between snapshots, 0 for none
+static const char     *snapshotFile    = "cell_clustering.snap";
+static int64_t         snapshotGrid    = 0; // the concentrations are averaged over blocks of snapshotGrid^3 voxels, 0 for none
+static const int       SNAPSHOT_BUFFERS = 4; // snapshots that may wait for the disk before one is dropped
+static SnapshotWriter *snapshots       = 0;
+
+static int64_t      insituEvery   = 0; // time steps of phase 2 between in-situ analyses, 0 for none
+static int          insituThreads = 1;
+static const char  *insituFile    = "cell_clustering_insitu.csv";
+static const int    INSITU_PENDING = 2; // analyses that may wait for a thread before one is dropped
+static InsituPool  *insitu        = 0;  // on the first rank only
+static stopwatch    insitu_sw;          // handing the cells over to the pool
+
+// <phase>:<step> with phase 'phase1' or 'phase2'; 'phase2' alone is the end of phase 1
+static void parseCheckpointAt(const char *spec)
+{
+    char *end = 0;
+    if(strncmp(spec, "phase1:", 7) == 0){
+        checkpointPhase = 1;
+        checkpointStep  = strtoll(spec + 7, &end, 10);
+    }
+    else if(strncmp(spec, "phase2:", 7) == 0){
+        checkpointPhase = 2;
+        checkpointStep  = strtoll(spec + 7, &end, 10);
     }
-  }
-
-  int xUp, xDown, yUp, yDown, zUp, zDown;
-  float *C0, *tC0, *C1, *tC1;
-
-  D = D/6;
-#pragma omp parallel for  collapse(3)
-  for (i1 = 0; i1 < L; i1++){
-    for (i2 = 0; i2 < L; i2++){
-      for (i3 = 0; i3 < L; i3++){
-	xUp   = (i1+1);
-	xDown = (i1-1);
-
-	yUp   = (i2+1);
-	yDown = (i2-1);
-
-	zUp   = (i3+1);
-	zDown = (i3-1);
-
-	C0 = &Conc[0][i1][i2][i3];
-	C1 = &Conc[1][i1][i2][i3];
-
-	tC0 = &tempConc[0][i1][i2][i3];
-	tC1 = &tempConc[1][i1][i2][i3];
-
-	if(xUp<L){
-	  *C0 += (tempConc[0][xUp][i2][i3] - *tC0) * D;
-	  *C1 += (tempConc[1][xUp][i2][i3] - *tC1) * D;
-	}
-	if(xDown>=0){
-	  *C0 += (tempConc[0][xDown][i2][i3] - *tC0) * D;
-	  *C1 += (tempConc[1][xDown][i2][i3] - *tC1) * D;
-	}
-	if(yUp<L){
-	  *C0 += (tempConc[0][i1][yUp][i3] - *tC0) * D;
-	  *C1 += (tempConc[1][i1][yUp][i3] - *tC1) * D;
-	}
-	if(yDown>=0){
-	  *C0 += (tempConc[0][i1][yDown][i3] - *tC0) * D;
-	  *C1 += (tempConc[1][i1][yDown][i3] - *tC1) * D;
-	}
-	if(zUp<L){
-	  *C0 += (tempConc[0][i1][i2][zUp] - *tC0) * D;
-	  *C1 += (tempConc[1][i1][i2][zUp] - *tC1) * D;
-	}
-	if(zDown>=0){
-	  *C0 += (tempConc[0][i1][i2][zDown] - *tC0) * D;
-	  *C1 += (tempConc[1][i1][i2][zDown] - *tC1) * D;
-	}
-
-      }
+    else if(strcmp(spec, "phase2") == 0){
+        checkpointPhase = 2;
+        checkpointStep  = 0;
+        return;
     }
-  }
-  runDiffusionStep_sw.mark();
+    if(!checkpointPhase || end == spec + 7 || *end || checkpointStep < 0)
+        die("Invalid checkpoint step %s!\n", spec);
 }
 
-static void runDecayStep(float**** Conc, int L, float mu) {
-    runDecayStep_sw.reset();
-    // computes the changes in substance concentrations due to decay
-
-    mu = 1-mu;
-
-    float ***Conc0 = Conc[0];
-    float ***Conc1 = Conc[1];
-
-    float **Conc0_x, *Conc0_xy;
-    float **Conc1_x, *Conc1_xy;
+static void saveCheckpoint(const CellStore &cells, const ConcentrationGrid &Conc, const checkpoint_state &st)
+{
+    writeCheckpoint(checkpointFile, cells, Conc, st);
+    checkpointWritten = true;
+    fprintf(stderr, "%-35s = %s (phase %d, step %lld)\n", "CHECKPOINT", checkpointFile, st.phase,
+            (long long int)(st.phase == 1 ? st.phase1Steps : st.phase2Steps));
+}
 
-    int i1,i2,i3;
-#pragma ivdep
-#pragma omp parallel for
-    for (i1 = 0; i1 < L; i1++){
-      Conc0_x = Conc0[i1];
-      Conc1_x = Conc1[i1];
+// hands the state after step steps of phase to the snapshot writer, if one is due
+static void takeSnapshot(int phase, int64_t step, const CellStore &cells, int64_t n, const ConcentrationGrid &Conc)
+{
+    if(snapshots && step % snapshotEvery == 0)
+        snapshots->capture(phase, step, cells, n, Conc);
+}
 
-      for (i2 = 0; i2 < L; i2++){
-	Conc0_xy = Conc0_x[i2];
-	Conc1_xy = Conc1_x[i2];
+// advances the grid of a multi-step engine by steps steps
+static void runMultiStepDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params, grid_engine engine, int64_t steps){
+  if(engine == GRID_ENGINE_SPECTRAL)
+      runSpectralDiffusionDecayStep(*spectral, Conc, nextConc, params, steps);
+  else
+      runAdiDiffusionDecayStep(Conc, params, steps);
+}
 
-	for (i3 = 0; i3 < L; i3++){
-	      Conc0_xy[i3]= Conc0_xy[i3] * mu;
-	      Conc1_xy[i3]= Conc1_xy[i3] * mu;
-            }
-        }
+static void updateGrid(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params, grid_engine engine, int64_t step){
+    // advances the concentrations of both substances by one time step of diffusion and decay,
+    // the step-th of its phase
+    voxelUpdates += 2*Conc.planes()*Conc.size()*Conc.size();
+    switch(engine){
+    case GRID_ENGINE_SEPARATE:
+        runDiffusionStep(Conc, nextConc, params.D);
+        runDecayStep(Conc, params.mu);
+        break;
+    case GRID_ENGINE_FUSED:
+        runDiffusionDecayStep(Conc, nextConc, params, false);
+        break;
+    case GRID_ENGINE_BLOCKED:
+    case GRID_ENGINE_TEMPORAL:
+        runDiffusionDecayStep(Conc, nextConc, params, true);
+        break;
+    case GRID_ENGINE_ACTIVE:
+        runActiveDiffusionDecayStep(Conc, nextConc, params);
+        break;
+    case GRID_ENGINE_ADI:
+    case GRID_ENGINE_SPECTRAL:
+        // the production of the steps in between accumulates in the grid
+        if(step % diffusionSubsteps == 0)
+            runMultiStepDiffusionDecayStep(Conc, nextConc, params, engine, diffusionSubsteps);
+        break;
     }
-    runDecayStep_sw.mark();
 }
 
-static int cellMovementAndDuplication(float** posAll, float* pathTraveled, int* typesAll, int* numberDivisions, float pathThreshold, int divThreshold, int n) {
-    cellMovementAndDuplication_sw.reset();
-    int c;
-    int currentNumberCells = n;
-    float currentNorm;
-
-    float currentCellMovement[3];
-    float duplicatedCellOffset[3];
-
-#pragma ivdep
-    for (c=0; c<n; c++) {
-        // random cell movement
-        currentCellMovement[0]=RandomFloatPos()-0.5;
-        currentCellMovement[1]=RandomFloatPos()-0.5;
-        currentCellMovement[2]=RandomFloatPos()-0.5;
-        currentNorm = getNorm(currentCellMovement);
-        posAll[c][0]+=0.1*currentCellMovement[0]/currentNorm;
-        posAll[c][1]+=0.1*currentCellMovement[1]/currentNorm;
-        posAll[c][2]+=0.1*currentCellMovement[2]/currentNorm;
-        pathTraveled[c]+=0.1;
-
-        // cell duplication if conditions fulfilled
-        if (numberDivisions[c]<divThreshold) {
-
-            if (pathTraveled[c]>pathThreshold) {
-                pathTraveled[c]-=pathThreshold;
-                numberDivisions[c]+=1;  // update number of divisions this cell has undergone
-                currentNumberCells++;   // update number of cells in the simulation
-
-                numberDivisions[currentNumberCells-1]=numberDivisions[c];   // update number of divisions the duplicated cell has undergone
-                typesAll[currentNumberCells-1]=-typesAll[c]; // assign type of duplicated cell (opposite to current cell)
-
-                // assign location of duplicated cell
-                duplicatedCellOffset[0]=RandomFloatPos()-0.5;
-                duplicatedCellOffset[1]=RandomFloatPos()-0.5;
-                duplicatedCellOffset[2]=RandomFloatPos()-0.5;
-                currentNorm = getNorm(duplicatedCellOffset);
-                posAll[currentNumberCells-1][0]=posAll[c][0]+0.05*duplicatedCellOffset[0]/currentNorm;
-                posAll[currentNumberCells-1][1]=posAll[c][1]+0.05*duplicatedCellOffset[1]/currentNorm;
-                posAll[currentNumberCells-1][2]=posAll[c][2]+0.05*duplicatedCellOffset[2]/currentNorm;
-
-            }
+// the clustering of the cells of a job, on a thread of the in-situ pool
+static insitu_result analyzeInsitu(const insitu_job &job, void *ctx) {
+    const float spatialRange = *(const float*)ctx;
+
+    CellList list;
+    list.build(job.x.data(), job.y.data(), job.z.data(), job.type.data(), job.x.size(), spatialRange);
+    cluster_stats st;
+    st.nrCellsSubVol = job.x.size();
+    closePairStats(list, spatialRange, st);
+
+    insitu_result r;
+    r.criterion     = evaluateCriterion(st, job.targetN, false);
+    r.energy        = st.energy;
+    r.nrCellsSubVol = st.nrCellsSubVol;
+    r.nrClose       = st.nrClose;
+    r.correctness   = st.correctness;
+    return r;
+}
 
+// hands the cells of the subvolume after step steps of phase 2 to the in-situ pool, if an analysis is due
+static void submitInsitu(int64_t step, const CellStore &cells, int64_t n, int64_t targetN) {
+    if(!insituEvery || step % insituEvery)
+        return;
+    insitu_sw.reset();
+
+    // every rank takes part in the gather, even if the first one has no free job
+    insitu_job *job = insitu ? insitu->acquire() : 0;
+    const int64_t nTotal = sumOverRanks(n);
+    vector<subvolume_cell> sub;
+    gatherSubvolume(cells, n, nTotal, targetN, sub);
+
+    if(job){
+        const int64_t m = sub.size();
+        job->step    = step;
+        job->targetN = targetN ? targetN : nTotal;
+        job->x.resize(m);
+        job->y.resize(m);
+        job->z.resize(m);
+        job->type.resize(m);
+        for(int64_t c = 0; c < m; c++){
+            job->x[c]    = sub[c].x;
+            job->y[c]    = sub[c].y;
+            job->z[c]    = sub[c].z;
+            job->type[c] = sub[c].type;
         }
+        insitu->submit(job);
     }
-    cellMovementAndDuplication_sw.mark();
-    return currentNumberCells;
+    insitu_sw.mark();
 }
 
-static void runDiffusionClusterStep(float**** Conc, float** movVec, float** posAll, int* typesAll, int cc, int L, float speed){
-  runDiffusionClusterStep_sw.reset();
-  // computes movements of all cells based on gradients of the two substances
-
-  float sideLength = 1/(float)L; // length of a side of a diffusion voxel
-
-  float gradSub1[3];
-  float gradSub2[3];
-
-  float normGrad1, normGrad2;
-  int i1, i2, i3, xUp, xDown, yUp, yDown, zUp, zDown;
+static const char usage_str[] = "USAGE:\t%s[-h] [-V] [--<param>=<value>]* <input file> \n";
 
-  L--;
-  int c = 0;
-#pragma ivdep
-#pragma omp parallel for
-  for(c=0;c<cc;c++){
-  //  while(c--){
-
-    i1 = min((int)floor(posAll[c][0]/sideLength), L);
-    i2 = min((int)floor(posAll[c][1]/sideLength), L);
-    i3 = min((int)floor(posAll[c][2]/sideLength), L);
-
-    xUp   = min((i1+1), L);
-    xDown = max((i1-1), 0);
-    yUp   = min((i2+1), L);
-    yDown = max((i2-1), 0);
-    zUp   = min((i3+1), L);
-    zDown = max((i3-1), 0);
-
-    gradSub1[0] = (Conc[0][xUp][i2][i3]-Conc[0][xDown][i2][i3])/(sideLength*(xUp-xDown));
-    gradSub1[1] = (Conc[0][i1][yUp][i3]-Conc[0][i1][yDown][i3])/(sideLength*(yUp-yDown));
-    gradSub1[2] = (Conc[0][i1][i2][zUp]-Conc[0][i1][i2][zDown])/(sideLength*(zUp-zDown));
-
-    gradSub2[0] = (Conc[1][xUp][i2][i3]-Conc[1][xDown][i2][i3])/(sideLength*(xUp-xDown));
-    gradSub2[1] = (Conc[1][i1][yUp][i3]-Conc[1][i1][yDown][i3])/(sideLength*(yUp-yDown));
-    gradSub2[2] = (Conc[1][i1][i2][zUp]-Conc[1][i1][i2][zDown])/(sideLength*(zUp-zDown));
-
-    normGrad1 = getNorm(gradSub1);
-    normGrad2 = getNorm(gradSub2);
-
-    if((normGrad1>0) && (normGrad2>0)){
-      movVec[c][0]=typesAll[c]*(gradSub1[0]/normGrad1-gradSub2[0]/normGrad2)*speed;
-      movVec[c][1]=typesAll[c]*(gradSub1[1]/normGrad1-gradSub2[1]/normGrad2)*speed;
-      movVec[c][2]=typesAll[c]*(gradSub1[2]/normGrad1-gradSub2[2]/normGrad2)*speed;
-    } else {
-      movVec[c][0]=0;
-      movVec[c][1]=0;
-      movVec[c][2]=0;
-    }
-  }
-  runDiffusionClusterStep_sw.mark();
+static void usage(const char *name)
+{
+    die(usage_str, basename(name));
 }
 
-static float getEnergy(float** posAll, int* typesAll, int n, float spatialRange, int targetN) {
-    getEnergy_sw.reset();
-    // Computes an energy measure of clusteredness within a subvolume. The size of the subvolume
-    // is computed by assuming roughly uniform distribution within the whole volume, and selecting
-    // a volume comprising approximately targetN cells.
-    int i1, i2;
-    float currDist;
-
-    float** posSubvol=0;    // array of all 3 dimensional cell positions
-    posSubvol = new float*[n];
-    int typesSubvol[n];
-
-    float subVolMax = pow(float(targetN)/float(n),1.0/3.0)/2;
-
-    if(quiet < 1)
-        printf("subVolMax: %f\n", subVolMax);
-
-    int nrCellsSubVol = 0;
-
-    float intraClusterEnergy = 0.0;
-    float extraClusterEnergy = 0.0;
-    float nrSmallDist=0.0;
-
-#pragma ivdep
-    for (i1 = 0; i1 < n; i1++) {
-        posSubvol[i1] = new float[3];
-        if ((fabs(posAll[i1][0]-0.5)<subVolMax) && (fabs(posAll[i1][1]-0.5)<subVolMax) && (fabs(posAll[i1][2]-0.5)<subVolMax)) {
-            posSubvol[nrCellsSubVol][0] = posAll[i1][0];
-            posSubvol[nrCellsSubVol][1] = posAll[i1][1];
-            posSubvol[nrCellsSubVol][2] = posAll[i1][2];
-            typesSubvol[nrCellsSubVol] = typesAll[i1];
-            nrCellsSubVol++;
+// Phase 2: cells move along the substance gradients and cluster, starting after firstStep steps;
+// returns the number of cells of this rank at the end. With a position, the checkpoint of
+// phase 2 is written when it is reached.
+static int64_t runPhase2(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, CellStore &cells, int64_t n,
+                         const cdc_params &params, grid_engine engine, bool progress, int64_t firstStep,
+                         const checkpoint_state *position){
+    const int64_t L = params.L;
+
+    checkpoint_state st;
+    if(position){
+        st       = *position;
+        st.phase = 2;
+        if(checkpointPhase == 2 && firstStep == checkpointStep){
+            st.phase2Steps = firstStep;
+            st.n           = n;
+            saveCheckpoint(cells, Conc, st);
         }
+        if(!(restartFile && position->phase == 2)) // a run restarted in phase 2 has its first state already
+            takeSnapshot(2, firstStep, cells, n, Conc);
     }
 
+    int64_t i = params.T - firstStep;
 //#pragma omp parallel for collapse(2)
 #pragma ivdep
-    for (i1 = 0; i1 < nrCellsSubVol; i1++) {
-        for (i2 = i1+1; i2 < nrCellsSubVol; i2++) {
-            currDist =  getL2Distance(posSubvol[i1][0],posSubvol[i1][1],posSubvol[i1][2],posSubvol[i2][0],posSubvol[i2][1],posSubvol[i2][2]);
-            if (currDist<spatialRange) {
-                nrSmallDist = nrSmallDist+1;//currDist/spatialRange;
-                if (typesSubvol[i1]*typesSubvol[i2]>0) {
-                    intraClusterEnergy = intraClusterEnergy+fmin(100.0,spatialRange/currDist); }
-                else {
-                    extraClusterEnergy = extraClusterEnergy+fmin(100.0,spatialRange/currDist);
-                }
+    while(i--){
+
+        if (progress && (i%10) == 0) {
+            if(quiet < 1) {
+                printf("step %lld\n", (long long int)i);
+            }
+            else if(quiet < 2) {
+                printf("\rstep %lld", (long long int)i);
+                fflush(stdout);
             }
         }
-    }
-    float totalEnergy = (extraClusterEnergy-intraClusterEnergy)/(1.0+100.0*nrSmallDist);
-    getEnergy_sw.mark();
-    return totalEnergy;
-}
-
-static bool getCriterion(float** posAll, int* typesAll, int n, float spatialRange, int targetN) {
-    getCriterion_sw.reset();
-    // Returns 0 if the cell locations within a subvolume of the total system, comprising approximately targetN cells,
-    // are arranged as clusters, and 1 otherwise.
 
-    int i1, i2;
-    int nrClose=0;      // number of cells that are close (i.e. within a distance of spatialRange)
-    float currDist;
-    int sameTypeClose=0; // number of cells of the same type, and that are close (i.e. within a distance of spatialRange)
-    int diffTypeClose=0; // number of cells of opposite types, and that are close (i.e. within a distance of spatialRange)
-
-    float** posSubvol=0;    // array of all 3 dimensional cell positions in the subcube
-    posSubvol = new float*[n];
-    int typesSubvol[n];
-
-    float subVolMax = pow(float(targetN)/float(n),1.0/3.0)/2;
-
-    int nrCellsSubVol = 0;
-
-    // the locations of all cells within the subvolume are copied to array posSubvol
-#pragma ivdep
-    for(i1 = 0; i1 < n; i1++){
-        posSubvol[i1] = new float[3];
-        if ((fabs(posAll[i1][0]-0.5)<subVolMax) && (fabs(posAll[i1][1]-0.5)<subVolMax) && (fabs(posAll[i1][2]-0.5)<subVolMax)) {
-            posSubvol[nrCellsSubVol][0] = posAll[i1][0];
-            posSubvol[nrCellsSubVol][1] = posAll[i1][1];
-            posSubvol[nrCellsSubVol][2] = posAll[i1][2];
-            typesSubvol[nrCellsSubVol] = typesAll[i1];
-
-            nrCellsSubVol++;
+        if(progress && quiet == 1) printf("\n");
+
+        step_sw.reset();
+        produceSubstances(Conc, cells, L, n);
+        updateGrid(Conc, nextConc, params, engine, params.T - i);
+        if(Conc.distributed())
+            Conc.fillHalo(); // the gradients at the slab boundary need the planes of the neighbours
+        runDiffusionClusterStep(Conc, cells, n, L, params.speed);
+        applyMovement(cells, n);
+        n = migrateCells(cells, n, domain);
+        sortCells(cells, n, L, params.T - i);
+        step_sw.mark();
+
+        if(position && checkpointPhase == 2 && params.T - i == checkpointStep){
+            st.phase2Steps = params.T - i;
+            st.n           = n;
+            saveCheckpoint(cells, Conc, st);
         }
-    }
-
-    if(quiet < 1)
-        printf("number of cells in subvolume: %d\n", nrCellsSubVol);
-
-
-    // If there are not enough cells within the subvolume, the correctness criterion is not fulfilled
-    if ((((float)(nrCellsSubVol))/(float)targetN) < 0.25) {
-        getCriterion_sw.mark();
-        if(quiet < 2)
-            printf("not enough cells in subvolume: %d\n", nrCellsSubVol);
-        return false;
-    }
-
-    // If there are too many cells within the subvolume, the correctness criterion is not fulfilled
-    if ((((float)(nrCellsSubVol))/(float)targetN) > 4) {
-        getCriterion_sw.mark();
-        if(quiet < 2)
-            printf("too many cells in subvolume: %d\n", nrCellsSubVol);
-        return false;
-    }
-
-//#pragma omp parallel for collapse(2)
-#pragma ivdep
-    for (i1 = 0; i1 < nrCellsSubVol; i1++) {
-        for (i2 = i1+1; i2 < nrCellsSubVol; i2++) {
-            currDist =  getL2Distance(posSubvol[i1][0],posSubvol[i1][1],posSubvol[i1][2],posSubvol[i2][0],posSubvol[i2][1],posSubvol[i2][2]);
-            if (currDist<spatialRange) {
-                nrClose++;
-                if (typesSubvol[i1]*typesSubvol[i2]<0) {
-                    diffTypeClose++;
-                }
-                else {
-                    sameTypeClose++;
-                }
-            }
+        if(position){
+            takeSnapshot(2, params.T - i, cells, n, Conc);
+            submitInsitu(params.T - i, cells, n, params.targetN);
         }
     }
+    if(multiStepEngine(engine) && params.T % diffusionSubsteps) // the grid ends without pending production, as in phase 1
+        runMultiStepDiffusionDecayStep(Conc, nextConc, params, engine, params.T % diffusionSubsteps);
+    return n;
+}
 
-    float correctness_coefficient = ((float)diffTypeClose)/(nrClose+1.0);
-
-    // check if there are many cells of opposite types located within a close distance, indicative of bad clustering
-    if (correctness_coefficient > 0.1) {
-        getCriterion_sw.mark();
-        if(quiet < 2)
-            printf("cells in subvolume are not well-clustered: %f\n", correctness_coefficient);
-        return false;
-    }
-
-    // check if clusters are large enough, i.e. whether cells have more than 100 cells of the same type located nearby
-    float avgNeighbors = ((float)sameTypeClose/nrCellsSubVol);
-    if(quiet < 1)
-        printf("average neighbors in subvolume: %f\n", avgNeighbors);
-    if (avgNeighbors < 100) {
-        getCriterion_sw.mark();
-        if(quiet < 2)
-            printf("cells in subvolume do not have enough neighbors: %f\n", avgNeighbors);
-        return false;
-    }
+// state of phase 1 the sweep runs branch from; each child has its own copy-on-write view of it
+struct sweep_context
+{
+    ConcentrationGrid *Conc;
+    ConcentrationGrid *nextConc;
+    CellStore         *cells;
+    int64_t            n;
+    int64_t            firstStep;
+};
 
+static sweep_result runSweepChild(const sweep_run &run, void *ctx){
+    const sweep_context &c = *(const sweep_context*)ctx;
 
-    if(quiet < 1)
-        printf("correctness coefficient: %f\n", correctness_coefficient);
+    stopwatch phase2_sw;
+    phase2_sw.reset();
+    const int64_t n = runPhase2(*c.Conc, *c.nextConc, *c.cells, c.n, run.params, gridEngine, false, c.firstStep, 0);
+    const cluster_stats st = analyzeClustering(*c.cells, n, run.params.spatialRange, run.params.targetN);
+    phase2_sw.mark();
 
-    getCriterion_sw.mark();
-    return true;
+    sweep_result r;
+    r.status        = 0;
+    r.criterion     = st.criterion;
+    r.energy        = st.energy;
+    r.nrCellsSubVol = st.nrCellsSubVol;
+    r.phase2Time    = phase2_sw.elapsed;
+    return r;
 }
 
-static const char usage_str[] = "USAGE:\t%s[-h] [-V] [--<param>=<value>]* <input file> \n";
-
-static void usage(const char *name)
+// Achieved rates of the kernels with an analytic model, placed under the roofline: a kernel whose
+// arithmetic intensity puts it under the bandwidth roof is bandwidth-bound if it reaches at least
+// half of that roof, else latency-bound, and likewise under the compute roof.
+static void reportRoofline(const roofline &roof)
 {
-    die(usage_str, basename(name));
+    fprintf(stderr, "%-35s = %.3g GFLOP/s\n", "ROOFLINE_PEAK_GFLOPS", roof.gflops);
+    fprintf(stderr, "%-35s = %.3g GB/s\n", "ROOFLINE_PEAK_BANDWIDTH", roof.gbs);
+    fprintf(stderr, "%-35s = %.3g flop/B\n", "ROOFLINE_RIDGE", roof.gflops/roof.gbs);
+    metrics.addResult("ROOFLINE_PEAK_GFLOPS", "%le", roof.gflops);
+    metrics.addResult("ROOFLINE_PEAK_GBS", "%le", roof.gbs);
+
+    for(size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++){
+        const stopwatch &sw = *kernels[k].sw;
+        if(!sw.count || sw.elapsed <= 0)
+            continue;
+
+        char key[64];
+        if(sw.bytes > 0){
+            const double gflops     = sw.flops/sw.elapsed*1e-9;
+            const double gbs        = sw.bytes/sw.elapsed*1e-9;
+            const double ai         = sw.flops/sw.bytes;
+            const bool   memoryRoof = ai*roof.gbs < roof.gflops;
+            const double attainable = memoryRoof ? ai*roof.gbs : roof.gflops;
+            const double fraction   = gflops/attainable;
+            const char  *bound      = fraction < 0.5 ? "latency" : memoryRoof ? "bandwidth" : "compute";
+
+            snprintf(key, sizeof(key), "ROOFLINE_%s", kernels[k].name);
+            fprintf(stderr, "%-35s = %.3g GFLOP/s, %.3g GB/s, %.3g flop/B, %.0f%% of the %s roof, %s-bound\n", key,
+                    gflops, gbs, ai, 100*fraction, memoryRoof ? "bandwidth" : "compute", bound);
+            snprintf(key, sizeof(key), "ROOFLINE_%s_GFLOPS", kernels[k].name);
+            metrics.addResult(key, "%le", gflops);
+            snprintf(key, sizeof(key), "ROOFLINE_%s_GBS", kernels[k].name);
+            metrics.addResult(key, "%le", gbs);
+            snprintf(key, sizeof(key), "ROOFLINE_%s_INTENSITY", kernels[k].name);
+            metrics.addResult(key, "%le", ai);
+            snprintf(key, sizeof(key), "ROOFLINE_%s_BOUND", kernels[k].name);
+            metrics.addResult(key, "%s", bound);
+        }
+
+        if(!perf_counting)
+            continue;
+        char text[256] = "";
+        int len = 0;
+        if(perfAvailable(PERF_CYCLES) && perfAvailable(PERF_INSTRUCTIONS) && sw.counters[PERF_CYCLES])
+            len += snprintf(text + len, sizeof(text) - len, "IPC %.2f, ", (double)sw.counters[PERF_INSTRUCTIONS]/sw.counters[PERF_CYCLES]);
+        for(int e = 0; e < PERF_EVENTS; e++){
+            if(!perfAvailable((perf_event_id)e))
+                continue;
+            len += snprintf(text + len, sizeof(text) - len, "%.3g %s, ", (double)sw.counters[e], perf_event_name((perf_event_id)e));
+            snprintf(key, sizeof(key), "COUNTERS_%s_%s", kernels[k].name, perf_event_name((perf_event_id)e));
+            metrics.addResult(key, "%llu", (long long unsigned int)sw.counters[e]);
+        }
+        if(perfAvailable(PERF_LLC_MISSES))
+            len += snprintf(text + len, sizeof(text) - len, "%.3g GB/s from memory, ", 64.0*sw.counters[PERF_LLC_MISSES]/sw.elapsed*1e-9);
+        if(len >= 2)
+            text[len - 2] = 0;
+        snprintf(key, sizeof(key), "COUNTERS_%s", kernels[k].name);
+        fprintf(stderr, "%-35s = %s\n", key, text);
+    }
 }
 
 static void help(const char *name)
@@ -516,16 +501,97 @@ static void help(const char *name)
             "\t mu\n\t    Decay constant (float)\n"
             "\t divThreshold\n\t    number of divisions a cell can maximally undergo (relevant only for the first phase of the simulation) (unsigned)\n"
             "\t finalNumberCells\n\t    Number of cells after cells have recursively duplicated (divided) (int64_t)\n"
-            "\t spatialRange\n\t    defines the maximal spatial extend of the clusters. This parameter is only used for computing the energy function and the correctness criterion (float)\n");
+            "\t spatialRange\n\t    defines the maximal spatial extend of the clusters. This parameter is only used for computing the energy function and the correctness criterion (float)\n"
+            "\t The following are optional:\n"
+            "\t tileX, tileY, tileZ\n\t    tile size in voxels of the blocked grid engines (int64_t, default 64, 16, 256)\n"
+            "\t timeTile\n\t    time steps advanced per tile by the temporal grid engine (unsigned, default 4)\n"
+            "\t activeBlock\n\t    edge in voxels of the blocks tracked by the active grid engine (int64_t, default 16)\n"
+            "\t activeEpsilon\n\t    concentration at or below which a block of the active grid engine is dropped to zero;\n"
+            "\t    0 keeps the results exact (float, default 0)\n"
+            "\t seed\n\t    seed of the random movement and division of the cells in phase 1 (uint64_t, default 1)\n"
+            "\t targetN\n\t    approximate number of cells in the subvolume the energy and the criterion are evaluated on,\n"
+            "\t    0 evaluates them on all cells (int64_t, default 10000)\n");
     fprintf(stderr, "OPTIONS\n"
             "\t-h,--help\n\t    print this help message\n"
             "\t-v,--version\n\t    print configuration information\n"
             "\t-q,--quiet\n\t    lower output to stdout. Multiples accepted.\n"
             "\t-v,--verbose\n\t    increase output to stdout. Multiples accepted\n"
-            "\t--<param>=<value>\n\t    override param/value form input file\n");
+            "\t--grid-engine <name>\n\t    how diffusion and decay are computed: 'fused' (default) sweeps the grid once per\n"
+            "\t    time step, 'separate' runs the diffusion and decay kernels one after the other, 'blocked'\n"
+            "\t    sweeps in tiles of tileX x tileY x tileZ voxels and 'temporal' additionally advances\n"
+            "\t    timeTile steps per tile of tileY rows during phase 1; 'active' sweeps only the blocks\n"
+            "\t    of activeBlock^3 voxels that hold substance above activeEpsilon, and their neighbours;\n"
+            "\t    'adi' solves the diffusion implicitly, in three passes of tridiagonal solves along x, y\n"
+            "\t    and z, which is stable for any time step. It also runs the simulation with the fused\n"
+            "\t    engine and reports the difference of FINAL_ENERGY, unless in a sweep or restarted;\n"
+            "\t    the timings then include that engine in phase 1. fp32 storage on one rank only.\n"
+            "\t    'spectral' applies the explicit steps as a multiplier in the cosine basis of the grid,\n"
+            "\t    with a forward and inverse 3D transform per diffusion step whatever its length; it\n"
+            "\t    is compared and restricted like 'adi'. It keeps its partial transforms in double in\n"
+            "\t    the second grid the explicit engines write to, so the engine itself needs no memory\n"
+            "\t    beyond those two fp32 grids of 8 L^3 bytes each.\n"
+            "\t--diffusion-substeps <n>\n\t    time steps of cell movement per diffusion step of the adi and spectral engines\n"
+            "\t    (default 1). The grid is advanced by n steps of diffusion and decay at once, every n\n"
+            "\t    steps, with the production of the steps in between accumulating in it.\n"
+            "\t--gradient-field <mode>\n\t    where the movement along the gradients is computed: 'cell' for every cell, 'voxel' once\n"
+            "\t    per voxel in a sweep over the grid, after which every cell looks up the direction of its\n"
+            "\t    voxel, or 'auto' (default): per voxel from %g cells per voxel on, %g without vector\n"
+            "\t    kernels. The results are the same.\n"
+            "\t--sort-every <K>\n\t    every K time steps of both phases, sorts the cells by the Z-order (Morton) key of their\n"
+            "\t    voxel, so that the production and the gradients access the grid in Z-order. The\n"
+            "\t    results do not change. Default 0: the cells stay in the order they were born.\n"
+            "\t--simd <level>\n\t    widest vector kernels to use: 'auto' (default), 'avx512', 'avx2' or 'scalar'. The\n"
+            "\t    kernels are chosen at run time from what the CPU supports.\n"
+            "\t--grid-precision <format>\n\t    storage of the concentrations: 'fp32' (default), 'fp16' or 'bf16'. The kernels\n"
+            "\t    always compute in fp32; 16-bit storage halves the memory and traffic of the grid.\n"
+            "\t    Not supported by the temporal grid engine.\n"
+            "\t--precision-drift\n\t    with 16-bit storage, also runs the simulation on an fp32 grid and reports the drift\n"
+            "\t    of FINAL_ENERGY. The timings then include the fp32 grid of phase 1.\n"
+            "\t--deterministic, --no-deterministic\n\t    whether results are identical for any number of threads (default on). Without it,\n"
+            "\t    cells that produce into the same voxel at the same time race on its update.\n"
+            "\t--checkpoint-at <phase>:<step>\n\t    writes the state of the run after <step> time steps of 'phase1' or 'phase2' to the\n"
+            "\t    checkpoint file; 'phase2' alone is the end of phase 1. A phase-1 checkpoint is only\n"
+            "\t    written if phase 1 lasts that long. Single rank only.\n"
+            "\t--checkpoint-file <path>\n\t    file the checkpoint is written to (default cell_clustering.ckpt)\n"
+            "\t--restart-from <path>\n\t    continues the run from a checkpoint instead of starting it from one cell. L and the\n"
+            "\t    grid precision must match the checkpointed run; the other parameters, e.g. speed, D\n"
+            "\t    or mu of phase 2, may differ. The seed of phase 1 is taken from the checkpoint.\n"
+            "\t--sweep <file>\n\t    runs phase 1 once, with the parameters of the input file, and then phase 2 once per\n"
+            "\t    line of <file>, with the whitespace-separated <param>=<value> overrides of that line\n"
+            "\t    (e.g. speed, D, mu or T),\n"
+            "\t    in forked processes on disjoint CPUs, and reports the results of all of them.\n"
+            "\t    Lines starting with '#' are skipped. Single rank only.\n"
+            "\t--sweep-jobs <n>\n\t    number of sweep runs at a time (default: one per CPU, at most one per run)\n"
+            "\t--sweep-dir <dir>\n\t    directory of the temporary file phase 1 of a sweep hands its final cells and grid over\n"
+            "\t    in, about the size of a checkpoint (default $TMPDIR, or /tmp). On a tmpfs it is held in\n"
+            "\t    memory next to the grid.\n"
+            "\t--snapshot-every <K>\n\t    every K time steps of both phases, and at their start, appends the positions, ids\n"
+            "\t    and types of the cells to the snapshot file. A background thread compresses and\n"
+            "\t    writes the snapshots; the simulation never waits for it, and drops a snapshot if\n"
+            "\t    %d are still waiting. Single rank only.\n"
+            "\t--snapshot-file <path>\n\t    file the snapshots are appended to (default cell_clustering.snap)\n"
+            "\t--snapshot-grid <f>\n\t    also records the concentrations, averaged over blocks of f^3 voxels (default 0: none).\n"
+            "\t    With the adi and spectral engines K must be a multiple of --diffusion-substeps.\n"
+            "\t--insitu-every <K>\n\t    every K time steps of phase 2 hands a copy of the cells of the subvolume to a pool of\n"
+            "\t    threads, which evaluates energy and criterion while the simulation steps on, and\n"
+            "\t    writes one CSV line per step to the in-situ output. If all threads are busy and %d\n"
+            "\t    copies are waiting, the analysis of the step is dropped. The threads come on top of\n"
+            "\t    the OpenMP threads of the simulation.\n"
+            "\t--insitu-threads <n>\n\t    threads of the in-situ analysis (default 1)\n"
+            "\t--insitu-out <path>\n\t    file the in-situ analyses are written to (default cell_clustering_insitu.csv)\n"
+            "\t--metrics-out <path>\n\t    writes the parameters, the system configuration, the results and per phase the\n"
+            "\t    distribution of the time of every kernel call (min, median, p99, max), the cell and\n"
+            "\t    voxel throughput and the peak memory to <path>, as CSV if it ends in .csv, else JSON\n"
+            "\t--perf\n\t    measures the peak flop rate and memory bandwidth at startup and reports the rates\n"
+            "\t    of every kernel against this roofline, from an analytic count of its flops and bytes.\n"
+            "\t    Where perf_event_open allows, also counts cycles, instructions and last-level cache\n"
+            "\t    misses per kernel.\n"
+            "\t--<param>=<value>\n\t    override param/value form input file\n", GRADIENT_FIELD_DENSITY, GRADIENT_FIELD_DENSITY_SCALAR, SNAPSHOT_BUFFERS, INSITU_PENDING);
 }
 
 int main(int argc, char *argv[]) {
+    initDomain(&argc, &argv);
+
     stopwatch init_sw;
     init_sw.reset();
 
@@ -535,6 +601,29 @@ int main(int argc, char *argv[]) {
         {"version",         no_argument,       0, 'V'},
         {"quiet",           no_argument,       0, 'q'},
         {"verbose",         no_argument,       0, 'v'},
+        {"grid-engine",     required_argument, 0, 'g'},
+        {"simd",            required_argument, 0, 's'},
+        {"grid-precision",  required_argument, 0, 'p'},
+        {"precision-drift", no_argument,       0, 'd'},
+        {"deterministic",    no_argument,      0, 'r'},
+        {"no-deterministic", no_argument,      0, 'R'},
+        {"checkpoint-at",    required_argument, 0, 'c'},
+        {"checkpoint-file",  required_argument, 0, 'C'},
+        {"restart-from",     required_argument, 0, 'x'},
+        {"sweep",            required_argument, 0, 'w'},
+        {"metrics-out",      required_argument, 0, 'm'},
+        {"perf",             no_argument,       0, 'e'},
+        {"sweep-jobs",       required_argument, 0, 'j'},
+        {"sweep-dir",        required_argument, 0, 'D'},
+        {"snapshot-every",   required_argument, 0, 'k'},
+        {"snapshot-file",    required_argument, 0, 'f'},
+        {"snapshot-grid",    required_argument, 0, 'G'},
+        {"insitu-every",     required_argument, 0, 'a'},
+        {"insitu-threads",   required_argument, 0, 't'},
+        {"insitu-out",       required_argument, 0, 'o'},
+        {"diffusion-substeps", required_argument, 0, 'S'},
+        {"sort-every",       required_argument, 0, 'z'},
+        {"gradient-field",   required_argument, 0, 'y'},
         {0, 0, 0, 0},
     };
 
@@ -568,6 +657,89 @@ int main(int argc, char *argv[]) {
         case 'v':
             --quiet;
             break;
+        case 'g':
+            gridEngine = parseGridEngine(optarg);
+            break;
+        case 's':
+            simdLevel = parseSimdLevel(optarg);
+            break;
+        case 'p':
+            gridPrecision = parseGridPrecision(optarg);
+            break;
+        case 'd':
+            reportDrift = true;
+            break;
+        case 'r':
+            deterministic = true;
+            break;
+        case 'R':
+            deterministic = false;
+            break;
+        case 'c':
+            parseCheckpointAt(optarg);
+            break;
+        case 'C':
+            checkpointFile = optarg;
+            break;
+        case 'x':
+            restartFile = optarg;
+            break;
+        case 'm':
+            metricsFile = optarg;
+            break;
+        case 'e':
+            perfReport = true;
+            break;
+        case 'w':
+            sweepFile = optarg;
+            break;
+        case 'j':
+            sweepJobs = atoi(optarg);
+            if(sweepJobs < 1)
+                die("Invalid number of sweep jobs %s!\n", optarg);
+            break;
+        case 'D':
+            sweepDir = optarg;
+            break;
+        case 'k':
+            snapshotEvery = atoll(optarg);
+            if(snapshotEvery < 1)
+                die("Invalid snapshot interval %s!\n", optarg);
+            break;
+        case 'f':
+            snapshotFile = optarg;
+            break;
+        case 'G':
+            snapshotGrid = atoll(optarg);
+            if(snapshotGrid < 0)
+                die("Invalid snapshot grid factor %s!\n", optarg);
+            break;
+        case 'a':
+            insituEvery = atoll(optarg);
+            if(insituEvery < 1)
+                die("Invalid in-situ analysis interval %s!\n", optarg);
+            break;
+        case 't':
+            insituThreads = atoi(optarg);
+            if(insituThreads < 1)
+                die("Invalid number of in-situ analysis threads %s!\n", optarg);
+            break;
+        case 'o':
+            insituFile = optarg;
+            break;
+        case 'S':
+            diffusionSubsteps = atoll(optarg);
+            if(diffusionSubsteps < 1)
+                die("Invalid number of diffusion substeps %s!\n", optarg);
+            break;
+        case 'y':
+            gradientField = parseGradientField(optarg);
+            break;
+        case 'z':
+            sortEvery = atoll(optarg);
+            if(sortEvery < 0)
+                die("Invalid sort interval %s!\n", optarg);
+            break;
         default:
             usage(argv[0]);
         case -1:
@@ -579,6 +751,13 @@ int main(int argc, char *argv[]) {
     if(optind+1 < argc)
         usage(argv[0]);
 
+    // libgomp cannot start threads in a child forked after the parent ran parallel regions with
+    // several threads, so a sweep keeps this process on one thread and runs phase 1 in a child
+    if(sweepFile){
+        sweepPhase1Threads = omp_get_max_threads();
+        omp_set_num_threads(1);
+    }
+
     fprintf(stderr, "==================================================\n");
 
     print_sys_config(stderr);
@@ -587,196 +766,411 @@ int main(int argc, char *argv[]) {
 
     print_params(&params, stderr);
 
-    const float    speed            = params.speed;
-    const int64_t  T                = params.T;
+    fprintf(stderr, "%-35s = %s\n", "SIMD_KERNELS", simd_level_name(selectDiffusionKernels(simdLevel)));
+    if(selectDiffusionKernels(simdLevel) == SIMD_SCALAR)
+        gradientFieldDensity = GRADIENT_FIELD_DENSITY_SCALAR;
+    fprintf(stderr, "%-35s = %s\n", "GRID_PRECISION", grid_precision_name(gridPrecision));
+    fprintf(stderr, "%-35s = %d\n", "DETERMINISTIC", deterministic);
+
+    roofline roof;
+    if(perfReport){
+        stopwatch roofline_sw;
+        roofline_sw.reset();
+        roof = measureRoofline(selectDiffusionKernels(simdLevel));
+        roofline_sw.mark();
+        fprintf(stderr, "%-35s = %le s\n", "ROOFLINE_TIME", roofline_sw.elapsed);
+
+        const int events = perfOpen();
+        fprintf(stderr, "%-35s = %d of %d\n", "PERF_COUNTERS", events, (int)PERF_EVENTS);
+    }
+
+    if(gridPrecision != GRID_FP32 && (gridEngine == GRID_ENGINE_TEMPORAL || multiStepEngine(gridEngine)))
+        die("The %s grid engine needs fp32 storage!\n", gridEngine == GRID_ENGINE_TEMPORAL ? "temporal" :
+            gridEngine == GRID_ENGINE_ADI ? "adi" : "spectral");
+    if(diffusionSubsteps > 1 && !multiStepEngine(gridEngine))
+        die("Diffusion substeps need the adi or spectral grid engine!\n");
+    if(gridPrecision == GRID_FP32)
+        reportDrift = false;
+
+    domain = makeDomain(params.L);
+    fprintf(stderr, "%-35s = %d\n", "MPI_RANKS", domain.ranks);
+    if(domain.ranks > 1 && (gridEngine == GRID_ENGINE_TEMPORAL || gridEngine == GRID_ENGINE_ACTIVE || multiStepEngine(gridEngine)))
+        die("The %s grid engine runs on a single rank only!\n",
+            gridEngine == GRID_ENGINE_TEMPORAL ? "temporal" : gridEngine == GRID_ENGINE_ACTIVE ? "active" :
+            gridEngine == GRID_ENGINE_ADI ? "adi" : "spectral");
+    if(domain.ranks > 1 && (checkpointPhase || restartFile))
+        die("Checkpoints are only written and read by a single rank!\n");
+    if(restartFile && reportDrift)
+        die("The precision drift cannot be measured on a restarted run!\n");
+    if(sweepFile && (domain.ranks > 1 || reportDrift || checkpointPhase == 2 || metricsFile))
+        die("A sweep runs on a single rank, without --precision-drift, --metrics-out and phase-2 checkpoints!\n");
+    if(snapshotEvery && (domain.ranks > 1 || sweepFile))
+        die("Snapshots are only written by a single rank and not in a sweep!\n");
+    if(snapshotEvery && snapshotGrid && multiStepEngine(gridEngine) && snapshotEvery % diffusionSubsteps)
+        die("Snapshots of the grid need --snapshot-every to be a multiple of --diffusion-substeps!\n");
+    if(insituEvery && sweepFile)
+        die("There is no in-situ analysis in a sweep!\n");
+    // the adi and spectral engines are compared against the explicit one, unless the run is a sweep or restarted
+    if(multiStepEngine(gridEngine) && !sweepFile && !restartFile)
+        reportDrift = true;
+    vector<sweep_run> sweepRuns;
+    if(sweepFile)
+        sweepRuns = readSweep(sweepFile, params);
+    if(checkpointPhase == 2 && checkpointStep > params.T)
+        die("Phase 2 has only %lld steps, no checkpoint after %lld!\n", (long long int)params.T, (long long int)checkpointStep);
+
     const int64_t  L                = params.L;
-    const float    D                = params.D;
-    const float    mu               = params.mu;
     const unsigned divThreshold     = params.divThreshold;
     const int64_t  finalNumberCells = params.finalNumberCells;
     const float    spatialRange     = params.spatialRange;
     const float    pathThreshold    = params.pathThreshold;
 
-    int i,c;
-    int i1, i2, i3, i4;
-
-    float energy;   // value that quantifies the quality of the cell clustering output. The smaller this value, the better the clustering.
+    int i1;
 
-    float** posAll=0;   // array of all 3 dimensional cell positions
-    posAll = new float*[finalNumberCells];
-    float** currMov=0;  // array of all 3 dimensional cell movements at the last time point
-    currMov = new float*[finalNumberCells]; // array of all cell movements in the last time step
+    // positions, movements, types, divisions and path traveled of the cells of this rank; with
+    // several ranks the store starts at an even share and grows when cells migrate into the slab
+    CellStore cells(domain.ranks > 1 ? finalNumberCells/domain.ranks + 1024 : finalNumberCells);
     float zeroFloat = 0.0;
 
-    float pathTraveled[finalNumberCells];   // array keeping track of length of path traveled until cell divides
-    int numberDivisions[finalNumberCells];  //array keeping track of number of division a cell has undergone
-    int typesAll[finalNumberCells];     // array specifying cell type (+1 or -1)
-
-    numberDivisions[0]=0;   // the first cell has initially undergone 0 duplications (= divisions)
-    typesAll[0]=1;  // the first cell is of type 1
-
-    bool currCriterion;
-
     // Initialization of the various arrays
 #pragma ivdep
 #pragma omp parallel for
-    for(i1 = 0; i1 < finalNumberCells; i1++){
-        currMov[i1] = new float[3];
-        posAll[i1] = new float[3];
-        pathTraveled[i1] = zeroFloat;
-        pathTraveled[i1] = 0;
-
-	currMov[i1][0] = zeroFloat;
-	currMov[i1][1] = zeroFloat;
-
-	posAll[i1][0] = 0.5;
-	posAll[i1][1] = 0.5;
+    for(i1 = 0; i1 < cells.capacity; i1++){
+        cells.x[i1]         = 0.5;
+        cells.y[i1]         = 0.5;
+        cells.z[i1]         = 0.5;
+        cells.movX[i1]      = zeroFloat;
+        cells.movY[i1]      = zeroFloat;
+        cells.movZ[i1]      = zeroFloat;
+        cells.path[i1]      = zeroFloat;
+        cells.type[i1]      = 0;
+        cells.divisions[i1] = 0;
+        cells.id[i1]        = 0;
     }
 
-    // create 3D concentration matrix
-    float**** Conc;
-    Conc = new float***[L];
-
-    Conc[0] = new float**[L];
-    Conc[1] = new float**[L];
-
-    float ***Conc0 = Conc[0];
-    float ***Conc1 = Conc[1];
+    cells.divisions[0] = 0; // the first cell has initially undergone 0 duplications (= divisions)
+    cells.type[0]      = 1; // the first cell is of type 1
+
+    // create 3D concentration matrix, of the slab of this rank
+    ConcentrationGrid Conc(L, gridPrecision, domain.firstPlane, domain.planes());
+    ConcentrationGrid nextConc(L, gridPrecision, domain.firstPlane, domain.planes()); // buffer the diffusion stencil writes to before it is swapped with Conc
+    Conc.setNeighbours(domain.lower(), domain.upper());
+    nextConc.setNeighbours(domain.lower(), domain.upper());
+    if(gridEngine == GRID_ENGINE_SPECTRAL)
+        spectral = new SpectralPropagator(L);
+
+    // fp32 grids of the reference run that the drift of 16-bit storage is measured against
+    ConcentrationGrid *refConc     = reportDrift ? new ConcentrationGrid(L, GRID_FP32, domain.firstPlane, domain.planes()) : 0;
+    ConcentrationGrid *refNextConc = reportDrift ? new ConcentrationGrid(L, GRID_FP32, domain.firstPlane, domain.planes()) : 0;
+    if(reportDrift){
+        refConc->setNeighbours(domain.lower(), domain.upper());
+        refNextConc->setNeighbours(domain.lower(), domain.upper());
+    }
 
-    float **Conc0_x, *Conc0_xy;
-    float **Conc1_x, *Conc1_xy;
+    // initially, there is one single cell, held by the rank owning its voxel
+    int64_t n = domain.owner(voxelOf(cells.x[0], 1/(float)L, L-1)) == domain.rank;
+
+    // position of the run: the seed and time step of phase 1 key its random numbers
+    checkpoint_state position;
+    position.seed        = params.seed;
+    position.phase       = 1;
+    position.phase1Steps = 0;
+    position.phase2Steps = 0;
+    position.n           = n;
+
+    if(restartFile){
+        position = readCheckpoint(restartFile, cells, Conc);
+        n        = position.n;
+        fprintf(stderr, "%-35s = %s\n", "RESTART_FROM", restartFile);
+        fprintf(stderr, "%-35s = %d\n", "RESTART_PHASE", position.phase);
+        fprintf(stderr, "%-35s = %lld\n", "RESTART_STEP", (long long int)(position.phase == 1 ? position.phase1Steps : position.phase2Steps));
+        if(position.seed != params.seed)
+            fprintf(stderr, "%-35s = %llu\n", "RESTART_SEED", (unsigned long long int)position.seed);
+        if(position.phase == 2 && position.phase2Steps > params.T)
+            die("The checkpoint is after step %lld of phase 2, which has only %lld steps!\n",
+                (long long int)position.phase2Steps, (long long int)params.T);
+    }
 
-#pragma ivdep
-#pragma omp parallel for
-    for(i2 = 0; i2 < L; i2++){
-      Conc0[i2] = new float*[L];
-      Conc1[i2] = new float*[L];
-
-      Conc0_x = Conc0[i2];
-      Conc1_x = Conc1[i2];
-
-      for(i3 = 0; i3 < L; i3++){
-	Conc0_x[i3] = new float[L];
-	Conc1_x[i3] = new float[L];
-	
-	Conc0_xy = Conc0_x[i3];
-	Conc1_xy = Conc1_x[i3];
-
-	for(i4 = 0; i4 < L; i4++){
-	  Conc0_xy[i4] = zeroFloat;
-	  Conc1_xy[i4] = zeroFloat;
-	}
-      }
+    if(gridEngine == GRID_ENGINE_ACTIVE){
+        Conc.trackActiveBlocks(params.activeBlock);
+        if(refConc)
+            refConc->trackActiveBlocks(params.activeBlock);
     }
 
+    if(snapshotEvery)
+        snapshots = new SnapshotWriter(snapshotFile, snapshotGrid, SNAPSHOT_BUFFERS);
+    if(insituEvery && domain.root())
+        insitu = new InsituPool(insituThreads, INSITU_PENDING, analyzeInsitu, (void*)&spatialRange, insituFile);
 
-    
     init_sw.mark();
     fprintf(stderr, "%-35s = %le s\n",  "INITIALIZATION_TIME", init_sw.elapsed);
 
     stopwatch compute_sw;
     compute_sw.reset();
 
+    for(size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++)
+        metrics.addKernel(kernels[k].name, kernels[k].sw);
+
     stopwatch phase1_sw;
     phase1_sw.reset();
+    metrics.beginPhase("phase1");
+
+    // a sweep runs phase 1 with all threads in a child, which hands its final state back as a checkpoint
+    pid_t phase1Child = -1;
+    char sweepState[PATH_MAX];
+    if(sweepFile && position.phase == 1){
+        const char *dir = sweepDir ? sweepDir : getenv("TMPDIR");
+        snprintf(sweepState, sizeof(sweepState), "%s/cell_clustering_sweep_XXXXXX", dir && *dir ? dir : "/tmp");
+        const int fd = mkstemp(sweepState);
+        if(fd < 0)
+            die("Could not create %s: %s\n", sweepState, strerror(errno));
+        close(fd);
+
+        fflush(stdout);
+        fflush(stderr);
+        phase1Child = fork();
+        if(phase1Child < 0)
+            die("Could not fork phase 1: %s\n", strerror(errno));
+        if(phase1Child > 0){
+            int status;
+            if(waitpid(phase1Child, &status, 0) != phase1Child || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+                die("Phase 1 failed!\n");
+            position = readCheckpoint(sweepState, cells, Conc);
+            n        = position.n;
+            unlink(sweepState);
+        }
+        else
+            omp_set_num_threads(sweepPhase1Threads);
+    }
 
-    int64_t n = 1; // initially, there is one single cell
+    const uint64_t seed = position.seed;
+    int64_t step = position.phase1Steps; // time step of phase 1, part of the key of the random numbers
 
     // Phase 1: Cells move randomly and divide until final number of cells is reached
-    while (n<finalNumberCells){
-        produceSubstances(Conc, posAll, typesAll, L, n); // Cells produce substances. Depending on the cell type, one of the two substances is produced.
-        runDiffusionStep(Conc, L, D); // Simulation of substance diffusion
-        runDecayStep(Conc, L, mu);
-        n = cellMovementAndDuplication(posAll, pathTraveled, typesAll, numberDivisions, pathThreshold, divThreshold, n);
-
-	//c=n;
-#pragma ivdep
-#pragma omp parallel for
-        for(c=n;c>0;--c){
-            // boundary conditions
-	    if(posAll[c][0]<0)      posAll[c][0]=0;
-	    else if(posAll[c][0]>1) posAll[c][0]=1;
-
-	    if(posAll[c][1]<0)      posAll[c][1]=0;
-	    else if(posAll[c][1]>1) posAll[c][1]=1;
+    ProductionBatch batch(L, params.timeTile);
+    if(position.phase == 1 && !restartFile)
+        takeSnapshot(1, step, cells, n, Conc);
+    while (position.phase == 1 && sumOverRanks(n)<finalNumberCells){
+        step_sw.reset();
+        if(gridEngine == GRID_ENGINE_TEMPORAL){
+            // The random movement does not depend on the substances, so the production of up to
+            // timeTile steps is recorded first and the grid is then advanced by all of them at once.
+            recordProduction(batch, cells, n);
+            n = cellMovementAndDuplication(cells, pathThreshold, divThreshold, n, seed, step++);
+            clampToUnitCube(cells, n);
+            if(batch.steps() == batch.maxSteps() || n >= finalNumberCells || (checkpointPhase == 1 && step == checkpointStep) ||
+               (snapshots && snapshotGrid && step % snapshotEvery == 0))
+                runTemporalDiffusionDecayStep(Conc, nextConc, batch, params);
+        }
+        else{
+            produceSubstances(Conc, cells, L, n); // Cells produce substances. Depending on the cell type, one of the two substances is produced.
+            updateGrid(Conc, nextConc, params, gridEngine, step + 1); // Simulation of substance diffusion and decay
+            if(refConc){
+                produceSubstances(*refConc, cells, L, n);
+                updateGrid(*refConc, *refNextConc, params, referenceEngine(), step + 1);
+            }
+            cells.reserve(std::min(2*n, finalNumberCells), n); // every cell divides at most once per step
+            n = cellMovementAndDuplication(cells, pathThreshold, divThreshold, n, seed, step++);
+            clampToUnitCube(cells, n);
+            n = migrateCells(cells, n, domain);
+        }
+        sortCells(cells, n, L, step);
+        step_sw.mark();
 
-	    if(posAll[c][2]<0)      posAll[c][2]=0;
-	    else if(posAll[c][2]>1) posAll[c][2]=1;
-	}
+        if(checkpointPhase == 1 && step == checkpointStep){
+            position.phase1Steps = step;
+            position.n           = n;
+            saveCheckpoint(cells, Conc, position);
+        }
+        takeSnapshot(1, step, cells, n, Conc);
+    }
+    if(position.phase == 1 && multiStepEngine(gridEngine) && step % diffusionSubsteps) // phase 2 starts from a grid without pending production
+        runMultiStepDiffusionDecayStep(Conc, nextConc, params, gridEngine, step % diffusionSubsteps);
+    position.phase1Steps = step;
+    if(phase1Child == 0){
+        position.phase       = 2;
+        position.phase2Steps = 0;
+        position.n           = n;
+        writeCheckpoint(sweepState, cells, Conc, position);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
     }
     phase1_sw.mark();
     fprintf(stderr, "%-35s = %le s\n",  "PHASE1_TIME", phase1_sw.elapsed);
+    metrics.endPhase(phase1_sw.elapsed, cellUpdates, voxelUpdates);
+    const int64_t phase1CellUpdates  = cellUpdates;
+    const int64_t phase1VoxelUpdates = voxelUpdates;
 
     stopwatch phase2_sw;
     phase2_sw.reset();
+    metrics.beginPhase("phase2");
 
 
     // Phase 2: Cells move along the substance gradients and cluster
-    energy = getEnergy(posAll, typesAll, n, spatialRange, 10000);
-    currCriterion = getCriterion(posAll, typesAll, n, spatialRange, 10000);
-    fprintf(stderr, "%-35s = %d\n",  "INITIAL_CRITERION", currCriterion);
-    fprintf(stderr, "%-35s = %le\n", "INITIAL_ENERGY", energy);
-
-    i = T;
-//#pragma omp parallel for collapse(2)
-#pragma ivdep
-    while(i--){
+    cluster_stats stats = analyzeClustering(cells, n, spatialRange, params.targetN);
+    fprintf(stderr, "%-35s = %d\n",  "INITIAL_CRITERION", stats.criterion);
+    fprintf(stderr, "%-35s = %le\n", "INITIAL_ENERGY", stats.energy);
+
+    // the phase-2 cells of the reference run start from the same state
+    CellStore *refCells = 0;
+    int64_t nRef = n;
+    if(reportDrift){
+        refCells = new CellStore(n);
+        memcpy(refCells->x,    cells.x,    n*sizeof(float));
+        memcpy(refCells->y,    cells.y,    n*sizeof(float));
+        memcpy(refCells->z,    cells.z,    n*sizeof(float));
+        memcpy(refCells->movX, cells.movX, n*sizeof(float));
+        memcpy(refCells->movY, cells.movY, n*sizeof(float));
+        memcpy(refCells->movZ, cells.movZ, n*sizeof(float));
+        memcpy(refCells->type, cells.type, n*sizeof(int));
+        memcpy(refCells->id,   cells.id,   n*sizeof(uint32_t));
+    }
 
-        if ((i%10) == 0) {
-            if(quiet < 1) {
-                printf("step %d\n", i);
-            }
-            else if(quiet < 2) {
-                printf("\rstep %d", i);
-                fflush(stdout);
+    if(sweepFile){
+        // Every run branches from the state of phase 1 in a child process of its own
+        stopwatch sweep_sw;
+        sweep_sw.reset();
+
+        sweep_context ctx;
+        ctx.Conc      = &Conc;
+        ctx.nextConc  = &nextConc;
+        ctx.cells     = &cells;
+        ctx.n         = n;
+        ctx.firstStep = position.phase == 2 ? position.phase2Steps : 0;
+
+        const int jobs = sweepJobs ? sweepJobs : std::min((int)sweepRuns.size(), availableCpus());
+        vector<sweep_result> results;
+        vector<string> cpus;
+        forkSweep(sweepRuns, jobs, runSweepChild, &ctx, results, cpus);
+        sweep_sw.mark();
+
+        fprintf(stderr, "%-35s = %lld\n", "SWEEP_RUNS", (long long int)sweepRuns.size());
+        fprintf(stderr, "%-35s = %d\n", "SWEEP_JOBS", jobs);
+        for(size_t r = 0; r < sweepRuns.size(); r++){
+            char key[64];
+            snprintf(key, sizeof(key), "SWEEP_%zu_PARAMS", r);
+            fprintf(stderr, "%-35s = %s\n", key, sweepRuns[r].overrides.c_str());
+            snprintf(key, sizeof(key), "SWEEP_%zu_CPUS", r);
+            fprintf(stderr, "%-35s = %s\n", key, cpus[r].c_str());
+            if(results[r].status != 0){
+                snprintf(key, sizeof(key), "SWEEP_%zu_STATUS", r);
+                fprintf(stderr, "%-35s = failed\n", key);
+                continue;
             }
+            snprintf(key, sizeof(key), "SWEEP_%zu_FINAL_CRITERION", r);
+            fprintf(stderr, "%-35s = %d\n", key, results[r].criterion);
+            snprintf(key, sizeof(key), "SWEEP_%zu_FINAL_ENERGY", r);
+            fprintf(stderr, "%-35s = %le\n", key, results[r].energy);
+            snprintf(key, sizeof(key), "SWEEP_%zu_FINAL_SUBVOLUME_CELLS", r);
+            fprintf(stderr, "%-35s = %lld\n", key, (long long int)results[r].nrCellsSubVol);
+            snprintf(key, sizeof(key), "SWEEP_%zu_PHASE2_TIME", r);
+            fprintf(stderr, "%-35s = %le s\n", key, results[r].phase2Time);
         }
+        fprintf(stderr, "%-35s = %le s\n", "SWEEP_TIME", sweep_sw.elapsed);
+        fprintf(stderr, "==================================================\n");
 
-        if(quiet == 1) printf("\n");
-
-        produceSubstances(Conc, posAll, typesAll, L, n);
-        runDiffusionStep(Conc, L, D);
-        runDecayStep(Conc, L, mu);
-        runDiffusionClusterStep(Conc, currMov, posAll, typesAll, n, L, speed);
-
-	c=n;
-        while(c--){
-            posAll[c][0] = posAll[c][0]+currMov[c][0];
-            posAll[c][1] = posAll[c][1]+currMov[c][1];
-            posAll[c][2] = posAll[c][2]+currMov[c][2];
-
-            // boundary conditions: cells can not move out of the cube [0,1]^3
-	    if(posAll[c][0]<0)      posAll[c][0]=0;
-	    else if(posAll[c][0]>1) posAll[c][0]=1;
-
-	    if(posAll[c][1]<0)      posAll[c][1]=0;
-	    else if(posAll[c][1]>1) posAll[c][1]=1;
-
-	    if(posAll[c][2]<0)      posAll[c][2]=0;
-	    else if(posAll[c][2]>1) posAll[c][2]=1;
-	}
+        finalizeDomain();
+        return 0;
     }
 
-    energy = getEnergy(posAll, typesAll, n, spatialRange, 10000);
-    currCriterion = getCriterion(posAll, typesAll, n, spatialRange, 10000);
-    fprintf(stderr, "%-35s = %d\n",  "FINAL_CRITERION", currCriterion);
-    fprintf(stderr, "%-35s = %le\n", "FINAL_ENERGY", energy);
+    n = runPhase2(Conc, nextConc, cells, n, params, gridEngine, true, position.phase == 2 ? position.phase2Steps : 0, &position);
+
+    stats = analyzeClustering(cells, n, spatialRange, params.targetN);
+    fprintf(stderr, "%-35s = %d\n",  "FINAL_CRITERION", stats.criterion);
+    fprintf(stderr, "%-35s = %le\n", "FINAL_ENERGY", stats.energy);
+    fprintf(stderr, "%-35s = %lld\n", "FINAL_SUBVOLUME_CELLS", (long long int)stats.nrCellsSubVol);
+    fprintf(stderr, "%-35s = %lld\n", "FINAL_CLOSE_PAIRS", (long long int)stats.nrClose);
+    fprintf(stderr, "%-35s = %le\n", "FINAL_CORRECTNESS", stats.correctness);
+    fprintf(stderr, "%-35s = %le\n", "FINAL_AVG_NEIGHBORS", stats.avgNeighbors);
 
     phase2_sw.mark();
     compute_sw.mark();
     fprintf(stderr, "%-35s = %le s\n",  "PHASE2_TIME", phase2_sw.elapsed);
+    metrics.endPhase(phase2_sw.elapsed, cellUpdates - phase1CellUpdates, voxelUpdates - phase1VoxelUpdates);
 
 
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "produceSubstances_TIME",          produceSubstances_sw.elapsed, produceSubstances_sw.elapsed*100.0f/compute_sw.elapsed);
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "runDiffusionStep_TIME",           runDiffusionStep_sw.elapsed, runDiffusionStep_sw.elapsed*100.0f/compute_sw.elapsed);
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "runDecayStep_TIME",               runDecayStep_sw.elapsed, runDecayStep_sw.elapsed*100.0f/compute_sw.elapsed);
+    fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "runDiffusionDecayStep_TIME",      runDiffusionDecayStep_sw.elapsed, runDiffusionDecayStep_sw.elapsed*100.0f/compute_sw.elapsed);
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "cellMovementAndDuplication_TIME", cellMovementAndDuplication_sw.elapsed, cellMovementAndDuplication_sw.elapsed*100.0f/compute_sw.elapsed);
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "runDiffusionClusterStep_TIME",    runDiffusionClusterStep_sw.elapsed, runDiffusionClusterStep_sw.elapsed*100.0f/compute_sw.elapsed);
-    fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "getEnergy_TIME",                  getEnergy_sw.elapsed, getEnergy_sw.elapsed*100.0f/compute_sw.elapsed);
-    fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "getCriterion_TIME",               getCriterion_sw.elapsed, getCriterion_sw.elapsed*100.0f/compute_sw.elapsed);
+    fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "analyzeClustering_TIME",          analyzeClustering_sw.elapsed, analyzeClustering_sw.elapsed*100.0f/compute_sw.elapsed);
+    fprintf(stderr, "%-35s = %s, per voxel in %lld calls\n", "GRADIENT_FIELD",
+            gradientField == GRADIENT_FIELD_AUTO ? "auto" : gradientField == GRADIENT_FIELD_CELL ? "cell" : "voxel",
+            (long long int)gradientFieldCalls);
+    if(sortEvery)
+        fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "sortCells_TIME",              sortCells_sw.elapsed, sortCells_sw.elapsed*100.0f/compute_sw.elapsed);
+    if(const ActiveBlocks *active = Conc.activeBlocks())
+        fprintf(stderr, "%-35s = %le\n", "ACTIVE_BLOCK_FRACTION", active->sweeps ? active->steppedBlocks/((double)active->sweeps*active->numBlocks()) : 0.0);
     fprintf(stderr, "%-35s = %le s (%3.2f %%)\n", "TOTAL_COMPUTE_TIME",              compute_sw.elapsed, compute_sw.elapsed*100.0f/compute_sw.elapsed);
+    if(checkpointPhase && !checkpointWritten)
+        fprintf(stderr, "%-35s = not reached, phase 1 ended after %lld steps\n", "CHECKPOINT", (long long int)position.phase1Steps);
+    if(perfReport)
+        reportRoofline(roof);
+    if(insitu){
+        stopwatch drain_sw;
+        drain_sw.reset();
+        insitu->drain();
+        drain_sw.mark();
+        fprintf(stderr, "%-35s = %s\n", "INSITU_OUT", insituFile);
+        fprintf(stderr, "%-35s = %lld done, %lld dropped\n", "INSITU_ANALYSES", (long long int)insitu->completed(), (long long int)insitu->dropped());
+        fprintf(stderr, "%-35s = %le s\n", "INSITU_HANDOFF_TIME", insitu_sw.elapsed);
+        fprintf(stderr, "%-35s = %le s\n", "INSITU_MAX_LATENCY", insitu->maxLatency());
+        fprintf(stderr, "%-35s = %le s\n", "INSITU_DRAIN_TIME", drain_sw.elapsed);
+        delete insitu;
+        insitu = 0;
+    }
+    if(snapshots){
+        snapshots->flush();
+        fprintf(stderr, "%-35s = %s\n", "SNAPSHOT_FILE", snapshotFile);
+        fprintf(stderr, "%-35s = %lld written, %lld dropped\n", "SNAPSHOTS", (long long int)snapshots->written(), (long long int)snapshots->dropped());
+        fprintf(stderr, "%-35s = %llu of %llu (%.2f)\n", "SNAPSHOT_BYTES", (unsigned long long int)snapshots->fileBytes(),
+                (unsigned long long int)snapshots->rawBytes(), snapshots->rawBytes() ? snapshots->fileBytes()/(double)snapshots->rawBytes() : 0.0);
+        fprintf(stderr, "%-35s = %le s\n", "SNAPSHOT_CAPTURE_TIME", snapshots->captureTime());
+        fprintf(stderr, "%-35s = %d\n", "SNAPSHOT_PINNED", snapshots->pinned());
+        delete snapshots;
+        snapshots = 0;
+    }
+
+    if(reportDrift){
+        // the same phase 2 on the fp32 grid with the explicit engine; its timings are not part of the report above
+        nRef = runPhase2(*refConc, *refNextConc, *refCells, nRef, params, referenceEngine(), false, 0, 0);
+        const cluster_stats ref = analyzeClustering(*refCells, nRef, spatialRange, params.targetN);
+        const bool adi = multiStepEngine(gridEngine);
+        fprintf(stderr, "%-35s = %d\n",  adi ? "EXPLICIT_FINAL_CRITERION" : "FP32_FINAL_CRITERION", ref.criterion);
+        fprintf(stderr, "%-35s = %le\n", adi ? "EXPLICIT_FINAL_ENERGY" : "FP32_FINAL_ENERGY", ref.energy);
+        fprintf(stderr, "%-35s = %le\n", adi ? "FINAL_ENERGY_DIFF" : "FINAL_ENERGY_DRIFT", stats.energy - ref.energy);
+        fprintf(stderr, "%-35s = %le\n", adi ? "FINAL_ENERGY_REL_DIFF" : "FINAL_ENERGY_REL_DRIFT",
+                ref.energy != 0 ? fabs((stats.energy - ref.energy)/ref.energy) : 0.0);
+
+        delete refCells;
+        delete refConc;
+        delete refNextConc;
+    }
+
+    if(metricsFile && domain.root()){
+        metrics.setSystem(sys_config());
+        metrics.setParams(params_config(&params));
+        metrics.addResult("SIMD_KERNELS", "%s", simd_level_name(selectDiffusionKernels(simdLevel)));
+        metrics.addResult("GRID_PRECISION", "%s", grid_precision_name(gridPrecision));
+        metrics.addResult("DETERMINISTIC", "%d", deterministic);
+        metrics.addResult("MPI_RANKS", "%d", domain.ranks);
+        metrics.addResult("OMP_MAX_THREADS", "%d", omp_get_max_threads());
+        metrics.addResult("INITIALIZATION_TIME", "%le", init_sw.elapsed);
+        metrics.addResult("FINAL_CRITERION", "%d", stats.criterion);
+        metrics.addResult("FINAL_ENERGY", "%le", stats.energy);
+        metrics.addResult("FINAL_SUBVOLUME_CELLS", "%lld", (long long int)stats.nrCellsSubVol);
+        metrics.addResult("TOTAL_COMPUTE_TIME", "%le", compute_sw.elapsed);
+        metrics.write(metricsFile);
+        fprintf(stderr, "%-35s = %s\n", "METRICS_OUT", metricsFile);
+    }
+
+    delete spectral;
+    spectral = 0;
 
     fprintf(stderr, "==================================================\n");
 
+    finalizeDomain();
     return 0;
 }
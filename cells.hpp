@@ -0,0 +1,129 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "util.hpp"
+
+static const size_t CELL_ALIGN = 64; // alignment (in bytes) of every per-cell array
+
+// Structure-of-arrays store for all cells of the simulation. Each per-cell
+// quantity lives in its own cache-line-aligned array, so loops over cells are
+// unit-stride. All arrays are carved from a single heap block sized for
+// 'capacity' cells; the contents are left uninitialized so that the caller
+// can first-touch them in parallel.
+struct CellStore
+{
+    explicit CellStore(int64_t cap)
+    {
+        capacity = cap;
+        block    = carve(capacity);
+    }
+
+    ~CellStore()
+    {
+        free(block);
+    }
+
+    // grows the store to hold at least cap cells, keeping the first n
+    void reserve(int64_t cap, int64_t n)
+    {
+        if(cap <= capacity)
+            return;
+
+        float *ox = x, *oy = y, *oz = z, *omx = movX, *omy = movY, *omz = movZ, *opath = path;
+        int *otype = type, *odiv = divisions;
+        uint32_t *oid = id;
+        char *old = block;
+
+        capacity = cap;
+        block    = carve(capacity);
+
+        memcpy(x,         ox,    n*sizeof(float));
+        memcpy(y,         oy,    n*sizeof(float));
+        memcpy(z,         oz,    n*sizeof(float));
+        memcpy(movX,      omx,   n*sizeof(float));
+        memcpy(movY,      omy,   n*sizeof(float));
+        memcpy(movZ,      omz,   n*sizeof(float));
+        memcpy(path,      opath, n*sizeof(float));
+        memcpy(type,      otype, n*sizeof(int));
+        memcpy(divisions, odiv,  n*sizeof(int));
+        memcpy(id,        oid,   n*sizeof(uint32_t));
+        free(old);
+    }
+
+    static size_t padded(size_t bytes)
+    {
+        return (bytes + CELL_ALIGN - 1) & ~(CELL_ALIGN - 1);
+    }
+
+    int64_t capacity;
+
+    float *x;         // positions in the unit cube
+    float *y;
+    float *z;
+    float *movX;      // movement of the cell in the last time step
+    float *movY;
+    float *movZ;
+    float *path;      // length of path traveled since the last division
+    int   *type;      // cell type (+1 or -1)
+    int   *divisions; // number of divisions the cell has undergone
+    uint32_t *id;     // lineage of the cell: a daughter born at the d-th division of its mother
+                      // gets the id of the mother with bit d-1 set, so ids are unique and do not
+                      // depend on where a cell is stored
+
+private:
+    CellStore(const CellStore &);
+    CellStore &operator=(const CellStore &);
+
+    // allocates a block for cap cells and points the arrays into it
+    char *carve(int64_t cap)
+    {
+        const size_t stride = padded(cap*sizeof(float));
+        char *b = (char*)alloc_aligned(10*stride, CELL_ALIGN);
+
+        x         = (float*)(b + 0*stride);
+        y         = (float*)(b + 1*stride);
+        z         = (float*)(b + 2*stride);
+        movX      = (float*)(b + 3*stride);
+        movY      = (float*)(b + 4*stride);
+        movZ      = (float*)(b + 5*stride);
+        path      = (float*)(b + 6*stride);
+        type      = (int*)  (b + 7*stride);
+        divisions = (int*)  (b + 8*stride);
+        id        = (uint32_t*)(b + 9*stride);
+        return b;
+    }
+
+    char *block;
+};
@@ -0,0 +1,141 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#include "cellsort.hpp"
+
+using namespace std;
+
+static const int RADIX_BITS = 8;
+static const int RADIX      = 1 << RADIX_BITS;
+
+double sortCellsByMorton(CellStore &cells, int64_t n, int64_t L)
+{
+    if(n < 2)
+        return 0;
+
+    int bits = 0; // per coordinate
+    while((int64_t(1) << bits) < L)
+        bits++;
+    const int passes = (3*bits + RADIX_BITS - 1)/RADIX_BITS;
+
+    static vector<uint64_t> key[2];
+    static vector<uint32_t> order[2]; // index of the cell that goes to each position
+    static vector<uint32_t> scratch;
+    for(int b = 0; b < 2; b++){
+        if((int64_t)key[b].size() < n){
+            key[b].resize(n);
+            order[b].resize(n);
+        }
+    }
+    if((int64_t)scratch.size() < n)
+        scratch.resize(n);
+    static vector<int64_t> count; // per thread and digit
+
+    const float *x = cells.x, *y = cells.y, *z = cells.z;
+    const float sideLength = 1/(float)L; // the voxel of a cell as produceSubstances finds it
+    const int   last       = L - 1;
+
+    int in = 0; // the buffers holding the current order
+#pragma omp parallel
+    {
+        const int nthreads = omp_get_num_threads();
+        const int tid = omp_get_thread_num();
+        const int64_t begin = n*tid/nthreads;
+        const int64_t end   = n*(tid+1)/nthreads;
+
+        for(int64_t c = begin; c < end; c++){
+            const int i1 = std::min((int)floor(x[c]/sideLength), last);
+            const int i2 = std::min((int)floor(y[c]/sideLength), last);
+            const int i3 = std::min((int)floor(z[c]/sideLength), last);
+            key[0][c]   = mortonKey(i1, i2, i3);
+            order[0][c] = (uint32_t)c;
+        }
+
+        // every thread counts the digits of its chunk, and the exclusive scan over digits, and
+        // over the threads within a digit, gives every thread the first slot of each digit
+#pragma omp single
+        count.assign((int64_t)RADIX*nthreads, 0);
+
+        for(int pass = 0; pass < passes; pass++){
+            const int shift = pass*RADIX_BITS;
+            const uint64_t *__restrict__ kin = key[in].data();
+            const uint32_t *__restrict__ oin = order[in].data();
+            uint64_t *__restrict__ kout = key[1-in].data();
+            uint32_t *__restrict__ oout = order[1-in].data();
+
+            int64_t *mine = &count[(int64_t)RADIX*tid];
+            fill(mine, mine + RADIX, 0);
+            for(int64_t c = begin; c < end; c++)
+                mine[kin[c] >> shift & (RADIX-1)]++;
+#pragma omp barrier
+#pragma omp single
+            {
+                int64_t sum = 0;
+                for(int d = 0; d < RADIX; d++)
+                    for(int t = 0; t < nthreads; t++){
+                        const int64_t c = count[(int64_t)RADIX*t + d];
+                        count[(int64_t)RADIX*t + d] = sum;
+                        sum += c;
+                    }
+            }
+            for(int64_t c = begin; c < end; c++){
+                const int64_t slot = mine[kin[c] >> shift & (RADIX-1)]++;
+                kout[slot] = kin[c];
+                oout[slot] = oin[c];
+            }
+#pragma omp barrier
+#pragma omp single
+            in = 1 - in;
+        }
+
+        // gathers every per-cell array into the new order
+        const uint32_t *__restrict__ perm = order[in].data();
+        uint32_t *__restrict__ tmp = scratch.data();
+        uint32_t *arrays[] = { (uint32_t*)cells.x, (uint32_t*)cells.y, (uint32_t*)cells.z,
+                               (uint32_t*)cells.movX, (uint32_t*)cells.movY, (uint32_t*)cells.movZ,
+                               (uint32_t*)cells.path, (uint32_t*)cells.type, (uint32_t*)cells.divisions, cells.id };
+        for(size_t a = 0; a < sizeof(arrays)/sizeof(arrays[0]); a++){
+            uint32_t *__restrict__ v = arrays[a];
+            for(int64_t c = begin; c < end; c++)
+                tmp[c] = v[perm[c]];
+#pragma omp barrier
+            memcpy(v + begin, tmp + begin, (end - begin)*sizeof(uint32_t));
+#pragma omp barrier
+        }
+    }
+
+    // keys and orders are read and written once per pass, and every array is gathered and copied back
+    return (double)n*(passes*2*(sizeof(uint64_t) + sizeof(uint32_t)) + 10*4*sizeof(uint32_t));
+}
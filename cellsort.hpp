@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+#include "cells.hpp"
+
+// spreads the low 21 bits of v to every third bit
+inline uint64_t spreadBits3(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8)  & 0x100f00f00f00f00full;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
+}
+
+// Z-order (Morton) key of voxel (i,j,k): the bits of the three coordinates
+// interleaved, so that voxels close in the grid mostly get close keys.
+// Coordinates may have up to 21 bits.
+inline uint64_t mortonKey(uint64_t i, uint64_t j, uint64_t k)
+{
+    return spreadBits3(i) << 2 | spreadBits3(j) << 1 | spreadBits3(k);
+}
+
+// Reorders the first n cells by the Morton key of their voxel in a grid of
+// L^3 voxels, with a stable parallel LSD radix sort of 8-bit digits, so that
+// the kernels that map every cell to its voxel walk the grid in Z-order. The
+// cells of one voxel keep their relative order. Returns the number of bytes
+// moved, for the roofline report.
+double sortCellsByMorton(CellStore &cells, int64_t n, int64_t L);
@@ -0,0 +1,187 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.hpp"
+#include "checkpoint.hpp"
+
+using namespace std;
+
+static const int CELL_ARRAYS = 10;
+
+static uint64_t alignUp(uint64_t v, uint64_t a)
+{
+    return (v + a - 1)/a*a;
+}
+
+// the per-cell arrays in the order they are stored in a checkpoint; all have 4-byte elements
+static void cellArrays(const CellStore &cells, void *a[CELL_ARRAYS])
+{
+    a[0] = cells.x;
+    a[1] = cells.y;
+    a[2] = cells.z;
+    a[3] = cells.movX;
+    a[4] = cells.movY;
+    a[5] = cells.movZ;
+    a[6] = cells.path;
+    a[7] = cells.type;
+    a[8] = cells.divisions;
+    a[9] = cells.id;
+}
+
+static void writeZeros(FILE *f, uint64_t bytes, const char *path)
+{
+    static const char zeros[CHECKPOINT_ALIGN] = {0};
+    while(bytes){
+        const uint64_t b = bytes < CHECKPOINT_ALIGN ? bytes : CHECKPOINT_ALIGN;
+        if(fwrite(zeros, 1, b, f) != b)
+            die("Could not write checkpoint %s: %s\n", path, strerror(errno));
+        bytes -= b;
+    }
+}
+
+void writeCheckpoint(const char *path, const CellStore &cells, const ConcentrationGrid &Conc, const checkpoint_state &st)
+{
+    checkpoint_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.version         = CHECKPOINT_VERSION;
+    h.byteOrder       = CHECKPOINT_BYTEORDER;
+    h.headerBytes     = sizeof(h);
+    h.precision       = Conc.precision();
+    h.L               = Conc.size();
+    h.rowStride       = Conc.rowStride();
+    h.planeStride     = Conc.planeStride();
+    h.substanceStride = Conc.substanceStride();
+    h.seed            = st.seed;
+    h.phase           = st.phase;
+    h.phase1Steps     = st.phase1Steps;
+    h.phase2Steps     = st.phase2Steps;
+    h.n               = st.n;
+    h.cellsOffset     = alignUp(sizeof(h), CHECKPOINT_ALIGN);
+    h.cellStride      = CellStore::padded(st.n*sizeof(float));
+    h.gridOffset      = alignUp(h.cellsOffset + CELL_ARRAYS*h.cellStride, CHECKPOINT_ALIGN);
+    h.gridBytes       = Conc.rawBytes();
+    h.fileBytes       = h.gridOffset + h.gridBytes;
+
+    const string tmp = string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f)
+        die("Could not create checkpoint %s: %s\n", tmp.c_str(), strerror(errno));
+
+    if(fwrite(&h, sizeof(h), 1, f) != 1)
+        die("Could not write checkpoint %s: %s\n", tmp.c_str(), strerror(errno));
+    writeZeros(f, h.cellsOffset - sizeof(h), tmp.c_str());
+
+    void *a[CELL_ARRAYS];
+    cellArrays(cells, a);
+    for(int i = 0; i < CELL_ARRAYS; i++){
+        if(fwrite(a[i], sizeof(float), st.n, f) != (size_t)st.n)
+            die("Could not write checkpoint %s: %s\n", tmp.c_str(), strerror(errno));
+        writeZeros(f, h.cellStride - st.n*sizeof(float), tmp.c_str());
+    }
+    writeZeros(f, h.gridOffset - (h.cellsOffset + CELL_ARRAYS*h.cellStride), tmp.c_str());
+
+    if(fwrite(Conc.raw(), 1, h.gridBytes, f) != h.gridBytes)
+        die("Could not write checkpoint %s: %s\n", tmp.c_str(), strerror(errno));
+
+    if(fclose(f) != 0)
+        die("Could not write checkpoint %s: %s\n", tmp.c_str(), strerror(errno));
+    if(rename(tmp.c_str(), path) != 0)
+        die("Could not rename checkpoint %s to %s: %s\n", tmp.c_str(), path, strerror(errno));
+}
+
+checkpoint_state readCheckpoint(const char *path, CellStore &cells, ConcentrationGrid &Conc)
+{
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        die("Could not open checkpoint %s: %s\n", path, strerror(errno));
+
+    struct stat sb;
+    if(fstat(fd, &sb) != 0)
+        die("Could not stat checkpoint %s: %s\n", path, strerror(errno));
+    if((uint64_t)sb.st_size < sizeof(checkpoint_header))
+        die("%s is not a checkpoint!\n", path);
+
+    void *map = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        die("Could not map checkpoint %s: %s\n", path, strerror(errno));
+    close(fd);
+
+    const char *base = (const char*)map;
+    const checkpoint_header &h = *(const checkpoint_header*)base;
+
+    if(memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0)
+        die("%s is not a checkpoint!\n", path);
+    if(h.byteOrder != CHECKPOINT_BYTEORDER)
+        die("Checkpoint %s was written on a host of another byte order!\n", path);
+    if(h.version != CHECKPOINT_VERSION || h.headerBytes != sizeof(h))
+        die("Checkpoint %s has version %u, expected %u!\n", path, h.version, CHECKPOINT_VERSION);
+    if(h.fileBytes != (uint64_t)sb.st_size)
+        die("Checkpoint %s is truncated!\n", path);
+    if(h.n < 0 || h.cellStride < h.n*sizeof(float) || h.cellsOffset + CELL_ARRAYS*h.cellStride > h.gridOffset ||
+       h.gridOffset + h.gridBytes != h.fileBytes)
+        die("Checkpoint %s is corrupt!\n", path);
+
+    if(h.L != Conc.size())
+        die("Checkpoint %s is of a grid with L=%lld, not %lld!\n", path, (long long int)h.L, (long long int)Conc.size());
+    if(h.precision != (uint32_t)Conc.precision())
+        die("Checkpoint %s has %s storage, not %s!\n", path,
+            h.precision <= GRID_BF16 ? grid_precision_name((grid_precision)h.precision) : "unknown",
+            grid_precision_name(Conc.precision()));
+    if(h.rowStride != Conc.rowStride() || h.planeStride != Conc.planeStride() ||
+       h.substanceStride != Conc.substanceStride() || h.gridBytes != Conc.rawBytes())
+        die("Checkpoint %s has another grid layout!\n", path);
+
+    checkpoint_state st;
+    st.seed        = h.seed;
+    st.phase       = h.phase;
+    st.phase1Steps = h.phase1Steps;
+    st.phase2Steps = h.phase2Steps;
+    st.n           = h.n;
+
+    cells.reserve(st.n, 0);
+    void *a[CELL_ARRAYS];
+    cellArrays(cells, a);
+    for(int i = 0; i < CELL_ARRAYS; i++)
+        memcpy(a[i], base + h.cellsOffset + i*h.cellStride, st.n*sizeof(float));
+
+    memcpy(Conc.raw(), base + h.gridOffset, h.gridBytes);
+
+    munmap(map, sb.st_size);
+    return st;
+}
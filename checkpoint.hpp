@@ -0,0 +1,96 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+#include "cells.hpp"
+#include "grid.hpp"
+
+// Checkpoints hold the full state of a run at a step boundary: the cells,
+// the concentrations of both substances and the position of the run, which
+// together with the seed is all the state of the counter-based random numbers.
+//
+// The file is a fixed header followed by page-aligned sections that hold the
+// arrays exactly as they are laid out in memory: the ten per-cell arrays of
+// the CellStore, each padded to a multiple of CELL_ALIGN bytes, and the raw
+// buffer of the ConcentrationGrid, halo included. A reader maps the file and
+// copies the sections; nothing is parsed. Files are written in the byte order
+// of the host, which the header records.
+
+static const char     CHECKPOINT_MAGIC[8]  = "CDCCKPT";
+static const uint32_t CHECKPOINT_VERSION   = 1;
+static const uint32_t CHECKPOINT_BYTEORDER = 0x01020304;
+static const uint64_t CHECKPOINT_ALIGN     = 4096; // alignment of the sections in the file
+
+struct checkpoint_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t headerBytes;
+    uint32_t precision;       // grid_precision of the concentrations
+
+    int64_t  L;               // layout of the grid buffer
+    int64_t  rowStride;
+    int64_t  planeStride;
+    int64_t  substanceStride;
+
+    uint64_t seed;            // key of the random numbers of phase 1
+    int32_t  phase;           // 1 or 2: the phase the run continues in
+    int32_t  reserved;
+    int64_t  phase1Steps;     // time steps of phase 1 done
+    int64_t  phase2Steps;     // time steps of phase 2 done
+    int64_t  n;               // number of cells
+
+    uint64_t cellsOffset;     // offset of the first cell array in the file
+    uint64_t cellStride;      // bytes from one cell array to the next
+    uint64_t gridOffset;      // offset of the grid buffer in the file
+    uint64_t gridBytes;
+    uint64_t fileBytes;
+};
+
+// position of a run
+struct checkpoint_state
+{
+    uint64_t seed;
+    int      phase;
+    int64_t  phase1Steps;
+    int64_t  phase2Steps;
+    int64_t  n;
+};
+
+// writes the first st.n cells and the grid to path; the file is replaced only once it is complete
+void writeCheckpoint(const char *path, const CellStore &cells, const ConcentrationGrid &Conc, const checkpoint_state &st);
+
+// maps the checkpoint at path and copies it into cells, which is grown as
+// needed, and Conc, which must have the size and precision of the
+// checkpointed grid
+checkpoint_state readCheckpoint(const char *path, CellStore &cells, ConcentrationGrid &Conc);
@@ -0,0 +1,806 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <omp.h>
+
+#include "util.hpp"
+#include "diffusion.hpp"
+
+using namespace std;
+
+static void stencilRowsScalar(const stencil_rows &r, int64_t n, float D6, float decay)
+{
+    // the neighbours are added in the same order as the original runDiffusionStep
+    for(int s = 0; s < 2; ++s){
+        const float *__restrict__ c  = r.c[s];
+        const float *__restrict__ xm = r.xm[s];
+        const float *__restrict__ xp = r.xp[s];
+        const float *__restrict__ ym = r.ym[s];
+        const float *__restrict__ yp = r.yp[s];
+        float *__restrict__ out      = r.out[s];
+#pragma ivdep
+        for(int64_t k = 0; k < n; k++){
+            float v = c[k];
+            v += (xp[k]  - c[k]) * D6;
+            v += (xm[k]  - c[k]) * D6;
+            v += (yp[k]  - c[k]) * D6;
+            v += (ym[k]  - c[k]) * D6;
+            v += (c[k+1] - c[k]) * D6;
+            v += (c[k-1] - c[k]) * D6;
+            out[k] = v * decay;
+        }
+    }
+}
+
+static void scaleRowsScalar(float *__restrict__ row0, float *__restrict__ row1, int64_t n, float decay)
+{
+#pragma ivdep
+    for(int64_t k = 0; k < n; k++){
+        row0[k] = row0[k] * decay;
+        row1[k] = row1[k] * decay;
+    }
+}
+
+// conversions of the 16-bit storage formats, for the scalar row kernels
+struct fp16_format
+{
+    static float    load(uint16_t h) { return halfToFloat(h); }
+    static uint16_t store(float v)   { return floatToHalf(v); }
+};
+
+struct bf16_format
+{
+    static float    load(uint16_t h) { return bf16ToFloat(h); }
+    static uint16_t store(float v)   { return floatToBf16(v); }
+};
+
+template<class F>
+static void stencilRows16Scalar(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    for(int s = 0; s < 2; ++s){
+        const uint16_t *__restrict__ c  = r.c[s];
+        const uint16_t *__restrict__ xm = r.xm[s];
+        const uint16_t *__restrict__ xp = r.xp[s];
+        const uint16_t *__restrict__ ym = r.ym[s];
+        const uint16_t *__restrict__ yp = r.yp[s];
+        uint16_t *__restrict__ out      = r.out[s];
+        for(int64_t k = 0; k < n; k++){
+            const float ck = F::load(c[k]);
+            float v = ck;
+            v += (F::load(xp[k])  - ck) * D6;
+            v += (F::load(xm[k])  - ck) * D6;
+            v += (F::load(yp[k])  - ck) * D6;
+            v += (F::load(ym[k])  - ck) * D6;
+            v += (F::load(c[k+1]) - ck) * D6;
+            v += (F::load(c[k-1]) - ck) * D6;
+            out[k] = F::store(v * decay);
+        }
+    }
+}
+
+template<class F>
+static void scaleRows16Scalar(uint16_t *__restrict__ row0, uint16_t *__restrict__ row1, int64_t n, float decay)
+{
+    for(int64_t k = 0; k < n; k++){
+        row0[k] = F::store(F::load(row0[k]) * decay);
+        row1[k] = F::store(F::load(row1[k]) * decay);
+    }
+}
+
+static void directionRowsScalar(const direction_rows &r, int64_t n, const float scale[3], float speed)
+{
+    for(int64_t k = 1; k < n-1; k++)
+        voxelDirection((r.xp[0][k]-r.xm[0][k])/scale[0], (r.yp[0][k]-r.ym[0][k])/scale[1], (r.c[0][k+1]-r.c[0][k-1])/scale[2],
+                       (r.xp[1][k]-r.xm[1][k])/scale[0], (r.yp[1][k]-r.ym[1][k])/scale[1], (r.c[1][k+1]-r.c[1][k-1])/scale[2],
+                       speed, r.dir[0][k], r.dir[1][k], r.dir[2][k]);
+}
+
+static stencil_rows_fn   stencilRows     = stencilRowsScalar;
+static scale_rows_fn     scaleRows       = scaleRowsScalar;
+static stencil_rows16_fn stencilRowsFp16 = stencilRows16Scalar<fp16_format>;
+static scale_rows16_fn   scaleRowsFp16   = scaleRows16Scalar<fp16_format>;
+static stencil_rows16_fn stencilRowsBf16 = stencilRows16Scalar<bf16_format>;
+static scale_rows16_fn   scaleRowsBf16   = scaleRows16Scalar<bf16_format>;
+static direction_rows_fn directionRows   = directionRowsScalar;
+
+simd_level selectDiffusionKernels(simd_level level)
+{
+    const simd_level supported = cpu_simd_level();
+    if(level > supported)
+        level = supported;
+
+    switch(level){
+    case SIMD_AVX512:
+        stencilRows     = stencilRowsAVX512;
+        scaleRows       = scaleRowsAVX512;
+        stencilRowsFp16 = stencilRowsFp16AVX512;
+        scaleRowsFp16   = scaleRowsFp16AVX512;
+        stencilRowsBf16 = stencilRowsBf16AVX512;
+        scaleRowsBf16   = scaleRowsBf16AVX512;
+        directionRows   = directionRowsAVX512;
+        break;
+    case SIMD_AVX2:
+        stencilRows     = stencilRowsAVX2;
+        scaleRows       = scaleRowsAVX2;
+        stencilRowsFp16 = stencilRowsFp16AVX2;
+        scaleRowsFp16   = scaleRowsFp16AVX2;
+        stencilRowsBf16 = stencilRowsBf16AVX2;
+        scaleRowsBf16   = scaleRowsBf16AVX2;
+        directionRows   = directionRowsAVX2;
+        break;
+    default:
+        stencilRows     = stencilRowsScalar;
+        scaleRows       = scaleRowsScalar;
+        stencilRowsFp16 = stencilRows16Scalar<fp16_format>;
+        scaleRowsFp16   = scaleRows16Scalar<fp16_format>;
+        stencilRowsBf16 = stencilRows16Scalar<bf16_format>;
+        scaleRowsBf16   = scaleRows16Scalar<bf16_format>;
+        directionRows   = directionRowsScalar;
+        break;
+    }
+    return level;
+}
+
+// first element of substance s in the storage type of the grid
+static inline const void *substanceData(const ConcentrationGrid &g, int s)
+{
+    return g.precision() == GRID_FP32 ? (const void*)g.substance(s) : (const void*)g.substance16(s);
+}
+
+template<typename T>
+static inline void gridRows(stencil_rows_of<T> &r, const ConcentrationGrid &Conc, ConcentrationGrid &nextConc,
+                            int64_t i, int64_t j, int64_t k)
+{
+    const int64_t o  = Conc.offset(i, j, k);
+    const int64_t sx = Conc.planeStride();
+    const int64_t sy = Conc.rowStride();
+    for(int s = 0; s < 2; ++s){
+        const T *C = (const T*)substanceData(Conc, s) + o;
+        r.c[s]   = C;
+        r.xm[s]  = C - sx;
+        r.xp[s]  = C + sx;
+        r.ym[s]  = C - sy;
+        r.yp[s]  = C + sy;
+        r.out[s] = (T*)substanceData(nextConc, s) + o;
+    }
+}
+
+template<typename T, typename Kernel>
+static void diffusionSweepRows(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, Kernel kernel, float D6, float decay)
+{
+    const int64_t L = Conc.size();
+
+    int64_t i1, i2;
+#pragma omp parallel for collapse(2)
+    for(i1 = 0; i1 < Conc.planes(); i1++){
+        for(i2 = 0; i2 < L; i2++){
+            stencil_rows_of<T> r;
+            gridRows(r, Conc, nextConc, i1, i2, 0);
+            kernel(r, L, D6, decay);
+        }
+    }
+}
+
+void diffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay)
+{
+    switch(Conc.precision()){
+    case GRID_FP16:
+        diffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsFp16, D/6, decay);
+        break;
+    case GRID_BF16:
+        diffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsBf16, D/6, decay);
+        break;
+    default:
+        diffusionSweepRows<float>(Conc, nextConc, stencilRows, D/6, decay);
+        break;
+    }
+}
+
+template<typename T, typename Kernel>
+static void decaySweepRows(ConcentrationGrid &Conc, Kernel kernel, float decay)
+{
+    const int64_t L = Conc.size();
+    T *C0 = (T*)substanceData(Conc, 0);
+    T *C1 = (T*)substanceData(Conc, 1);
+
+    int64_t i1, i2;
+#pragma omp parallel for collapse(2)
+    for(i1 = 0; i1 < Conc.planes(); i1++){
+        for(i2 = 0; i2 < L; i2++){
+            const int64_t o = Conc.offset(i1, i2, 0);
+            kernel(C0 + o, C1 + o, L, decay);
+        }
+    }
+}
+
+void decaySweep(ConcentrationGrid &Conc, float decay)
+{
+    switch(Conc.precision()){
+    case GRID_FP16:
+        decaySweepRows<uint16_t>(Conc, scaleRowsFp16, decay);
+        break;
+    case GRID_BF16:
+        decaySweepRows<uint16_t>(Conc, scaleRowsBf16, decay);
+        break;
+    default:
+        decaySweepRows<float>(Conc, scaleRows, decay);
+        break;
+    }
+}
+
+// applies the stencil to the voxels [i0,i1) x [j0,j1) x [k0,k1)
+template<typename T, typename Kernel>
+static inline void sweepTile(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, Kernel kernel, float D6, float decay,
+                             int64_t i0, int64_t i1, int64_t j0, int64_t j1, int64_t k0, int64_t k1)
+{
+    for(int64_t i = i0; i < i1; i++){
+        for(int64_t j = j0; j < j1; j++){
+            stencil_rows_of<T> r;
+            gridRows(r, Conc, nextConc, i, j, k0);
+            kernel(r, k1 - k0, D6, decay);
+        }
+    }
+}
+
+template<typename T, typename Kernel>
+static void blockedDiffusionSweepRows(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, Kernel kernel, float D6, float decay,
+                                      int64_t tileX, int64_t tileY, int64_t tileZ)
+{
+    const int64_t L = Conc.size();
+    const int64_t P = Conc.planes();
+
+    const int64_t nx = (P + tileX - 1)/tileX;
+    const int64_t ny = (L + tileY - 1)/tileY;
+    const int64_t nz = (L + tileZ - 1)/tileZ;
+
+    int64_t bx, by, bz;
+#pragma omp parallel for collapse(3) schedule(static)
+    for(bx = 0; bx < nx; bx++){
+        for(by = 0; by < ny; by++){
+            for(bz = 0; bz < nz; bz++){
+                const int64_t i0 = bx*tileX, j0 = by*tileY, k0 = bz*tileZ;
+                sweepTile<T>(Conc, nextConc, kernel, D6, decay,
+                             i0, min(P, i0 + tileX), j0, min(L, j0 + tileY), k0, min(L, k0 + tileZ));
+            }
+        }
+    }
+}
+
+void blockedDiffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay,
+                           int64_t tileX, int64_t tileY, int64_t tileZ)
+{
+    switch(Conc.precision()){
+    case GRID_FP16:
+        blockedDiffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsFp16, D/6, decay, tileX, tileY, tileZ);
+        break;
+    case GRID_BF16:
+        blockedDiffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsBf16, D/6, decay, tileX, tileY, tileZ);
+        break;
+    default:
+        blockedDiffusionSweepRows<float>(Conc, nextConc, stencilRows, D/6, decay, tileX, tileY, tileZ);
+        break;
+    }
+}
+
+// whether any voxel of either substance in [i0,i1) x [j0,j1) x [k0,k1) is above threshold,
+// compared on the stored values; every voxel is non-negative, so the bit patterns of the
+// 16-bit formats are ordered like their values
+template<typename T>
+static bool tileAbove(const ConcentrationGrid &g, T threshold,
+                      int64_t i0, int64_t i1, int64_t j0, int64_t j1, int64_t k0, int64_t k1)
+{
+    for(int s = 0; s < 2; s++){
+        const T *C = (const T*)substanceData(g, s);
+        for(int64_t i = i0; i < i1; i++){
+            for(int64_t j = j0; j < j1; j++){
+                const T *row = C + g.offset(i, j, 0);
+                bool above = false;
+                for(int64_t k = k0; k < k1; k++)
+                    above |= row[k] > threshold;
+                if(above)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// largest stored 16-bit value that is not above epsilon
+static uint16_t threshold16(grid_precision p, float epsilon)
+{
+    if(p == GRID_FP16){
+        uint16_t h = floatToHalf(epsilon);
+        if(halfToFloat(h) > epsilon)
+            h--;
+        return h;
+    }
+    uint16_t h = floatToBf16(epsilon);
+    if(bf16ToFloat(h) > epsilon)
+        h--;
+    return h;
+}
+
+static const int64_t ACTIVE_CHECK_INTERVAL = 8; // sweeps between checks for blocks that went idle
+
+template<typename T, typename Kernel>
+static void activeDiffusionSweepRows(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, Kernel kernel, float D6, float decay,
+                                     T threshold)
+{
+    const int64_t L  = Conc.size();
+    ActiveBlocks &a  = *Conc.activeBlocks();
+    const int64_t B  = a.blockSize();
+    const int64_t nb = a.blocksPerSide();
+
+    // The active blocks and their face neighbours, the only ones substance can be in after this
+    // step. Consecutive blocks along z are merged into runs, so that the row kernels see long rows.
+    struct block_run { int64_t bx, by, bz0, bz1; };
+    vector<block_run> runs;
+    int64_t stepped = 0;
+    for(int64_t bx = 0; bx < nb; bx++){
+        for(int64_t by = 0; by < nb; by++){
+            for(int64_t bz = 0; bz < nb; bz++){
+                const bool near = a.active(a.index(bx, by, bz))
+                    || (bx > 0    && a.active(a.index(bx-1, by, bz))) || (bx < nb-1 && a.active(a.index(bx+1, by, bz)))
+                    || (by > 0    && a.active(a.index(bx, by-1, bz))) || (by < nb-1 && a.active(a.index(bx, by+1, bz)))
+                    || (bz > 0    && a.active(a.index(bx, by, bz-1))) || (bz < nb-1 && a.active(a.index(bx, by, bz+1)));
+                if(!near)
+                    continue;
+                if(!runs.empty() && runs.back().bx == bx && runs.back().by == by && runs.back().bz1 == bz)
+                    runs.back().bz1++;
+                else{
+                    const block_run r = { bx, by, bz, bz + 1 };
+                    runs.push_back(r);
+                }
+                stepped++;
+            }
+        }
+    }
+    const int64_t nruns = runs.size();
+    vector<unsigned char> stillActive(a.numBlocks());
+
+    // keeping a block active longer than needed is always exact, so blocks are only
+    // checked for going idle every few steps, which saves most of the extra reads
+    const bool check = a.sweeps % ACTIVE_CHECK_INTERVAL == 0;
+
+    int64_t t;
+#pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < nruns; t++){
+        const block_run &r = runs[t];
+        const int64_t i0 = r.bx*B, i1 = min(L, i0 + B);
+        const int64_t j0 = r.by*B, j1 = min(L, j0 + B);
+        sweepTile<T>(Conc, nextConc, kernel, D6, decay, i0, i1, j0, j1, r.bz0*B, min(L, r.bz1*B));
+        for(int64_t bz = r.bz0; bz < r.bz1; bz++)
+            stillActive[a.index(r.bx, r.by, bz)] = !check || tileAbove<T>(nextConc, threshold, i0, i1, j0, j1, bz*B, min(L, bz*B + B));
+    }
+
+    // blocks that went idle are zeroed in both buffers, once no stencil reads Conc any more
+#pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < nruns; t++){
+        const block_run &r = runs[t];
+        const int64_t i0 = r.bx*B, i1 = min(L, i0 + B);
+        const int64_t j0 = r.by*B, j1 = min(L, j0 + B);
+        for(int64_t bz = r.bz0; bz < r.bz1; bz++){
+            const int64_t b = a.index(r.bx, r.by, bz);
+            a.setActive(b, stillActive[b]);
+            if(stillActive[b])
+                continue;
+            nextConc.clearBlock(i0, i1, j0, j1, bz*B, min(L, bz*B + B));
+            Conc.clearBlock(i0, i1, j0, j1, bz*B, min(L, bz*B + B));
+        }
+    }
+
+    a.steppedBlocks += stepped;
+    a.sweeps++;
+}
+
+void activeDiffusionSweep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay, float epsilon)
+{
+    if(!Conc.activeBlocks())
+        die("The grid does not track its active blocks!\n");
+
+    switch(Conc.precision()){
+    case GRID_FP16:
+        activeDiffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsFp16, D/6, decay, threshold16(GRID_FP16, epsilon));
+        break;
+    case GRID_BF16:
+        activeDiffusionSweepRows<uint16_t>(Conc, nextConc, stencilRowsBf16, D/6, decay, threshold16(GRID_BF16, epsilon));
+        break;
+    default:
+        activeDiffusionSweepRows<float>(Conc, nextConc, stencilRows, D/6, decay, epsilon);
+        break;
+    }
+}
+
+// rolling planes of the intermediate time levels of one temporal tile
+struct temporal_window
+{
+    int64_t L;
+    int64_t rowStride;
+    int64_t planeFloats; // floats per plane of one substance
+    int64_t rowBase;     // global row held in local row 0
+    float  *data;
+
+    // first interior voxel of row j in plane i of intermediate level s (1-based)
+    float *row(int s, int sub, int64_t i, int64_t j) const
+    {
+        // the planes outside the grid mirror the boundary planes
+        if(i < 0)  i = 0;
+        if(i >= L) i = L-1;
+        return data + (((s-1)*3 + i%3)*2 + sub)*planeFloats + (j - rowBase)*rowStride + GRID_PAD;
+    }
+};
+
+void temporalDiffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay,
+                            const ProductionBatch &batch, int64_t tileY)
+{
+    const int64_t L     = Conc.size();
+    const int     steps = batch.steps();
+    const float   D6    = D/6;
+
+    if(Conc.precision() != GRID_FP32)
+        die("The temporal grid engine needs fp32 storage!\n");
+    if(Conc.distributed())
+        die("The temporal grid engine needs the whole grid!\n");
+
+    if(steps <= 1){
+        diffusionSweep(Conc, nextConc, D, decay);
+        return;
+    }
+
+    const int64_t ntiles = (L + tileY - 1)/tileY;
+    const int64_t rs     = Conc.rowStride();
+    const int64_t R      = tileY + 2*steps + 2; // rows held per plane, including the widening and the mirror rows
+
+#pragma omp parallel
+    {
+        temporal_window w;
+        w.L           = L;
+        w.rowStride   = rs;
+        w.planeFloats = R*rs;
+        w.data        = (float*)alloc_aligned((steps-1)*3*2*w.planeFloats*sizeof(float), GRID_ALIGN);
+        memset(w.data, 0, (steps-1)*3*2*w.planeFloats*sizeof(float));
+
+        int64_t t;
+#pragma omp for schedule(dynamic)
+        for(t = 0; t < ntiles; t++){
+            const int64_t j0 = t*tileY;
+            const int64_t j1 = min(L, j0 + tileY);
+            w.rowBase = j0 - steps - 1;
+
+            // wavefront through x: at position p, level s computes plane p-(s-1)
+            for(int64_t p = 0; p < L + steps - 1; p++){
+                for(int s = 1; s <= steps; s++){
+                    const int64_t i = p - (s-1);
+                    if(i < 0 || i >= L)
+                        continue;
+
+                    // level s is needed on all rows that can still influence [j0, j1) at the last level
+                    const int64_t lo = max((int64_t)0, j0 - (steps - s));
+                    const int64_t hi = min(L,          j1 + (steps - s));
+
+                    for(int64_t j = lo; j < hi; j++){
+                        stencil_rows r;
+                        if(s == 1)
+                            gridRows(r, Conc, nextConc, i, j, 0);
+                        else{
+                            for(int sub = 0; sub < 2; sub++){
+                                r.c[sub]  = w.row(s-1, sub, i,   j);
+                                r.xm[sub] = w.row(s-1, sub, i-1, j);
+                                r.xp[sub] = w.row(s-1, sub, i+1, j);
+                                r.ym[sub] = w.row(s-1, sub, i,   j-1);
+                                r.yp[sub] = w.row(s-1, sub, i,   j+1);
+                            }
+                        }
+                        for(int sub = 0; sub < 2; sub++)
+                            r.out[sub] = (s == steps) ? nextConc.substance(sub) + Conc.offset(i, j, 0) : w.row(s, sub, i, j);
+                        stencilRows(r, L, D6, decay);
+                    }
+
+                    if(s == steps)
+                        continue;
+
+                    // production of the next step, then the halo that level s+1 reads
+                    for(int64_t j = lo; j < hi; j++){
+                        for(const uint32_t *e = batch.rowBegin(s, i, j); e != batch.rowEnd(s, i, j); ++e)
+                            produceAt(w.row(s, (*e & PRODUCTION_SUBSTANCE1) ? 1 : 0, i, j) + (*e & ~PRODUCTION_SUBSTANCE1));
+                        for(int sub = 0; sub < 2; sub++){
+                            float *row = w.row(s, sub, i, j);
+                            row[-1] = row[0];
+                            row[L]  = row[L-1];
+                        }
+                    }
+                    for(int sub = 0; sub < 2; sub++){
+                        if(lo == 0)
+                            memcpy(w.row(s, sub, i, -1) - GRID_PAD, w.row(s, sub, i, 0) - GRID_PAD, rs*sizeof(float));
+                        if(hi == L)
+                            memcpy(w.row(s, sub, i, L) - GRID_PAD, w.row(s, sub, i, L-1) - GRID_PAD, rs*sizeof(float));
+                    }
+                }
+            }
+        }
+
+        free(w.data);
+    }
+}
+
+// Thomas factors of the tridiagonal system (1 - a*d2) u = r of a line of L
+// voxels with mirrored ends, whose off-diagonal entries are all -a: inv[i] is
+// the reciprocal of the i-th pivot and c[i] the i-th eliminated superdiagonal.
+static void adiFactors(int64_t L, float a, vector<float> &inv, vector<float> &c)
+{
+    inv.resize(L);
+    c.resize(L);
+    for(int64_t i = 0; i < L; i++){
+        const float b = (i == 0 || i == L-1) ? 1 + a : 1 + 2*a;
+        inv[i] = 1/(L == 1 ? 1.0f : b + (i ? a*c[i-1] : 0.0f));
+        c[i]   = -a*inv[i];
+    }
+}
+
+// Solves the systems of n lines at once that start at u and advance by stride
+// from one voxel of the line to the next; the lines are adjacent in memory, so
+// the loops over them vectorize.
+static inline void adiSolveLines(float *u, int64_t n, int64_t L, int64_t stride, float a,
+                                 const float *inv, const float *c)
+{
+    for(int64_t k = 0; k < n; k++)
+        u[k] *= inv[0];
+    for(int64_t i = 1; i < L; i++){
+        float *__restrict__ ui = u + i*stride;
+        const float *__restrict__ up = u + (i-1)*stride;
+        for(int64_t k = 0; k < n; k++)
+            ui[k] = (ui[k] + a*up[k])*inv[i];
+    }
+    for(int64_t i = L-2; i >= 0; i--){
+        float *__restrict__ ui = u + i*stride;
+        const float *__restrict__ un = u + (i+1)*stride;
+        for(int64_t k = 0; k < n; k++)
+            ui[k] -= c[i]*un[k];
+    }
+}
+
+void adiDiffusionSweep(ConcentrationGrid &Conc, float a, float decay)
+{
+    const int64_t L  = Conc.size();
+    const int64_t rs = Conc.rowStride();
+    const int64_t ps = Conc.planeStride();
+
+    vector<float> inv, c;
+    adiFactors(L, a, inv, c);
+
+    for(int s = 0; s < 2; s++){
+        float *u = &Conc.at(s, 0, 0, 0);
+        int64_t i, j;
+
+        // along x: the rows of a given j of all planes form one batch of lines
+#pragma omp parallel for schedule(static)
+        for(j = 0; j < L; j++)
+            adiSolveLines(u + j*rs, L, L, ps, a, inv.data(), c.data());
+
+        // along y: the rows of a plane form one batch
+#pragma omp parallel for schedule(static)
+        for(i = 0; i < L; i++)
+            adiSolveLines(u + i*ps, L, L, rs, a, inv.data(), c.data());
+
+        // along z the lines are the rows, which are not adjacent; the rows of a plane are solved
+        // together, a column of voxels at a time, so that their recurrences overlap
+#pragma omp parallel for schedule(static)
+        for(i = 0; i < L; i++){
+            float *p = u + i*ps;
+            for(int64_t r = 0; r < L; r++)
+                p[r*rs] *= inv[0];
+            for(int64_t k = 1; k < L; k++)
+                for(int64_t r = 0; r < L; r++)
+                    p[r*rs + k] = (p[r*rs + k] + a*p[r*rs + k-1])*inv[k];
+            for(int64_t k = L-2; k >= 0; k--)
+                for(int64_t r = 0; r < L; r++)
+                    p[r*rs + k] -= c[k]*p[r*rs + k+1];
+            for(int64_t r = 0; r < L; r++)
+                for(int64_t k = 0; k < L; k++)
+                    p[r*rs + k] *= decay;
+        }
+    }
+}
+
+// the movement direction of every voxel of the slab, one row of voxels at a time
+void directionFieldSweep(const ConcentrationGrid &Conc, float speed, float *dirX, float *dirY, float *dirZ)
+{
+    const int64_t L      = Conc.size();
+    const int64_t last   = L - 1;
+    const int64_t p0     = Conc.firstPlane();
+    const int64_t planes = Conc.planes();
+    const float   side   = 1/(float)L; // length of a side of a voxel
+    const bool    fp32   = Conc.precision() == GRID_FP32;
+
+    int64_t row;
+#pragma omp parallel
+    {
+        vector<float> scratch(fp32 ? 0 : 10*L); // the five rows of both substances of 16-bit grids
+
+        // row j of plane i (of the whole grid) of substance s, as fp32
+        auto gridRow = [&](int s, int64_t i, int64_t j, int slot) -> const float* {
+            if(fp32)
+                return Conc.substance(s) + Conc.offset(i - p0, j, 0);
+            float *buf = &scratch[slot*L];
+            for(int64_t k = 0; k < L; k++)
+                buf[k] = Conc.get(s, i - p0, j, k);
+            return buf;
+        };
+
+#pragma omp for schedule(static)
+        for(row = 0; row < planes*L; row++){
+            const int64_t i = p0 + row/L, j = row%L;
+            const int64_t xUp = min(i+1, last), xDown = max(i-1, (int64_t)0);
+            const int64_t yUp = min(j+1, last), yDown = max(j-1, (int64_t)0);
+
+            direction_rows r;
+            for(int s = 0; s < 2; s++){
+                r.c[s]  = gridRow(s, i, j, 5*s);
+                r.xp[s] = gridRow(s, xUp, j, 5*s + 1);
+                r.xm[s] = gridRow(s, xDown, j, 5*s + 2);
+                r.yp[s] = gridRow(s, i, yUp, 5*s + 3);
+                r.ym[s] = gridRow(s, i, yDown, 5*s + 4);
+            }
+            r.dir[0] = dirX + row*L;
+            r.dir[1] = dirY + row*L;
+            r.dir[2] = dirZ + row*L;
+
+            const float scale[3] = { side*(xUp-xDown), side*(yUp-yDown), side*2 };
+            directionRows(r, L, scale, speed);
+
+            // the z gradient is one-sided at both ends of the row
+            for(int64_t k = 0; k < L; k += max(last, (int64_t)1)){
+                const int64_t zUp = min(k+1, last), zDown = max(k-1, (int64_t)0);
+                const float zScale = side*(zUp-zDown);
+                voxelDirection((r.xp[0][k]-r.xm[0][k])/scale[0], (r.yp[0][k]-r.ym[0][k])/scale[1], (r.c[0][zUp]-r.c[0][zDown])/zScale,
+                               (r.xp[1][k]-r.xm[1][k])/scale[0], (r.yp[1][k]-r.ym[1][k])/scale[1], (r.c[1][zUp]-r.c[1][zDown])/zScale,
+                               speed, r.dir[0][k], r.dir[1][k], r.dir[2][k]);
+            }
+        }
+    }
+}
+
+ProductionBatch::ProductionBatch(int64_t L_, int maxSteps_)
+    : L(L_), nsteps(0), keys(maxSteps_), rowStart(maxSteps_)
+{
+}
+
+void ProductionBatch::record(const CellStore &cells, int64_t n)
+{
+    if(nsteps == maxSteps())
+        die("Production batch holds at most %d steps!\n", maxSteps());
+    const int t = nsteps++;
+
+    const float sideLength = 1/(float)L;
+    const int   last       = L-1;
+
+    cellRow.resize(n);
+    scratch.resize(n);
+    keys[t].resize(n);
+    rowStart[t].assign(L*L + 1, 0);
+
+    const float *x = cells.x, *y = cells.y, *z = cells.z;
+    const int *type = cells.type;
+    int64_t *start  = &rowStart[t][0];
+
+    // Stable two-level counting sort of the cells by grid row: first by plane with per-thread
+    // histograms over static chunks of cells, then by row within every plane. Each row ends up
+    // holding its cells in cell order, whatever the number of threads.
+    const int nthreads = omp_get_max_threads();
+    vector<int64_t> planeCount((int64_t)nthreads*L, 0);
+    vector<int64_t> planeStart(L + 1, 0);
+    vector<int32_t> byPlane(n);
+
+#pragma omp parallel num_threads(nthreads)
+    {
+        const int     tid = omp_get_thread_num();
+        const int64_t c0  = n*tid/nthreads;
+        const int64_t c1  = n*(tid+1)/nthreads;
+        int64_t *count    = &planeCount[(int64_t)tid*L];
+
+        for(int64_t c = c0; c < c1; c++){
+            const int i1 = voxelOf(x[c], sideLength, last);
+            const int i2 = voxelOf(y[c], sideLength, last);
+            const int i3 = voxelOf(z[c], sideLength, last);
+            cellRow[c] = i1*L + i2;
+            scratch[c] = i3 | (type[c] == 1 ? 0 : PRODUCTION_SUBSTANCE1);
+            count[i1]++;
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+            int64_t sum = 0;
+            for(int64_t i = 0; i < L; i++){
+                planeStart[i] = sum;
+                for(int th = 0; th < nthreads; th++){
+                    const int64_t cnt = planeCount[(int64_t)th*L + i];
+                    planeCount[(int64_t)th*L + i] = sum;
+                    sum += cnt;
+                }
+            }
+            planeStart[L] = sum;
+        }
+        for(int64_t c = c0; c < c1; c++)
+            byPlane[count[cellRow[c]/L]++] = c;
+#pragma omp barrier
+
+        vector<int64_t> cursor(L);
+        int64_t i;
+#pragma omp for schedule(dynamic)
+        for(i = 0; i < L; i++){
+            fill(cursor.begin(), cursor.end(), 0);
+            for(int64_t e = planeStart[i]; e < planeStart[i+1]; e++)
+                cursor[cellRow[byPlane[e]] - i*L]++;
+            int64_t sum = planeStart[i];
+            for(int64_t j = 0; j < L; j++){
+                const int64_t cnt = cursor[j];
+                start[i*L + j] = sum;
+                cursor[j]      = sum;
+                sum           += cnt;
+            }
+            for(int64_t e = planeStart[i]; e < planeStart[i+1]; e++){
+                const int32_t c = byPlane[e];
+                keys[t][cursor[cellRow[c] - i*L]++] = scratch[c];
+            }
+        }
+    }
+    start[L*L] = n;
+}
+
+void ProductionBatch::apply(ConcentrationGrid &Conc, int t) const
+{
+    ActiveBlocks *active = Conc.activeBlocks();
+    const bool    fp32   = Conc.precision() == GRID_FP32;
+
+    // every plane is updated by a single thread, in cell order; a slab applies its own planes
+    const int64_t p0 = Conc.firstPlane();
+    int64_t i;
+#pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < Conc.planes(); i++){
+        for(int64_t j = 0; j < L; j++){
+            for(const uint32_t *e = rowBegin(t, p0 + i, j); e != rowEnd(t, p0 + i, j); ++e){
+                const int     s = (*e & PRODUCTION_SUBSTANCE1) ? 1 : 0;
+                const int64_t k = *e & ~PRODUCTION_SUBSTANCE1;
+                if(fp32)
+                    produceAt(&Conc.at(s, i, j, k));
+                else{
+                    float C = Conc.get(s, i, j, k) + 0.1;
+                    if(C > 1) C = 1;
+                    Conc.set(s, i, j, k, C);
+                }
+                if(active)
+                    active->markVoxel(i, j, k);
+            }
+        }
+    }
+}
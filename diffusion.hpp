@@ -0,0 +1,211 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#include "util.hpp"
+#include "cells.hpp"
+#include "grid.hpp"
+
+// The production of the cells over a batch of consecutive time steps. For
+// every step the voxels that receive substance are bucketed by grid row, in
+// cell order, so that a row can be updated exactly as produceSubstances
+// would have done without scanning all cells.
+class ProductionBatch
+{
+public:
+    ProductionBatch(int64_t L, int maxSteps);
+
+    int64_t size() const { return L; }
+    int steps() const    { return nsteps; }
+    int maxSteps() const { return (int)keys.size(); }
+
+    void clear()         { nsteps = 0; }
+
+    // appends the production of the first n cells at their current positions as the next step
+    void record(const CellStore &cells, int64_t n);
+
+    // scatters the production of step t into Conc, in any storage precision, and marks
+    // the blocks it lands in if Conc tracks its active blocks
+    void apply(ConcentrationGrid &Conc, int t) const;
+
+    // events of step t in row (i,j): each key is the z index, with the top bit set for substance 1
+    const uint32_t *rowBegin(int t, int64_t i, int64_t j) const { return &keys[t][rowStart[t][i*L + j]]; }
+    const uint32_t *rowEnd(int t, int64_t i, int64_t j) const   { return &keys[t][rowStart[t][i*L + j + 1]]; }
+
+private:
+    int64_t L;
+    int     nsteps;
+    std::vector<std::vector<uint32_t> > keys;
+    std::vector<std::vector<int64_t> >  rowStart;
+    std::vector<uint32_t> scratch;
+    std::vector<int32_t>  cellRow;
+};
+
+static const uint32_t PRODUCTION_SUBSTANCE1 = 0x80000000u;
+
+// adds the production of one cell to a voxel, clamping at 1 like produceSubstances
+static inline void produceAt(float *C)
+{
+    *C = *C + 0.1;
+    if(*C > 1) *C = 1;
+}
+
+// pointers to the first interior voxel of a row of both substances, of its four
+// neighbour rows in x and y, and of the rows the result is written to
+template<typename T>
+struct stencil_rows_of
+{
+    const T *c[2];
+    const T *xm[2];
+    const T *xp[2];
+    const T *ym[2];
+    const T *yp[2];
+    T       *out[2];
+};
+
+typedef stencil_rows_of<float>    stencil_rows;
+typedef stencil_rows_of<uint16_t> stencil_rows16; // GRID_FP16 or GRID_BF16 storage
+
+// Row kernels shared by all engines. stencil computes out = (c + D6*sum(neighbour - c))*decay
+// for n voxels of both substances, scale multiplies n voxels of both rows by decay in place.
+// Every variant adds the neighbours in the same order, without fused multiply-adds, so that
+// all of them give bit-identical results. The kernels for 16-bit storage convert every voxel
+// to fp32 on load, compute in fp32 and round once on store.
+typedef void (*stencil_rows_fn)(const stencil_rows &r, int64_t n, float D6, float decay);
+typedef void (*scale_rows_fn)(float *row0, float *row1, int64_t n, float decay);
+typedef void (*stencil_rows16_fn)(const stencil_rows16 &r, int64_t n, float D6, float decay);
+typedef void (*scale_rows16_fn)(uint16_t *row0, uint16_t *row1, int64_t n, float decay);
+
+void stencilRowsAVX2(const stencil_rows &r, int64_t n, float D6, float decay);
+void stencilRowsAVX512(const stencil_rows &r, int64_t n, float D6, float decay);
+void scaleRowsAVX2(float *row0, float *row1, int64_t n, float decay);
+void scaleRowsAVX512(float *row0, float *row1, int64_t n, float decay);
+
+void stencilRowsFp16AVX2(const stencil_rows16 &r, int64_t n, float D6, float decay);
+void stencilRowsFp16AVX512(const stencil_rows16 &r, int64_t n, float D6, float decay);
+void stencilRowsBf16AVX2(const stencil_rows16 &r, int64_t n, float D6, float decay);
+void stencilRowsBf16AVX512(const stencil_rows16 &r, int64_t n, float D6, float decay);
+void scaleRowsFp16AVX2(uint16_t *row0, uint16_t *row1, int64_t n, float decay);
+void scaleRowsFp16AVX512(uint16_t *row0, uint16_t *row1, int64_t n, float decay);
+void scaleRowsBf16AVX2(uint16_t *row0, uint16_t *row1, int64_t n, float decay);
+void scaleRowsBf16AVX512(uint16_t *row0, uint16_t *row1, int64_t n, float decay);
+
+// Pointers to the first interior voxel of a row of both substances, of its
+// neighbour rows in x and y, clamped at the boundary of the grid rather than
+// mirrored, and of the rows of the direction field in x, y and z.
+struct direction_rows
+{
+    const float *c[2];
+    const float *xm[2];
+    const float *xp[2];
+    const float *ym[2];
+    const float *yp[2];
+    float       *dir[3];
+};
+
+// The movement along the gradients at speed of a cell of type +1 in a voxel
+// whose gradients are g1 and g2: the difference of the normalized gradients,
+// or zero unless both are nonzero. Computes exactly what the per-cell loop of
+// runDiffusionClusterStep does, with the norms summed in the same order.
+static inline void voxelDirection(float g1x, float g1y, float g1z, float g2x, float g2y, float g2z, float speed,
+                                  float &dx, float &dy, float &dz)
+{
+    const float n1 = sqrtf(g1x*g1x + g1y*g1y + g1z*g1z);
+    const float n2 = sqrtf(g2x*g2x + g2y*g2y + g2z*g2z);
+    if((n1>0) && (n2>0)){
+        dx = (g1x/n1-g2x/n2)*speed;
+        dy = (g1y/n1-g2y/n2)*speed;
+        dz = (g1z/n1-g2z/n2)*speed;
+    } else {
+        dx = dy = dz = 0;
+    }
+}
+
+// Row kernel of directionFieldSweep: the direction of voxels [1, n-1) of a
+// row of n voxels, with central differences divided by scale[0], scale[1] and
+// scale[2] in x, y and z. Every variant gives the same result as voxelDirection.
+typedef void (*direction_rows_fn)(const direction_rows &r, int64_t n, const float scale[3], float speed);
+
+void directionRowsAVX2(const direction_rows &r, int64_t n, const float scale[3], float speed);
+void directionRowsAVX512(const direction_rows &r, int64_t n, const float scale[3], float speed);
+
+// chooses the row kernels for the given instruction set; returns the level actually used
+simd_level selectDiffusionKernels(simd_level level);
+
+// Diffusion of both substances for one time step, reading from Conc and
+// writing the result scaled by decay to nextConc. The halo of Conc must be
+// filled, and both grids must use the same storage precision. The blocked
+// variant walks the grid in tileX x tileY x tileZ tiles, streaming through x
+// within each tile, so that the three planes the stencil touches stay in
+// cache.
+void diffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay);
+void blockedDiffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay,
+                           int64_t tileX, int64_t tileY, int64_t tileZ);
+
+// Diffusion and decay like diffusionSweep, restricted to the ActiveBlocks of
+// Conc and their face neighbours, since substance moves by at most one voxel
+// per step. A block stays active while any of its voxels is above epsilon;
+// blocks that go idle are set to zero in both grids. With epsilon 0 only
+// blocks that hold nothing but zeros are dropped, so the result equals that
+// of diffusionSweep.
+void activeDiffusionSweep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay, float epsilon);
+
+// Advances the grid by batch.steps() time steps of production, diffusion and
+// decay in a single pass over memory. The grid is cut into slabs of tileY
+// rows; every slab sweeps through x as a wavefront that keeps one rolling
+// window of three planes per intermediate time level, with the slab widened
+// by one row per remaining level so that no communication between slabs is
+// needed. The production of the first step must already have been applied to
+// Conc and its halo filled; the result is written to nextConc. Only fp32
+// storage is supported.
+void temporalDiffusionSweep(const ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D, float decay,
+                            const ProductionBatch &batch, int64_t tileY);
+
+// Implicit diffusion of both substances in place, followed by decay: one
+// backward Euler step (1 - a*d2) along x, then along y, then along z, where d2
+// is the second difference with mirrored boundaries and a = D/6 times the
+// time span of the step. Every direction is a batch of tridiagonal solves, so
+// the step is stable for any a and costs three passes over the grid. Only fp32
+// storage on a single rank is supported.
+void adiDiffusionSweep(ConcentrationGrid &Conc, float a, float decay);
+
+// The movement along the gradients at speed of a cell of type +1 in every
+// voxel of the slab of Conc, as runDiffusionClusterStep computes it per cell,
+// written to dirX, dirY and dirZ in the order of the voxels. 16-bit grids are
+// converted to fp32 a row at a time. The halo planes next to other slabs must
+// be filled.
+void directionFieldSweep(const ConcentrationGrid &Conc, float speed, float *dirX, float *dirY, float *dirZ);
+
+// multiplies every interior voxel of both substances by decay
+void decaySweep(ConcentrationGrid &Conc, float decay);
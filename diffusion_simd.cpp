@@ -0,0 +1,435 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Hand-vectorized row kernels of the diffusion engines. Each function is
+// compiled for its own instruction set through the target attribute, so the
+// rest of the program stays runnable on any x86-64 CPU and
+// selectDiffusionKernels() picks the widest variant at run time. Only
+// separate multiplies and adds are used, never fused multiply-adds, so the
+// results match the scalar kernels bit for bit. The kernels for 16-bit grids
+// widen to fp32 with F16C or AVX-512F conversions, or with integer shifts
+// for bf16, and round to nearest even on store like the scalar conversions.
+
+#include <cstring>
+#include <immintrin.h>
+
+// AVX-512F implies FMA, and the compiler would otherwise contract the multiplies and adds
+#pragma GCC optimize ("fp-contract=off")
+
+// the AVX-512 intrinsics start from _mm512_undefined_*(), which GCC reports once inlined
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#include "diffusion.hpp"
+
+#define AVX2_TARGET   __attribute__((target("avx2,f16c")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+AVX2_TARGET static inline __m256i avx2TailMask(int64_t remaining)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)remaining), lanes);
+}
+
+AVX2_TARGET static inline __m256 avx2Stencil(__m256 c, __m256 xp, __m256 xm, __m256 yp, __m256 ym, __m256 zp, __m256 zm,
+                                             __m256 d, __m256 f)
+{
+    __m256 v = c;
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(xp, c), d));
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(xm, c), d));
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(yp, c), d));
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(ym, c), d));
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(zp, c), d));
+    v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(zm, c), d));
+    return _mm256_mul_ps(v, f);
+}
+
+AVX2_TARGET void stencilRowsAVX2(const stencil_rows &r, int64_t n, float D6, float decay)
+{
+    const __m256 d = _mm256_set1_ps(D6);
+    const __m256 f = _mm256_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 8 <= n; k += 8){
+        for(int s = 0; s < 2; s++){
+            const float *c = r.c[s] + k;
+            _mm256_storeu_ps(r.out[s] + k,
+                             avx2Stencil(_mm256_loadu_ps(c),
+                                         _mm256_loadu_ps(r.xp[s] + k), _mm256_loadu_ps(r.xm[s] + k),
+                                         _mm256_loadu_ps(r.yp[s] + k), _mm256_loadu_ps(r.ym[s] + k),
+                                         _mm256_loadu_ps(c + 1),       _mm256_loadu_ps(c - 1),
+                                         d, f));
+        }
+    }
+    if(k < n){
+        const __m256i m = avx2TailMask(n - k);
+        for(int s = 0; s < 2; s++){
+            const float *c = r.c[s] + k;
+            _mm256_maskstore_ps(r.out[s] + k, m,
+                                avx2Stencil(_mm256_maskload_ps(c, m),
+                                            _mm256_maskload_ps(r.xp[s] + k, m), _mm256_maskload_ps(r.xm[s] + k, m),
+                                            _mm256_maskload_ps(r.yp[s] + k, m), _mm256_maskload_ps(r.ym[s] + k, m),
+                                            _mm256_maskload_ps(c + 1, m),       _mm256_maskload_ps(c - 1, m),
+                                            d, f));
+        }
+    }
+}
+
+AVX2_TARGET void scaleRowsAVX2(float *row0, float *row1, int64_t n, float decay)
+{
+    const __m256 f = _mm256_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 8 <= n; k += 8){
+        _mm256_storeu_ps(row0 + k, _mm256_mul_ps(_mm256_loadu_ps(row0 + k), f));
+        _mm256_storeu_ps(row1 + k, _mm256_mul_ps(_mm256_loadu_ps(row1 + k), f));
+    }
+    if(k < n){
+        const __m256i m = avx2TailMask(n - k);
+        _mm256_maskstore_ps(row0 + k, m, _mm256_mul_ps(_mm256_maskload_ps(row0 + k, m), f));
+        _mm256_maskstore_ps(row1 + k, m, _mm256_mul_ps(_mm256_maskload_ps(row1 + k, m), f));
+    }
+}
+
+// loads and stores of 8 voxels of a 16-bit grid as fp32
+struct avx2_fp16
+{
+    AVX2_TARGET static inline __m256 load(const uint16_t *p)
+    {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+    }
+    AVX2_TARGET static inline void store(uint16_t *p, __m256 v)
+    {
+        _mm_storeu_si128((__m128i*)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    }
+};
+
+struct avx2_bf16
+{
+    AVX2_TARGET static inline __m256 load(const uint16_t *p)
+    {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16));
+    }
+    AVX2_TARGET static inline void store(uint16_t *p, __m256 v)
+    {
+        const __m256i u    = _mm256_castps_si256(v);
+        const __m256i odd  = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+        const __m256i rne  = _mm256_srli_epi32(_mm256_add_epi32(u, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7fff))), 16);
+        const __m256i qnan = _mm256_or_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(0x40));
+        const __m256i h    = _mm256_blendv_epi8(rne, qnan, _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+        const __m256i pack = _mm256_permute4x64_epi64(_mm256_packus_epi32(h, h), 0x08);
+        _mm_storeu_si128((__m128i*)p, _mm256_castsi256_si128(pack));
+    }
+};
+
+// copies the last m < W voxels of a row into a zero-padded buffer of W voxels
+template<int W>
+static inline const uint16_t *tail16(uint16_t (&buf)[W], const uint16_t *p, int64_t m)
+{
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, p, m*sizeof(uint16_t));
+    return buf;
+}
+
+template<class F>
+AVX2_TARGET static inline void stencilRows16AVX2(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    const __m256 d = _mm256_set1_ps(D6);
+    const __m256 f = _mm256_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 8 <= n; k += 8){
+        for(int s = 0; s < 2; s++){
+            const uint16_t *c = r.c[s] + k;
+            F::store(r.out[s] + k,
+                     avx2Stencil(F::load(c),
+                                 F::load(r.xp[s] + k), F::load(r.xm[s] + k),
+                                 F::load(r.yp[s] + k), F::load(r.ym[s] + k),
+                                 F::load(c + 1),       F::load(c - 1),
+                                 d, f));
+        }
+    }
+    if(k < n){
+        const int64_t m = n - k;
+        for(int s = 0; s < 2; s++){
+            const uint16_t *c = r.c[s] + k;
+            uint16_t b[7][8], out[8];
+            F::store(out,
+                     avx2Stencil(F::load(tail16(b[0], c, m)),
+                                 F::load(tail16(b[1], r.xp[s] + k, m)), F::load(tail16(b[2], r.xm[s] + k, m)),
+                                 F::load(tail16(b[3], r.yp[s] + k, m)), F::load(tail16(b[4], r.ym[s] + k, m)),
+                                 F::load(tail16(b[5], c + 1, m)),       F::load(tail16(b[6], c - 1, m)),
+                                 d, f));
+            memcpy(r.out[s] + k, out, m*sizeof(uint16_t));
+        }
+    }
+}
+
+template<class F>
+AVX2_TARGET static inline void scaleRows16AVX2(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    const __m256 f = _mm256_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 8 <= n; k += 8){
+        F::store(row0 + k, _mm256_mul_ps(F::load(row0 + k), f));
+        F::store(row1 + k, _mm256_mul_ps(F::load(row1 + k), f));
+    }
+    if(k < n){
+        const int64_t m = n - k;
+        uint16_t b[8];
+        F::store(b, _mm256_mul_ps(F::load(tail16(b, row0 + k, m)), f));
+        memcpy(row0 + k, b, m*sizeof(uint16_t));
+        F::store(b, _mm256_mul_ps(F::load(tail16(b, row1 + k, m)), f));
+        memcpy(row1 + k, b, m*sizeof(uint16_t));
+    }
+}
+
+AVX2_TARGET void stencilRowsFp16AVX2(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    stencilRows16AVX2<avx2_fp16>(r, n, D6, decay);
+}
+
+AVX2_TARGET void stencilRowsBf16AVX2(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    stencilRows16AVX2<avx2_bf16>(r, n, D6, decay);
+}
+
+AVX2_TARGET void scaleRowsFp16AVX2(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    scaleRows16AVX2<avx2_fp16>(row0, row1, n, decay);
+}
+
+AVX2_TARGET void scaleRowsBf16AVX2(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    scaleRows16AVX2<avx2_bf16>(row0, row1, n, decay);
+}
+
+// the direction of 8 voxels from the neighbours of both substances in x, y and z, as voxelDirection
+AVX2_TARGET static inline void avx2Direction(const __m256 (&g)[2][3], __m256 speed, __m256 (&dir)[3])
+{
+    __m256 norm[2];
+    for(int s = 0; s < 2; s++)
+        norm[s] = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(g[s][0], g[s][0]), _mm256_mul_ps(g[s][1], g[s][1])),
+                                               _mm256_mul_ps(g[s][2], g[s][2])));
+    const __m256 zero  = _mm256_setzero_ps();
+    const __m256 moves = _mm256_and_ps(_mm256_cmp_ps(norm[0], zero, _CMP_GT_OQ), _mm256_cmp_ps(norm[1], zero, _CMP_GT_OQ));
+    for(int d = 0; d < 3; d++)
+        dir[d] = _mm256_and_ps(moves, _mm256_mul_ps(_mm256_sub_ps(_mm256_div_ps(g[0][d], norm[0]), _mm256_div_ps(g[1][d], norm[1])),
+                                                    speed));
+}
+
+AVX2_TARGET void directionRowsAVX2(const direction_rows &r, int64_t n, const float scale[3], float speed)
+{
+    const __m256 sx = _mm256_set1_ps(scale[0]), sy = _mm256_set1_ps(scale[1]), sz = _mm256_set1_ps(scale[2]);
+    const __m256 sp = _mm256_set1_ps(speed);
+
+    for(int64_t k = 1; k < n-1; k += 8){
+        const __m256i m = avx2TailMask(n-1 - k);
+        __m256 g[2][3], dir[3];
+        for(int s = 0; s < 2; s++){
+            g[s][0] = _mm256_div_ps(_mm256_sub_ps(_mm256_maskload_ps(r.xp[s] + k, m), _mm256_maskload_ps(r.xm[s] + k, m)), sx);
+            g[s][1] = _mm256_div_ps(_mm256_sub_ps(_mm256_maskload_ps(r.yp[s] + k, m), _mm256_maskload_ps(r.ym[s] + k, m)), sy);
+            g[s][2] = _mm256_div_ps(_mm256_sub_ps(_mm256_maskload_ps(r.c[s] + k + 1, m), _mm256_maskload_ps(r.c[s] + k - 1, m)), sz);
+        }
+        avx2Direction(g, sp, dir);
+        for(int d = 0; d < 3; d++)
+            _mm256_maskstore_ps(r.dir[d] + k, m, dir[d]);
+    }
+}
+
+AVX512_TARGET static inline __m512 avx512Stencil(__m512 c, __m512 xp, __m512 xm, __m512 yp, __m512 ym, __m512 zp, __m512 zm,
+                                                 __m512 d, __m512 f)
+{
+    __m512 v = c;
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(xp, c), d));
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(xm, c), d));
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(yp, c), d));
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(ym, c), d));
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(zp, c), d));
+    v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_sub_ps(zm, c), d));
+    return _mm512_mul_ps(v, f);
+}
+
+AVX512_TARGET void stencilRowsAVX512(const stencil_rows &r, int64_t n, float D6, float decay)
+{
+    const __m512 d = _mm512_set1_ps(D6);
+    const __m512 f = _mm512_set1_ps(decay);
+
+    for(int64_t k = 0; k < n; k += 16){
+        const __mmask16 m = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+        for(int s = 0; s < 2; s++){
+            const float *c = r.c[s] + k;
+            _mm512_mask_storeu_ps(r.out[s] + k, m,
+                                  avx512Stencil(_mm512_maskz_loadu_ps(m, c),
+                                                _mm512_maskz_loadu_ps(m, r.xp[s] + k), _mm512_maskz_loadu_ps(m, r.xm[s] + k),
+                                                _mm512_maskz_loadu_ps(m, r.yp[s] + k), _mm512_maskz_loadu_ps(m, r.ym[s] + k),
+                                                _mm512_maskz_loadu_ps(m, c + 1),       _mm512_maskz_loadu_ps(m, c - 1),
+                                                d, f));
+        }
+    }
+}
+
+AVX512_TARGET void scaleRowsAVX512(float *row0, float *row1, int64_t n, float decay)
+{
+    const __m512 f = _mm512_set1_ps(decay);
+
+    for(int64_t k = 0; k < n; k += 16){
+        const __mmask16 m = (n - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - k)) - 1);
+        _mm512_mask_storeu_ps(row0 + k, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, row0 + k), f));
+        _mm512_mask_storeu_ps(row1 + k, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, row1 + k), f));
+    }
+}
+
+struct avx512_fp16
+{
+    AVX512_TARGET static inline __m512 load(const uint16_t *p)
+    {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p));
+    }
+    AVX512_TARGET static inline void store(uint16_t *p, __m512 v)
+    {
+        _mm256_storeu_si256((__m256i*)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    }
+};
+
+struct avx512_bf16
+{
+    AVX512_TARGET static inline __m512 load(const uint16_t *p)
+    {
+        return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p)), 16));
+    }
+    AVX512_TARGET static inline void store(uint16_t *p, __m512 v)
+    {
+        const __m512i u    = _mm512_castps_si512(v);
+        const __m512i odd  = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+        const __m512i rne  = _mm512_srli_epi32(_mm512_add_epi32(u, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7fff))), 16);
+        const __m512i qnan = _mm512_or_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(0x40));
+        const __m512i h    = _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q), rne, qnan);
+        _mm256_storeu_si256((__m256i*)p, _mm512_cvtepi32_epi16(h));
+    }
+};
+
+template<class F>
+AVX512_TARGET static inline void stencilRows16AVX512(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    const __m512 d = _mm512_set1_ps(D6);
+    const __m512 f = _mm512_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 16 <= n; k += 16){
+        for(int s = 0; s < 2; s++){
+            const uint16_t *c = r.c[s] + k;
+            F::store(r.out[s] + k,
+                     avx512Stencil(F::load(c),
+                                   F::load(r.xp[s] + k), F::load(r.xm[s] + k),
+                                   F::load(r.yp[s] + k), F::load(r.ym[s] + k),
+                                   F::load(c + 1),       F::load(c - 1),
+                                   d, f));
+        }
+    }
+    // masked 16-bit loads would need AVX-512BW, so the tail goes through a buffer
+    if(k < n){
+        const int64_t m = n - k;
+        for(int s = 0; s < 2; s++){
+            const uint16_t *c = r.c[s] + k;
+            uint16_t b[7][16], out[16];
+            F::store(out,
+                     avx512Stencil(F::load(tail16(b[0], c, m)),
+                                   F::load(tail16(b[1], r.xp[s] + k, m)), F::load(tail16(b[2], r.xm[s] + k, m)),
+                                   F::load(tail16(b[3], r.yp[s] + k, m)), F::load(tail16(b[4], r.ym[s] + k, m)),
+                                   F::load(tail16(b[5], c + 1, m)),       F::load(tail16(b[6], c - 1, m)),
+                                   d, f));
+            memcpy(r.out[s] + k, out, m*sizeof(uint16_t));
+        }
+    }
+}
+
+template<class F>
+AVX512_TARGET static inline void scaleRows16AVX512(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    const __m512 f = _mm512_set1_ps(decay);
+
+    int64_t k = 0;
+    for(; k + 16 <= n; k += 16){
+        F::store(row0 + k, _mm512_mul_ps(F::load(row0 + k), f));
+        F::store(row1 + k, _mm512_mul_ps(F::load(row1 + k), f));
+    }
+    if(k < n){
+        const int64_t m = n - k;
+        uint16_t b[16];
+        F::store(b, _mm512_mul_ps(F::load(tail16(b, row0 + k, m)), f));
+        memcpy(row0 + k, b, m*sizeof(uint16_t));
+        F::store(b, _mm512_mul_ps(F::load(tail16(b, row1 + k, m)), f));
+        memcpy(row1 + k, b, m*sizeof(uint16_t));
+    }
+}
+
+AVX512_TARGET void stencilRowsFp16AVX512(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    stencilRows16AVX512<avx512_fp16>(r, n, D6, decay);
+}
+
+AVX512_TARGET void stencilRowsBf16AVX512(const stencil_rows16 &r, int64_t n, float D6, float decay)
+{
+    stencilRows16AVX512<avx512_bf16>(r, n, D6, decay);
+}
+
+AVX512_TARGET void scaleRowsFp16AVX512(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    scaleRows16AVX512<avx512_fp16>(row0, row1, n, decay);
+}
+
+AVX512_TARGET void scaleRowsBf16AVX512(uint16_t *row0, uint16_t *row1, int64_t n, float decay)
+{
+    scaleRows16AVX512<avx512_bf16>(row0, row1, n, decay);
+}
+
+AVX512_TARGET void directionRowsAVX512(const direction_rows &r, int64_t n, const float scale[3], float speed)
+{
+    const __m512 sx = _mm512_set1_ps(scale[0]), sy = _mm512_set1_ps(scale[1]), sz = _mm512_set1_ps(scale[2]);
+    const __m512 sp = _mm512_set1_ps(speed);
+
+    for(int64_t k = 1; k < n-1; k += 16){
+        const __mmask16 m = (n-1 - k >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n-1 - k)) - 1);
+        __m512 g[2][3], norm[2];
+        for(int s = 0; s < 2; s++){
+            g[s][0] = _mm512_div_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, r.xp[s] + k), _mm512_maskz_loadu_ps(m, r.xm[s] + k)), sx);
+            g[s][1] = _mm512_div_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, r.yp[s] + k), _mm512_maskz_loadu_ps(m, r.ym[s] + k)), sy);
+            g[s][2] = _mm512_div_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, r.c[s] + k + 1), _mm512_maskz_loadu_ps(m, r.c[s] + k - 1)), sz);
+            norm[s] = _mm512_sqrt_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(g[s][0], g[s][0]), _mm512_mul_ps(g[s][1], g[s][1])),
+                                                   _mm512_mul_ps(g[s][2], g[s][2])));
+        }
+        // lanes where a norm is not positive are written as zero
+        const __mmask16 moves = _mm512_cmp_ps_mask(norm[0], _mm512_setzero_ps(), _CMP_GT_OQ) &
+                                _mm512_cmp_ps_mask(norm[1], _mm512_setzero_ps(), _CMP_GT_OQ);
+        for(int d = 0; d < 3; d++)
+            _mm512_mask_storeu_ps(r.dir[d] + k, m,
+                                  _mm512_maskz_mul_ps(moves, _mm512_sub_ps(_mm512_div_ps(g[0][d], norm[0]), _mm512_div_ps(g[1][d], norm[1])), sp));
+    }
+}
@@ -0,0 +1,241 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef CDC_MPI
+#include <mpi.h>
+#endif
+
+#include "util.hpp"
+#include "grid.hpp"
+#include "domain.hpp"
+
+using namespace std;
+
+void initDomain(int *argc, char ***argv)
+{
+#ifdef CDC_MPI
+    int provided;
+    MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if(rank != 0){
+        if(!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+            die("Could not silence rank %d!\n", rank);
+    }
+#else
+    (void)argc;
+    (void)argv;
+#endif
+}
+
+void finalizeDomain()
+{
+#ifdef CDC_MPI
+    MPI_Finalize();
+#endif
+}
+
+Domain makeDomain(int64_t L)
+{
+    Domain d;
+    d.rank  = 0;
+    d.ranks = 1;
+#ifdef CDC_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &d.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &d.ranks);
+#endif
+    if(L < d.ranks)
+        die("The grid has fewer planes (%lld) than there are ranks (%d)!\n", (long long int)L, d.ranks);
+
+    d.L          = L;
+    d.firstPlane = L*d.rank/d.ranks;
+    d.endPlane   = L*(d.rank + 1)/d.ranks;
+    return d;
+}
+
+int64_t sumOverRanks(int64_t v)
+{
+#ifdef CDC_MPI
+    long long int in = v, out = 0;
+    MPI_Allreduce(&in, &out, 1, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+    return out;
+#else
+    return v;
+#endif
+}
+
+#ifdef CDC_MPI
+// one cell on its way to another rank
+struct cell_record
+{
+    float    x, y, z;
+    float    movX, movY, movZ;
+    float    path;
+    int      type;
+    int      divisions;
+    uint32_t id;
+};
+#endif
+
+int64_t migrateCells(CellStore &cells, int64_t n, const Domain &d)
+{
+#ifdef CDC_MPI
+    if(d.ranks == 1)
+        return n;
+
+    const float sideLength = 1/(float)d.L;
+    const int   P          = d.ranks;
+
+    // destination of every cell, and how many go to each rank
+    vector<int> dest(n);
+    vector<int> sendCount(P, 0), recvCount(P, 0);
+    for(int64_t c = 0; c < n; c++){
+        dest[c] = d.owner(voxelOf(cells.x[c], sideLength, d.L - 1));
+        if(dest[c] != d.rank)
+            sendCount[dest[c]]++;
+    }
+
+    vector<int> sendStart(P + 1, 0);
+    for(int r = 0; r < P; r++)
+        sendStart[r + 1] = sendStart[r] + sendCount[r];
+
+    // pack the leaving cells by destination and close the gaps they leave, keeping the order
+    vector<cell_record> out(sendStart[P]);
+    vector<int> cursor(sendStart.begin(), sendStart.end() - 1);
+    int64_t kept = 0;
+    for(int64_t c = 0; c < n; c++){
+        if(dest[c] != d.rank){
+            cell_record &r = out[cursor[dest[c]]++];
+            r.x         = cells.x[c];
+            r.y         = cells.y[c];
+            r.z         = cells.z[c];
+            r.movX      = cells.movX[c];
+            r.movY      = cells.movY[c];
+            r.movZ      = cells.movZ[c];
+            r.path      = cells.path[c];
+            r.type      = cells.type[c];
+            r.divisions = cells.divisions[c];
+            r.id        = cells.id[c];
+            continue;
+        }
+        cells.x[kept]         = cells.x[c];
+        cells.y[kept]         = cells.y[c];
+        cells.z[kept]         = cells.z[c];
+        cells.movX[kept]      = cells.movX[c];
+        cells.movY[kept]      = cells.movY[c];
+        cells.movZ[kept]      = cells.movZ[c];
+        cells.path[kept]      = cells.path[c];
+        cells.type[kept]      = cells.type[c];
+        cells.divisions[kept] = cells.divisions[c];
+        cells.id[kept]        = cells.id[c];
+        kept++;
+    }
+
+    MPI_Alltoall(&sendCount[0], 1, MPI_INT, &recvCount[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+    const int rec = sizeof(cell_record);
+    vector<int> sendBytes(P), sendDispl(P), recvBytes(P), recvDispl(P);
+    int received = 0;
+    for(int r = 0; r < P; r++){
+        sendBytes[r] = sendCount[r]*rec;
+        sendDispl[r] = sendStart[r]*rec;
+        recvBytes[r] = recvCount[r]*rec;
+        recvDispl[r] = received*rec;
+        received    += recvCount[r];
+    }
+
+    vector<cell_record> in(received);
+    MPI_Alltoallv(out.empty() ? 0 : &out[0], &sendBytes[0], &sendDispl[0], MPI_BYTE,
+                  in.empty()  ? 0 : &in[0],  &recvBytes[0], &recvDispl[0], MPI_BYTE, MPI_COMM_WORLD);
+
+    if(kept + received > cells.capacity)
+        cells.reserve(max(kept + received, cells.capacity + cells.capacity/2), kept);
+
+    for(int i = 0; i < received; i++){
+        const cell_record &r = in[i];
+        const int64_t c = kept + i;
+        cells.x[c]         = r.x;
+        cells.y[c]         = r.y;
+        cells.z[c]         = r.z;
+        cells.movX[c]      = r.movX;
+        cells.movY[c]      = r.movY;
+        cells.movZ[c]      = r.movZ;
+        cells.path[c]      = r.path;
+        cells.type[c]      = r.type;
+        cells.divisions[c] = r.divisions;
+        cells.id[c]        = r.id;
+    }
+    return kept + received;
+#else
+    (void)cells;
+    (void)d;
+    return n;
+#endif
+}
+
+void gatherAtRoot(vector<char> &bytes)
+{
+#ifdef CDC_MPI
+    int rank, P;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &P);
+
+    int size = (int)bytes.size();
+    vector<int> sizes(P), displ(P, 0);
+    MPI_Gather(&size, 1, MPI_INT, &sizes[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    int total = 0;
+    for(int r = 0; r < P; r++){
+        displ[r] = total;
+        total   += sizes[r];
+    }
+
+    vector<char> all(rank == 0 ? total : 0);
+    MPI_Gatherv(bytes.empty() ? 0 : &bytes[0], size, MPI_BYTE,
+                all.empty() ? 0 : &all[0], &sizes[0], &displ[0], MPI_BYTE, 0, MPI_COMM_WORLD);
+    bytes.swap(all);
+#else
+    (void)bytes;
+#endif
+}
+
+void broadcastFromRoot(void *data, size_t bytes)
+{
+#ifdef CDC_MPI
+    MPI_Bcast(data, (int)bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cells.hpp"
+
+// Decomposition of the L^3 grid into slabs of consecutive planes in x, one
+// per MPI rank. Every rank holds the grid planes of its slab and the cells
+// whose voxel lies in them. Without CDC_MPI there is a single rank that owns
+// the whole grid, and the functions below do nothing.
+struct Domain
+{
+    int     rank;
+    int     ranks;
+    int64_t L;
+    int64_t firstPlane; // this rank owns the planes [firstPlane, endPlane)
+    int64_t endPlane;
+
+    int64_t planes() const { return endPlane - firstPlane; }
+    bool    root() const   { return rank == 0; }
+
+    // ranks owning the neighbouring slabs, -1 at the boundary of the grid
+    int lower() const { return rank > 0 ? rank - 1 : -1; }
+    int upper() const { return rank < ranks - 1 ? rank + 1 : -1; }
+
+    // rank owning plane i
+    int owner(int64_t i) const { return (int)(((i + 1)*ranks - 1)/L); }
+};
+
+// starts MPI; output of all but the first rank is discarded
+void initDomain(int *argc, char ***argv);
+void finalizeDomain();
+
+// the slab of this rank for a grid of L^3 voxels
+Domain makeDomain(int64_t L);
+
+int64_t sumOverRanks(int64_t v);
+
+// Sends every one of the first n cells whose voxel lies in another slab to
+// the rank owning it and appends the cells received from the others, growing
+// the store if needed. Returns the new number of cells of this rank.
+int64_t migrateCells(CellStore &cells, int64_t n, const Domain &d);
+
+// concatenates the buffers of all ranks, in rank order, on the first rank
+void gatherAtRoot(std::vector<char> &bytes);
+
+void broadcastFromRoot(void *data, size_t bytes);
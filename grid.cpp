@@ -0,0 +1,194 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstring>
+#include <cstdlib>
+
+#ifdef CDC_MPI
+#include <mpi.h>
+#endif
+
+#include "util.hpp"
+#include "grid.hpp"
+
+const char *grid_precision_name(grid_precision p)
+{
+    switch(p){
+    case GRID_FP16: return "fp16";
+    case GRID_BF16: return "bf16";
+    default:        return "fp32";
+    }
+}
+
+ConcentrationGrid::ConcentrationGrid(int64_t L_, grid_precision precision, int64_t firstPlane, int64_t planes)
+{
+    L                = L_;
+    firstPlane_      = firstPlane;
+    planes_          = planes < 0 ? L : planes;
+    lowerRank        = -1;
+    upperRank        = -1;
+    precision_       = precision;
+    rowStride_       = (GRID_PAD + L + 1 + GRID_PAD - 1)/GRID_PAD*GRID_PAD;
+    planeStride_     = (L + 2)*rowStride_;
+    substanceStride_ = (planes_ + 2)*planeStride_;
+
+    data   = (char*)alloc_aligned(2*substanceStride_*elementSize(), GRID_ALIGN);
+    active = 0;
+    clear();
+}
+
+ConcentrationGrid::~ConcentrationGrid()
+{
+    delete active;
+    free(data);
+}
+
+ActiveBlocks::ActiveBlocks(int64_t L, int64_t blockSize)
+{
+    B             = blockSize;
+    nb            = (L + B - 1)/B;
+    steppedBlocks = 0;
+    sweeps        = 0;
+    flags.assign(nb*nb*nb, 0);
+}
+
+void ConcentrationGrid::trackActiveBlocks(int64_t blockSize)
+{
+    if(distributed())
+        die("Active blocks are only tracked on the whole grid!\n");
+
+    delete active;
+    active = new ActiveBlocks(L, blockSize);
+
+    // a block starts out active if any of its voxels is nonzero
+    const size_t  e  = elementSize();
+    const int64_t nb = active->blocksPerSide();
+    int64_t b;
+#pragma omp parallel for schedule(dynamic)
+    for(b = 0; b < active->numBlocks(); b++){
+        const int64_t i0 = b/(nb*nb)*blockSize, j0 = b/nb%nb*blockSize, k0 = b%nb*blockSize;
+        const int64_t i1 = std::min(L, i0 + blockSize), j1 = std::min(L, j0 + blockSize), k1 = std::min(L, k0 + blockSize);
+        bool nonzero = false;
+        for(int s = 0; s < 2 && !nonzero; s++){
+            const char *C = data + s*substanceStride_*e;
+            for(int64_t i = i0; i < i1 && !nonzero; i++)
+                for(int64_t j = j0; j < j1 && !nonzero; j++){
+                    const char *row = C + offset(i, j, k0)*e;
+                    for(size_t k = 0; k < (k1 - k0)*e; k++)
+                        nonzero |= row[k] != 0;
+                }
+        }
+        active->setActive(b, nonzero);
+    }
+}
+
+void ConcentrationGrid::clearBlock(int64_t i0, int64_t i1, int64_t j0, int64_t j1, int64_t k0, int64_t k1)
+{
+    const size_t e = elementSize();
+    for(int s = 0; s < 2; s++){
+        char *C = data + s*substanceStride_*e;
+        for(int64_t i = i0; i < i1; i++)
+            for(int64_t j = j0; j < j1; j++)
+                memset(C + offset(i, j, k0)*e, 0, (k1 - k0)*e);
+    }
+}
+
+void ConcentrationGrid::clear()
+{
+    const size_t planeBytes = planeStride_*elementSize();
+
+    // touch the planes in parallel so that they are spread across the memory of all threads
+    int64_t p;
+#pragma omp parallel for
+    for(p = 0; p < 2*(planes_+2); p++)
+        memset(data + p*planeBytes, 0, planeBytes);
+}
+
+// mirrors the z halo of every interior row of one substance
+template<typename T>
+static void fillRowHalo(T *C, const ConcentrationGrid &g)
+{
+    const int64_t L = g.size();
+
+    int64_t i;
+#pragma omp parallel for
+    for(i = 0; i < g.planes(); i++){
+        for(int64_t j = 0; j < L; j++){
+            T *row = C + g.offset(i, j, 0);
+            row[-1] = row[0];
+            row[L]  = row[L-1];
+        }
+    }
+}
+
+void ConcentrationGrid::fillHalo()
+{
+    const size_t e = elementSize();
+
+    for(int s = 0; s < 2; s++){
+        char *C = data + s*substanceStride_*e;
+
+        // z halo of every interior row
+        if(precision_ == GRID_FP32)
+            fillRowHalo((float*)C, *this);
+        else
+            fillRowHalo((uint16_t*)C, *this);
+
+        // y halo rows of every interior plane
+        int64_t i;
+#pragma omp parallel for
+        for(i = 0; i < planes_; i++){
+            memcpy(C + offset(i, -1, -1)*e, C + offset(i, 0,   -1)*e, (rowStride_ - (GRID_PAD-1))*e);
+            memcpy(C + offset(i, L,  -1)*e, C + offset(i, L-1, -1)*e, (rowStride_ - (GRID_PAD-1))*e);
+        }
+
+        // x halo planes at the boundary of the grid
+        const int64_t last = planes_ - 1;
+        if(lowerRank < 0)
+            memcpy(C + offset(-1, -1, -1)*e, C + offset(0,    -1, -1)*e, (planeStride_ - (GRID_PAD-1))*e);
+        if(upperRank < 0)
+            memcpy(C + offset(planes_, -1, -1)*e, C + offset(last, -1, -1)*e, (planeStride_ - (GRID_PAD-1))*e);
+    }
+
+#ifdef CDC_MPI
+    // x halo planes next to the neighbouring slabs; each plane is sent whole, with its y and z halo
+    const int planeBytes = (int)(planeStride_*e);
+    for(int s = 0; s < 2; s++){
+        char *C = data + s*substanceStride_*e;
+        char *halo[2]  = { C, C + (planes_ + 1)*planeBytes };               // planes -1 and planes
+        char *inner[2] = { C + planeBytes, C + planes_*planeBytes };         // planes 0 and planes-1
+        const int lower = lowerRank < 0 ? MPI_PROC_NULL : lowerRank;
+        const int upper = upperRank < 0 ? MPI_PROC_NULL : upperRank;
+        MPI_Sendrecv(inner[1], planeBytes, MPI_BYTE, upper, 2*s,     halo[0], planeBytes, MPI_BYTE, lower, 2*s,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(inner[0], planeBytes, MPI_BYTE, lower, 2*s + 1, halo[1], planeBytes, MPI_BYTE, upper, 2*s + 1,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+#endif
+}
@@ -0,0 +1,265 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+static const int64_t GRID_ALIGN = 64;                       // alignment (in bytes) of the grid buffer and of every row
+static const int64_t GRID_PAD   = GRID_ALIGN/sizeof(float); // offset of the first interior voxel within a row
+
+// how the concentrations are stored; the kernels always compute in fp32
+enum grid_precision
+{
+    GRID_FP32,
+    GRID_FP16, // IEEE half precision
+    GRID_BF16, // upper half of an fp32
+};
+
+const char *grid_precision_name(grid_precision p);
+
+static inline uint32_t floatBits(float f)    { uint32_t u; memcpy(&u, &f, sizeof(u)); return u; }
+static inline float    bitsFloat(uint32_t u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+
+// Exact conversions between fp32 and the 16-bit formats, rounding to nearest
+// even like the F16C and AVX-512 instructions do, so that the scalar and the
+// vector kernels give identical results. Subnormals are kept.
+static inline uint16_t floatToHalf(float value)
+{
+    const uint32_t f32infty     = 255u << 23;
+    const uint32_t f16max       = (127u + 16) << 23;
+    const uint32_t denormMagic  = ((127u - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t f = floatBits(value);
+    const uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint32_t o;
+    if(f >= f16max)
+        o = (f > f32infty) ? 0x7e00 : 0x7c00; // NaN stays NaN, everything else too large becomes inf
+    else if(f < (113u << 23))
+        o = floatBits(bitsFloat(f) + bitsFloat(denormMagic)) - denormMagic; // the fp32 add rounds the subnormal
+    else{
+        const uint32_t mantOdd = (f >> 13) & 1;
+        f += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        f += mantOdd;
+        o = f >> 13;
+    }
+    return (uint16_t)(o | (sign >> 16));
+}
+
+static inline float halfToFloat(uint16_t h)
+{
+    const uint32_t shiftedExp = 0x7c00u << 13;
+
+    uint32_t o = (uint32_t)(h & 0x7fff) << 13;
+    const uint32_t exp = shiftedExp & o;
+    o += (127u - 15) << 23;
+    if(exp == shiftedExp)
+        o += (128u - 16) << 23; // inf or NaN
+    else if(exp == 0){
+        o += 1u << 23;          // zero or subnormal, renormalized by the fp32 subtraction
+        o = floatBits(bitsFloat(o) - bitsFloat(113u << 23));
+    }
+    return bitsFloat(o | ((uint32_t)(h & 0x8000) << 16));
+}
+
+static inline uint16_t floatToBf16(float value)
+{
+    uint32_t u = floatBits(value);
+    if((u & 0x7fffffffu) > 0x7f800000u)
+        return (uint16_t)((u >> 16) | 0x40); // quiet NaN
+    u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+static inline float bf16ToFloat(uint16_t h)
+{
+    return bitsFloat((uint32_t)h << 16);
+}
+
+// index of the voxel holding position pos along one axis, for voxels of the given side length
+static inline int voxelOf(float pos, float sideLength, int last)
+{
+    return std::min((int)std::floor(pos/sideLength), last);
+}
+
+// The set of blocks of blockSize^3 voxels that may hold substance. A block
+// that is not active holds only zeros, in both buffers of a double-buffered
+// grid, so the diffusion of a time step only has to visit the active blocks
+// and their face neighbours.
+class ActiveBlocks
+{
+public:
+    ActiveBlocks(int64_t L, int64_t blockSize);
+
+    int64_t blockSize() const     { return B; }
+    int64_t blocksPerSide() const { return nb; }
+    int64_t numBlocks() const     { return nb*nb*nb; }
+
+    int64_t index(int64_t bx, int64_t by, int64_t bz) const { return (bx*nb + by)*nb + bz; }
+
+    bool active(int64_t b) const  { return flags[b] != 0; }
+    void setActive(int64_t b, bool a) { flags[b] = a; }
+
+    // activates the block holding voxel (i,j,k); safe to call from several threads
+    void markVoxel(int64_t i, int64_t j, int64_t k)
+    {
+        unsigned char &f = flags[index(i/B, j/B, k/B)];
+#pragma omp atomic write
+        f = 1;
+    }
+
+    // blocks visited by the sweeps so far, for reporting
+    int64_t steppedBlocks;
+    int64_t sweeps;
+
+private:
+    int64_t B;
+    int64_t nb;
+    std::vector<unsigned char> flags;
+};
+
+// Concentrations of both substances on an L^3 voxel grid, or on the slab of
+// planes [firstPlane, firstPlane + planes) in x of it, held in one
+// contiguous, 64-byte-aligned buffer. Plane indices are local to the slab. Every row, plane and substance is
+// surrounded by a one-voxel ghost halo so that stencils need no boundary
+// branches; fillHalo() mirrors the outermost interior voxels into the halo,
+// which makes the ghost neighbours contribute zero flux. Rows are padded so
+// that the first interior voxel of each row starts GRID_PAD elements into
+// the row, which is a GRID_ALIGN boundary for fp32 storage and half of one
+// for the 16-bit formats. A grid can track its ActiveBlocks; the set belongs
+// to the grid object, not to its buffer, so it is not exchanged by swap().
+// The halo planes of a slab next to another slab are received from the rank
+// that owns it (see setNeighbours()) instead of being mirrored.
+class ConcentrationGrid
+{
+public:
+    explicit ConcentrationGrid(int64_t L, grid_precision precision = GRID_FP32, int64_t firstPlane = 0, int64_t planes = -1);
+    ~ConcentrationGrid();
+
+    int64_t size() const            { return L; }
+    int64_t firstPlane() const      { return firstPlane_; }
+    int64_t planes() const          { return planes_; }
+    bool distributed() const        { return planes_ != L; }
+    grid_precision precision() const { return precision_; }
+    size_t elementSize() const      { return precision_ == GRID_FP32 ? sizeof(float) : sizeof(uint16_t); }
+    int64_t rowStride() const       { return rowStride_; }
+    int64_t planeStride() const     { return planeStride_; }
+    int64_t substanceStride() const { return substanceStride_; }
+
+    // offset of interior voxel (i,j,k) from the start of a substance; -1 and L (planes() for i)
+    // address the halo
+    int64_t offset(int64_t i, int64_t j, int64_t k) const
+    {
+        return (i+1)*planeStride_ + (j+1)*rowStride_ + GRID_PAD + k;
+    }
+
+    // direct access to the voxels, only for GRID_FP32 storage
+    float *substance(int s)             { return (float*)data + s*substanceStride_; }
+    const float *substance(int s) const { return (const float*)data + s*substanceStride_; }
+
+    float &at(int s, int64_t i, int64_t j, int64_t k)       { return substance(s)[offset(i, j, k)]; }
+    float  at(int s, int64_t i, int64_t j, int64_t k) const { return substance(s)[offset(i, j, k)]; }
+
+    // direct access to the voxels, only for GRID_FP16 and GRID_BF16 storage
+    uint16_t *substance16(int s)             { return (uint16_t*)data + s*substanceStride_; }
+    const uint16_t *substance16(int s) const { return (const uint16_t*)data + s*substanceStride_; }
+
+    // reads and writes one voxel in any storage precision
+    float get(int s, int64_t i, int64_t j, int64_t k) const
+    {
+        const int64_t o = s*substanceStride_ + offset(i, j, k);
+        switch(precision_){
+        case GRID_FP16: return halfToFloat(((const uint16_t*)data)[o]);
+        case GRID_BF16: return bf16ToFloat(((const uint16_t*)data)[o]);
+        default:        return ((const float*)data)[o];
+        }
+    }
+
+    void set(int s, int64_t i, int64_t j, int64_t k, float v)
+    {
+        const int64_t o = s*substanceStride_ + offset(i, j, k);
+        switch(precision_){
+        case GRID_FP16: ((uint16_t*)data)[o] = floatToHalf(v); break;
+        case GRID_BF16: ((uint16_t*)data)[o] = floatToBf16(v); break;
+        default:        ((float*)data)[o]    = v;              break;
+        }
+    }
+
+    // the whole buffer of both substances, halo included, as it is laid out in memory
+    void *raw()                     { return data; }
+    const void *raw() const         { return data; }
+    size_t rawBytes() const         { return 2*substanceStride_*elementSize(); }
+
+    // sets every voxel, including the halo, to zero
+    void clear();
+
+    // exchanges the buffers of two grids of the same size and precision
+    void swap(ConcentrationGrid &o)
+    {
+        char *t = data;
+        data     = o.data;
+        o.data   = t;
+    }
+
+    // mirrors the boundary voxels of both substances into the ghost halo; with neighbours, the
+    // halo planes towards them are exchanged instead, so every rank has to call it
+    void fillHalo();
+
+    // MPI ranks owning the slabs below and above this one, -1 at the boundary of the grid
+    void setNeighbours(int lower, int upper) { lowerRank = lower; upperRank = upper; }
+
+    // starts tracking the blocks that hold substance, starting from those with a nonzero voxel
+    void trackActiveBlocks(int64_t blockSize);
+    ActiveBlocks *activeBlocks() const { return active; }
+
+    // sets the interior voxels [i0,i1) x [j0,j1) x [k0,k1) of both substances to zero
+    void clearBlock(int64_t i0, int64_t i1, int64_t j0, int64_t j1, int64_t k0, int64_t k1);
+
+private:
+    ConcentrationGrid(const ConcentrationGrid &);
+    ConcentrationGrid &operator=(const ConcentrationGrid &);
+
+    int64_t L;
+    int64_t firstPlane_;
+    int64_t planes_;
+    int     lowerRank;
+    int     upperRank;
+    grid_precision precision_;
+    int64_t rowStride_;
+    int64_t planeStride_;
+    int64_t substanceStride_;
+    char   *data;
+    ActiveBlocks *active;
+};
@@ -0,0 +1,160 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <time.h>
+#include <omp.h>
+
+#include "util.hpp"
+#include "insitu.hpp"
+
+using namespace std;
+
+static double monotonicSeconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+InsituPool::InsituPool(int threads, int pending, insitu_fn fn, void *ctx, const char *path)
+    : fn(fn), ctx(ctx), path(path), jobs(threads + pending), running(0), submitted(0), nextWritten(0), stop(false),
+      threads(threads), completed_(0), dropped_(0), maxLatency_(0)
+{
+    out = fopen(path, "w");
+    if(!out)
+        die("Could not create %s: %s\n", path, strerror(errno));
+    fprintf(out, "step,subvolume_cells,close_pairs,correctness,energy,criterion,latency_s\n");
+    fflush(out);
+
+    for(size_t j = 0; j < jobs.size(); j++)
+        free_.push_back(&jobs[j]);
+
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&wake, 0);
+    pthread_cond_init(&idle, 0);
+    for(size_t t = 0; t < this->threads.size(); t++)
+        if(pthread_create(&this->threads[t], 0, run, this) != 0)
+            die("Could not start the in-situ analysis threads!\n");
+}
+
+InsituPool::~InsituPool()
+{
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for(size_t t = 0; t < threads.size(); t++)
+        pthread_join(threads[t], 0);
+
+    if(fclose(out) != 0)
+        die("Could not write %s: %s\n", path, strerror(errno));
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+insitu_job *InsituPool::acquire()
+{
+    insitu_job *job = 0;
+    pthread_mutex_lock(&lock);
+    if(!free_.empty()){
+        job = free_.back();
+        free_.pop_back();
+    }
+    else
+        dropped_++;
+    pthread_mutex_unlock(&lock);
+    return job;
+}
+
+void InsituPool::submit(insitu_job *job)
+{
+    job->submitted = monotonicSeconds();
+    pthread_mutex_lock(&lock);
+    job->sequence = submitted++;
+    queue.push_back(job);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+void InsituPool::drain()
+{
+    pthread_mutex_lock(&lock);
+    while(!queue.empty() || running)
+        pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void *InsituPool::run(void *self)
+{
+    InsituPool &p = *(InsituPool*)self;
+
+    // the OpenMP threads belong to the simulation; every analysis runs on a single thread
+    omp_set_num_threads(1);
+
+    pthread_mutex_lock(&p.lock);
+    for(;;){
+        while(p.queue.empty() && !p.stop)
+            pthread_cond_wait(&p.wake, &p.lock);
+        if(p.queue.empty())
+            break;
+        insitu_job *job = p.queue.front();
+        p.queue.erase(p.queue.begin());
+        p.running++;
+        pthread_mutex_unlock(&p.lock);
+
+        const insitu_result r = p.fn(*job, p.ctx);
+        const double latency  = monotonicSeconds() - job->submitted;
+
+        char line[256];
+        snprintf(line, sizeof(line), "%lld,%lld,%lld,%le,%le,%d,%le\n", (long long int)job->step,
+                 (long long int)r.nrCellsSubVol, (long long int)r.nrClose, r.correctness, r.energy, r.criterion, latency);
+
+        pthread_mutex_lock(&p.lock);
+        // the lines are written in the order of submission, which the threads may finish out of
+        p.finished[job->sequence] = line;
+        for(map<int64_t, string>::iterator f = p.finished.begin(); f != p.finished.end() && f->first == p.nextWritten; f = p.finished.begin()){
+            fputs(f->second.c_str(), p.out);
+            p.finished.erase(f);
+            p.nextWritten++;
+        }
+        fflush(p.out);
+
+        p.completed_++;
+        p.maxLatency_ = max(p.maxLatency_, latency);
+        p.free_.push_back(job);
+        p.running--;
+        pthread_cond_broadcast(&p.idle);
+    }
+    pthread_mutex_unlock(&p.lock);
+    return 0;
+}
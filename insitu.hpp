@@ -0,0 +1,115 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+// In-situ analysis: the simulation hands copies of the cells of the
+// subvolume the clustering is evaluated on to a pool of threads, which
+// evaluate them while the simulation steps on. The results are written as
+// CSV, one line per analysis, in the order the copies were handed over.
+
+struct insitu_job
+{
+    int64_t step;            // time step of phase 2 the cells are of
+    int64_t targetN;         // number of cells the subvolume should have
+    std::vector<float> x, y, z;
+    std::vector<int>   type;
+    double  submitted;       // CLOCK_MONOTONIC seconds at which it was handed over, set by submit()
+    int64_t sequence;        // order in which it was handed over, set by submit()
+};
+
+struct insitu_result
+{
+    int     criterion;
+    double  energy;
+    int64_t nrCellsSubVol;
+    int64_t nrClose;
+    double  correctness;
+};
+
+typedef insitu_result (*insitu_fn)(const insitu_job &job, void *ctx);
+
+class InsituPool
+{
+public:
+    // starts threads threads that run fn on the jobs and append the results
+    // to path. At most threads+pending jobs are in the pool at a time.
+    InsituPool(int threads, int pending, insitu_fn fn, void *ctx, const char *path);
+
+    // waits for all jobs and closes the output
+    ~InsituPool();
+
+    // a free job to fill, or 0 if all are taken and the analysis has to be dropped
+    insitu_job *acquire();
+
+    // hands a job from acquire() to the threads
+    void submit(insitu_job *job);
+
+    // waits until all submitted jobs are done
+    void drain();
+
+    int64_t completed() const    { return completed_; }
+    int64_t dropped() const      { return dropped_; }
+    double  maxLatency() const   { return maxLatency_; }
+
+private:
+    InsituPool(const InsituPool &);
+    InsituPool &operator=(const InsituPool &);
+
+    static void *run(void *self);
+
+    insitu_fn   fn;
+    void       *ctx;
+    const char *path;
+    FILE       *out;
+
+    std::vector<insitu_job>  jobs;
+    std::vector<insitu_job*> free_;
+    std::vector<insitu_job*> queue;    // submitted jobs, oldest first
+    int64_t              running;
+    int64_t              submitted;
+    int64_t              nextWritten;          // sequence of the next line of the output
+    std::map<int64_t, std::string> finished;   // lines waiting for an earlier one
+    bool                 stop;
+    pthread_mutex_t      lock;
+    pthread_cond_t       wake;     // signalled when a job is queued or stop is set
+    pthread_cond_t       idle;     // signalled when a job is done
+    std::vector<pthread_t> threads;
+
+    int64_t completed_;
+    int64_t dropped_;
+    double  maxLatency_;
+};
@@ -0,0 +1,651 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "util.hpp"
+#include "rng.hpp"
+#include "domain.hpp"
+#include "cellsort.hpp"
+#include "diffusion.hpp"
+#include "kernels.hpp"
+
+using namespace std;
+
+int  quiet         = 0;
+bool deterministic = true;
+int64_t sortEvery  = 0;
+
+stopwatch produceSubstances_sw;
+stopwatch runDiffusionStep_sw;
+stopwatch runDecayStep_sw;
+stopwatch runDiffusionDecayStep_sw;
+stopwatch cellMovementAndDuplication_sw;
+stopwatch runDiffusionClusterStep_sw;
+stopwatch analyzeClustering_sw;
+stopwatch sortCells_sw;
+
+int64_t cellUpdates  = 0;
+int64_t voxelUpdates = 0;
+
+gradient_field gradientField        = GRADIENT_FIELD_AUTO;
+double         gradientFieldDensity = GRADIENT_FIELD_DENSITY;
+int64_t        gradientFieldCalls   = 0;
+
+static inline float getNorm(float* currArray) {
+  // computes L2 norm of input array
+  float d, arraySum=0;
+
+  d = currArray[0] * currArray[0];
+  arraySum = arraySum + d;
+
+  d = currArray[1] * currArray[1];
+  arraySum = arraySum + d;
+
+  d = currArray[2] * currArray[2];
+  arraySum = arraySum + d;
+
+  arraySum = sqrt(arraySum);
+
+  return arraySum;
+}
+
+// Analytic work of the kernels for the roofline report: flops per voxel of one substance or per
+// cell, and the bytes moved per cell beyond the voxels. The grid sweeps count each voxel read
+// once and written once (no write-allocate), the cells the per-cell arrays they touch.
+static const double STENCIL_FLOPS   = 19; // six neighbour differences, each scaled and added, and the decay
+static const double DECAY_FLOPS     = 1;
+static const double PRODUCE_FLOPS   = 4;  // voxel index and the added substance
+static const double PRODUCE_BYTES   = 16; // position and type; the voxel is read and written
+static const double MOVEMENT_FLOPS  = 15; // random direction, its normalization and the path
+static const double MOVEMENT_BYTES  = 44;
+static const double GRADIENT_FLOPS  = 45; // two gradients, their norms and the movement
+static const double GRADIENT_BYTES  = 28; // position, type and movement; 12 voxels are read
+static const double FIELD_FLOPS     = 6;  // voxel index and movement of a cell, with the direction field
+static const double FIELD_BYTES     = 40; // position and type; the direction is read, the movement written
+static const double DIRECTION_BYTES = 12; // per voxel of the field, written; each substance is read once, as
+                                          // the neighbouring rows mostly come from cache
+static const double ADI_FLOPS       = 16; // forward and back substitution in three directions, and the decay
+static const double ADI_PASSES      = 5;  // the x and y solves read and write the grid twice each, the z solve once
+static const double SPECTRAL_FLOPS  = 15; // per voxel and log2(L): six DCTs of 2.5 L log2(L) flops per line, as two
+                                          // lines share a complex FFT
+static const double SPECTRAL_PASSES = 5;  // forward x and y, z with the multiplier, inverse y and x
+
+void produceSubstances(ConcentrationGrid &Conc, const CellStore &cells, int L, int n){
+  produceSubstances_sw.reset();
+  produceSubstances_sw.work(PRODUCE_FLOPS*n, (PRODUCE_BYTES + 2*Conc.elementSize())*n);
+  // increases the concentration of substances at the location of the cells
+
+  if(deterministic){
+    // the production is bucketed by grid row in cell order, and every row is updated by
+    // one thread in that order, as the serial loop would
+    static ProductionBatch *scatter = 0; // reused while the grid size stays, which the bench changes
+    if(!scatter || scatter->size() != L){
+      delete scatter;
+      scatter = new ProductionBatch(L, 1);
+    }
+    scatter->clear();
+    scatter->record(cells, n);
+    scatter->apply(Conc, 0);
+    produceSubstances_sw.mark();
+    return;
+  }
+
+  // threads may update the same voxel at the same time, so the result depends on the timing
+  float sideLength = 1/(float)L; // length of a side of a diffusion voxel
+
+  L--;
+
+  const float *x = cells.x, *y = cells.y, *z = cells.z;
+  const int *type = cells.type;
+  ActiveBlocks *active = Conc.activeBlocks();
+  const int p0 = Conc.firstPlane(); // the cells of a slab lie in its planes
+
+  int c;
+#pragma ivdep
+#pragma omp parallel for
+  for(c=0; c< n; c++){
+    const int i1 = std::min((int)floor(x[c]/sideLength), L);
+    const int i2 = std::min((int)floor(y[c]/sideLength), L);
+    const int i3 = std::min((int)floor(z[c]/sideLength), L);
+
+    const int s = !(type[c]==1);
+    float C = Conc.get(s, i1-p0, i2, i3) + 0.1;
+
+    if(C > 1) C=1;
+    Conc.set(s, i1-p0, i2, i3, C);
+    if(active)
+      active->markVoxel(i1, i2, i3);
+  }
+  produceSubstances_sw.mark();
+}
+
+void runDiffusionStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D){
+  runDiffusionStep_sw.reset();
+  // computes the changes in substance concentrations due to diffusion. The stencil reads
+  // from Conc and writes to nextConc, and the two buffers are swapped afterwards.
+  Conc.fillHalo(); // ghost voxels mirror the boundary, so they add no flux
+  diffusionSweep(Conc, nextConc, D, 1.0f);
+  Conc.swap(nextConc);
+  const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+  runDiffusionStep_sw.work(STENCIL_FLOPS*voxels, 2*Conc.elementSize()*voxels);
+  runDiffusionStep_sw.mark();
+}
+
+void runDecayStep(ConcentrationGrid &Conc, float mu) {
+    runDecayStep_sw.reset();
+    // computes the changes in substance concentrations due to decay
+    decaySweep(Conc, 1-mu);
+    const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+    runDecayStep_sw.work(DECAY_FLOPS*voxels, 2*Conc.elementSize()*voxels);
+    runDecayStep_sw.mark();
+}
+
+void runDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params, bool blocked){
+  runDiffusionDecayStep_sw.reset();
+  // computes diffusion and decay of both substances in a single sweep over the grid. The
+  // production of the cells has already been scattered into Conc, so every voxel is read
+  // once from Conc and written once to nextConc, and the two buffers are swapped afterwards.
+  Conc.fillHalo();
+  if(blocked)
+    blockedDiffusionSweep(Conc, nextConc, params.D, 1-params.mu, params.tileX, params.tileY, params.tileZ);
+  else
+    diffusionSweep(Conc, nextConc, params.D, 1-params.mu);
+  Conc.swap(nextConc);
+  const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+  runDiffusionDecayStep_sw.work(STENCIL_FLOPS*voxels, 2*Conc.elementSize()*voxels);
+  runDiffusionDecayStep_sw.mark();
+}
+
+void runActiveDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params){
+  runDiffusionDecayStep_sw.reset();
+  // like runDiffusionDecayStep, but only the blocks that hold substance and their neighbours are swept
+  Conc.fillHalo();
+  const int64_t stepped = Conc.activeBlocks()->steppedBlocks;
+  activeDiffusionSweep(Conc, nextConc, params.D, 1-params.mu, params.activeEpsilon);
+  Conc.swap(nextConc);
+  const int64_t B = Conc.activeBlocks()->blockSize();
+  const double voxels = 2.0*(Conc.activeBlocks()->steppedBlocks - stepped)*B*B*B;
+  runDiffusionDecayStep_sw.work(STENCIL_FLOPS*voxels, 2*Conc.elementSize()*voxels);
+  runDiffusionDecayStep_sw.mark();
+}
+
+void runTemporalDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, ProductionBatch &batch, const cdc_params &params){
+  runDiffusionDecayStep_sw.reset();
+  // advances the grid by all time steps recorded in batch, including the production of the cells
+  voxelUpdates += 2*Conc.planes()*Conc.size()*Conc.size()*batch.steps();
+  batch.apply(Conc, 0);
+  Conc.fillHalo();
+  // all steps of a tile are taken while it is in cache, so the grid is read and written once
+  const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+  runDiffusionDecayStep_sw.work(STENCIL_FLOPS*voxels*batch.steps(), 2*Conc.elementSize()*voxels);
+  temporalDiffusionSweep(Conc, nextConc, params.D, 1-params.mu, batch, params.tileY);
+  Conc.swap(nextConc);
+  batch.clear();
+  runDiffusionDecayStep_sw.mark();
+}
+
+void recordProduction(ProductionBatch &batch, const CellStore &cells, int n){
+  produceSubstances_sw.reset();
+  // remembers where the cells produce substances in this time step
+  batch.record(cells, n);
+  produceSubstances_sw.mark();
+}
+
+void runAdiDiffusionDecayStep(ConcentrationGrid &Conc, const cdc_params &params, int64_t steps){
+  runDiffusionDecayStep_sw.reset();
+  // advances the concentrations by the diffusion and decay of steps time steps in a single implicit step,
+  // which is stable however many steps it spans
+  adiDiffusionSweep(Conc, steps*params.D/6, pow(1-params.mu, (double)steps));
+  const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+  runDiffusionDecayStep_sw.work(ADI_FLOPS*voxels, ADI_PASSES*2*Conc.elementSize()*voxels);
+  runDiffusionDecayStep_sw.mark();
+}
+
+void runSpectralDiffusionDecayStep(SpectralPropagator &spectral, ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params, int64_t steps){
+  runDiffusionDecayStep_sw.reset();
+  // advances the concentrations by exactly the diffusion and decay of steps explicit time steps, at the
+  // cost of two 3D cosine transforms however many steps it spans
+  spectral.advance(Conc, nextConc, params.D, params.mu, steps);
+  const double voxels = 2.0*Conc.planes()*Conc.size()*Conc.size();
+  runDiffusionDecayStep_sw.work(SPECTRAL_FLOPS*log2((double)Conc.size())*voxels, SPECTRAL_PASSES*2*Conc.elementSize()*voxels);
+  runDiffusionDecayStep_sw.mark();
+}
+
+// Moves every cell and appends the daughters of the cells that divide. Runs
+// in three parallel passes: each thread moves a contiguous chunk of cells and
+// flags the ones that divide, an exclusive scan over the per-thread counts
+// assigns daughter slots, and each thread then writes the daughters of its
+// chunk. Daughters end up in cell order behind the n existing cells, exactly
+// as the serial loop appended them, so the result does not depend on the
+// number of threads.
+int cellMovementAndDuplication(CellStore &cells, float pathThreshold, int divThreshold, int n, uint64_t seed, int64_t step) {
+    cellMovementAndDuplication_sw.reset();
+    cellMovementAndDuplication_sw.work(MOVEMENT_FLOPS*n, MOVEMENT_BYTES*n);
+    cellUpdates += n;
+
+    float *x = cells.x, *y = cells.y, *z = cells.z;
+    float *path = cells.path;
+    int *type = cells.type, *divisions = cells.divisions;
+    uint32_t *id = cells.id;
+
+    if(n == 0){
+        cellMovementAndDuplication_sw.mark();
+        return 0;
+    }
+
+    static std::vector<unsigned char> divides;
+    static std::vector<int> firstDaughter;
+    if((int)divides.size() < n)
+        divides.resize(n);
+    unsigned char *div = &divides[0];
+
+    int currentNumberCells = n;
+
+#pragma omp parallel
+    {
+        const int nthreads = omp_get_num_threads();
+        const int tid = omp_get_thread_num();
+        const int begin = (int)((int64_t)n*tid/nthreads);
+        const int end = (int)((int64_t)n*(tid+1)/nthreads);
+
+#pragma omp single
+        firstDaughter.assign(nthreads + 1, 0);
+
+        // pass 1: random cell movement, flag the cells that divide
+        int count = 0;
+        for(int c=begin; c<end; c++) {
+            float currentCellMovement[3];
+            float r[4];
+            randomFloats4(seed, step, id[c], RNG_DRAW_MOVEMENT, r);
+            currentCellMovement[0]=r[0]-0.5;
+            currentCellMovement[1]=r[1]-0.5;
+            currentCellMovement[2]=r[2]-0.5;
+            const float currentNorm = getNorm(currentCellMovement);
+            x[c]+=0.1*currentCellMovement[0]/currentNorm;
+            y[c]+=0.1*currentCellMovement[1]/currentNorm;
+            z[c]+=0.1*currentCellMovement[2]/currentNorm;
+            path[c]+=0.1;
+
+            // cell duplication if conditions fulfilled
+            div[c] = divisions[c]<divThreshold && path[c]>pathThreshold;
+            if(div[c]) {
+                path[c]-=pathThreshold;
+                divisions[c]+=1;        // update number of divisions this cell has undergone
+                count++;
+            }
+        }
+        firstDaughter[tid + 1] = count;
+
+        // pass 2: exclusive scan of the daughter counts gives every thread its first slot
+#pragma omp barrier
+#pragma omp single
+        {
+            firstDaughter[0] = n;
+            for(int t=0; t<nthreads; t++)
+                firstDaughter[t + 1] += firstDaughter[t];
+            currentNumberCells = firstDaughter[nthreads];
+        }
+
+        // pass 3: write the daughters of this chunk in cell order
+        int d = firstDaughter[tid];
+        for(int c=begin; c<end; c++) {
+            if(!div[c])
+                continue;
+
+            float duplicatedCellOffset[3];
+            float r[4];
+            divisions[d]=divisions[c];  // update number of divisions the duplicated cell has undergone
+            type[d]=-type[c];           // assign type of duplicated cell (opposite to current cell)
+            path[d]=0;
+            id[d]=id[c] | (1u << (divisions[c]-1));
+
+            // assign location of duplicated cell
+            randomFloats4(seed, step, id[c], RNG_DRAW_DIVISION, r);
+            duplicatedCellOffset[0]=r[0]-0.5;
+            duplicatedCellOffset[1]=r[1]-0.5;
+            duplicatedCellOffset[2]=r[2]-0.5;
+            const float currentNorm = getNorm(duplicatedCellOffset);
+            x[d]=x[c]+0.05*duplicatedCellOffset[0]/currentNorm;
+            y[d]=y[c]+0.05*duplicatedCellOffset[1]/currentNorm;
+            z[d]=z[c]+0.05*duplicatedCellOffset[2]/currentNorm;
+            d++;
+        }
+    }
+
+    cellMovementAndDuplication_sw.mark();
+    return currentNumberCells;
+}
+
+void clampToUnitCube(CellStore &cells, int n) {
+    // boundary conditions: cells can not move out of the cube [0,1]^3
+    float *x = cells.x, *y = cells.y, *z = cells.z;
+
+    int c;
+#pragma ivdep
+#pragma omp parallel for
+    for(c=0; c<n; c++){
+        x[c] = fminf(fmaxf(x[c], 0.0f), 1.0f);
+        y[c] = fminf(fmaxf(y[c], 0.0f), 1.0f);
+        z[c] = fminf(fmaxf(z[c], 0.0f), 1.0f);
+    }
+}
+
+// runDiffusionClusterStep with the movement computed once per voxel, for grids with many cells per
+// voxel: every cell then only looks up the direction of its voxel
+static void runDirectionFieldStep(const ConcentrationGrid &Conc, CellStore &cells, int cc, int L, float speed){
+  const int64_t voxels = (int64_t)Conc.planes()*L*L;
+  runDiffusionClusterStep_sw.work(GRADIENT_FLOPS*voxels + FIELD_FLOPS*cc,
+                                  (DIRECTION_BYTES + 2*Conc.elementSize())*voxels + FIELD_BYTES*cc);
+  gradientFieldCalls++;
+
+  static vector<float> field; // the movement in x, y and z of every voxel of the slab
+  field.resize(3*voxels);
+  float *dirX = &field[0], *dirY = dirX + voxels, *dirZ = dirY + voxels;
+  directionFieldSweep(Conc, speed, dirX, dirY, dirZ);
+
+  const float sideLength = 1/(float)L;
+  const float *x = cells.x, *y = cells.y, *z = cells.z;
+  const int *type = cells.type;
+  float *movX = cells.movX, *movY = cells.movY, *movZ = cells.movZ;
+  const int p0   = Conc.firstPlane();
+  const int last = L - 1;
+
+  int c;
+#pragma omp parallel for
+  for(c=0;c<cc;c++){
+    const int i1 = min((int)floor(x[c]/sideLength), last);
+    const int i2 = min((int)floor(y[c]/sideLength), last);
+    const int i3 = min((int)floor(z[c]/sideLength), last);
+    const int64_t v = ((int64_t)(i1-p0)*L + i2)*L + i3;
+    movX[c]=type[c]*dirX[v];
+    movY[c]=type[c]*dirY[v];
+    movZ[c]=type[c]*dirZ[v];
+  }
+}
+
+void runDiffusionClusterStep(const ConcentrationGrid &Conc, CellStore &cells, int cc, int L, float speed){
+  runDiffusionClusterStep_sw.reset();
+  cellUpdates += cc;
+  if(gradientField == GRADIENT_FIELD_VOXEL ||
+     (gradientField == GRADIENT_FIELD_AUTO && cc >= gradientFieldDensity*Conc.planes()*L*L)){
+    runDirectionFieldStep(Conc, cells, cc, L, speed);
+    runDiffusionClusterStep_sw.mark();
+    return;
+  }
+  runDiffusionClusterStep_sw.work(GRADIENT_FLOPS*cc, (GRADIENT_BYTES + 12*Conc.elementSize())*cc);
+  // computes movements of all cells based on gradients of the two substances
+
+  float sideLength = 1/(float)L; // length of a side of a diffusion voxel
+
+  const float *x = cells.x, *y = cells.y, *z = cells.z;
+  const int *type = cells.type;
+  float *movX = cells.movX, *movY = cells.movY, *movZ = cells.movZ;
+  const int p0 = Conc.firstPlane(); // planes next to the slab are read from the halo
+
+  L--;
+  int c = 0;
+#pragma ivdep
+#pragma omp parallel for
+  for(c=0;c<cc;c++){
+    float gradSub1[3];
+    float gradSub2[3];
+
+    const int i1 = min((int)floor(x[c]/sideLength), L);
+    const int i2 = min((int)floor(y[c]/sideLength), L);
+    const int i3 = min((int)floor(z[c]/sideLength), L);
+
+    const int xUp   = min((i1+1), L);
+    const int xDown = max((i1-1), 0);
+    const int yUp   = min((i2+1), L);
+    const int yDown = max((i2-1), 0);
+    const int zUp   = min((i3+1), L);
+    const int zDown = max((i3-1), 0);
+
+    gradSub1[0] = (Conc.get(0, xUp-p0, i2, i3)-Conc.get(0, xDown-p0, i2, i3))/(sideLength*(xUp-xDown));
+    gradSub1[1] = (Conc.get(0, i1-p0, yUp, i3)-Conc.get(0, i1-p0, yDown, i3))/(sideLength*(yUp-yDown));
+    gradSub1[2] = (Conc.get(0, i1-p0, i2, zUp)-Conc.get(0, i1-p0, i2, zDown))/(sideLength*(zUp-zDown));
+
+    gradSub2[0] = (Conc.get(1, xUp-p0, i2, i3)-Conc.get(1, xDown-p0, i2, i3))/(sideLength*(xUp-xDown));
+    gradSub2[1] = (Conc.get(1, i1-p0, yUp, i3)-Conc.get(1, i1-p0, yDown, i3))/(sideLength*(yUp-yDown));
+    gradSub2[2] = (Conc.get(1, i1-p0, i2, zUp)-Conc.get(1, i1-p0, i2, zDown))/(sideLength*(zUp-zDown));
+
+    const float normGrad1 = getNorm(gradSub1);
+    const float normGrad2 = getNorm(gradSub2);
+
+    if((normGrad1>0) && (normGrad2>0)){
+      movX[c]=type[c]*(gradSub1[0]/normGrad1-gradSub2[0]/normGrad2)*speed;
+      movY[c]=type[c]*(gradSub1[1]/normGrad1-gradSub2[1]/normGrad2)*speed;
+      movZ[c]=type[c]*(gradSub1[2]/normGrad1-gradSub2[2]/normGrad2)*speed;
+    } else {
+      movX[c]=0;
+      movY[c]=0;
+      movZ[c]=0;
+    }
+  }
+  runDiffusionClusterStep_sw.mark();
+}
+
+void applyMovement(CellStore &cells, int n) {
+    float *x = cells.x, *y = cells.y, *z = cells.z;
+    const float *movX = cells.movX, *movY = cells.movY, *movZ = cells.movZ;
+
+    int c;
+#pragma ivdep
+#pragma omp parallel for
+    for(c=0; c<n; c++){
+        x[c] = x[c]+movX[c];
+        y[c] = y[c]+movY[c];
+        z[c] = z[c]+movZ[c];
+    }
+    clampToUnitCube(cells, n);
+}
+
+// Sorts the cells by the Morton key of their voxel after step steps of either phase, if a sort is due,
+// so that produceSubstances and runDiffusionClusterStep walk the grid in Z-order instead of in the
+// order the cells were born. The results do not change, as the random numbers of a cell are drawn
+// by its id and the clustering is evaluated in the order of the ids.
+void sortCells(CellStore &cells, int64_t n, int64_t L, int64_t step) {
+    if(!sortEvery || step % sortEvery)
+        return;
+    sortCells_sw.reset();
+    sortCells_sw.work(0, sortCellsByMorton(cells, n, L));
+    sortCells_sw.mark();
+}
+
+static void extractSubvolume(const CellStore &cells, int64_t n, float subVolMax, vector<subvolume_cell> &sub) {
+    // copies the locations, types and ids of all cells within the central subcube of half-width subVolMax
+    const float *x = cells.x, *y = cells.y, *z = cells.z;
+    const int *type = cells.type;
+
+    sub.clear();
+    for (int64_t c = 0; c < n; c++) {
+        if ((fabs(x[c]-0.5)<subVolMax) && (fabs(y[c]-0.5)<subVolMax) && (fabs(z[c]-0.5)<subVolMax)) {
+            const subvolume_cell sc = { x[c], y[c], z[c], type[c], cells.id[c] };
+            sub.push_back(sc);
+        }
+    }
+}
+
+void gatherSubvolume(const CellStore &cells, int64_t n, int64_t nTotal, int64_t targetN, vector<subvolume_cell> &sub) {
+    // Collects the cells within a central subvolume on the first rank.
+    // The size of the subvolume is computed by assuming roughly uniform distribution within the whole
+    // volume, and selecting a volume comprising approximately targetN cells. targetN=0 selects all cells.
+    // The cells of all ranks are gathered on the first rank and put in the order of their ids, so that
+    // the sums over the pairs do not depend on where the cells are stored.
+    float subVolMax = INFINITY;
+    if(targetN > 0){
+        subVolMax = pow(float(targetN)/float(nTotal),1.0/3.0)/2;
+
+        if(quiet < 1)
+            printf("subVolMax: %f\n", subVolMax);
+    }
+
+    extractSubvolume(cells, n, subVolMax, sub);
+
+    vector<char> bytes((char*)sub.data(), (char*)(sub.data() + sub.size()));
+    gatherAtRoot(bytes);
+    sub.resize(bytes.size()/sizeof(subvolume_cell));
+    if(!sub.empty())
+        memcpy(&sub[0], &bytes[0], bytes.size());
+    sort(sub.begin(), sub.end());
+}
+
+static int64_t extractClusterCells(const CellStore &cells, int64_t n, int64_t nTotal, float spatialRange, int64_t targetN, CellList &list) {
+    // Collects the cells within the central subvolume into a cell list with buckets of size spatialRange.
+    vector<subvolume_cell> sub;
+    gatherSubvolume(cells, n, nTotal, targetN, sub);
+
+    const int64_t m = sub.size();
+    vector<float> sx(m), sy(m), sz(m);
+    vector<int> typesSubvol(m);
+    for (int64_t c = 0; c < m; c++) {
+        sx[c]          = sub[c].x;
+        sy[c]          = sub[c].y;
+        sz[c]          = sub[c].z;
+        typesSubvol[c] = sub[c].type;
+    }
+    list.build(sx.data(), sy.data(), sz.data(), typesSubvol.data(), m, spatialRange);
+    return m;
+}
+
+bool evaluateCriterion(const cluster_stats &st, int64_t targetN, bool explain) {
+    // Returns false unless the cells in the subvolume, comprising approximately targetN cells, are arranged as clusters.
+    // Without explain, nothing is printed.
+
+    // If there are not enough cells within the subvolume, the correctness criterion is not fulfilled
+    if ((((float)(st.nrCellsSubVol))/(float)targetN) < 0.25) {
+        if(explain && quiet < 2)
+            printf("not enough cells in subvolume: %lld\n", (long long int)st.nrCellsSubVol);
+        return false;
+    }
+
+    // If there are too many cells within the subvolume, the correctness criterion is not fulfilled
+    if ((((float)(st.nrCellsSubVol))/(float)targetN) > 4) {
+        if(explain && quiet < 2)
+            printf("too many cells in subvolume: %lld\n", (long long int)st.nrCellsSubVol);
+        return false;
+    }
+
+    // check if there are many cells of opposite types located within a close distance, indicative of bad clustering
+    if (st.correctness > 0.1) {
+        if(explain && quiet < 2)
+            printf("cells in subvolume are not well-clustered: %f\n", st.correctness);
+        return false;
+    }
+
+    // check if clusters are large enough, i.e. whether cells have more than 100 cells of the same type located nearby
+    if(explain && quiet < 1)
+        printf("average neighbors in subvolume: %f\n", st.avgNeighbors);
+    if (st.avgNeighbors < 100) {
+        if(explain && quiet < 2)
+            printf("cells in subvolume do not have enough neighbors: %f\n", st.avgNeighbors);
+        return false;
+    }
+
+    if(explain && quiet < 1)
+        printf("correctness coefficient: %f\n", st.correctness);
+
+    return true;
+}
+
+void closePairStats(const CellList &list, float spatialRange, cluster_stats &st) {
+    // Sums the energies over the pairs of cells of list closer than spatialRange and fills in all
+    // of st but the criterion; st.nrCellsSubVol must be set.
+
+    // The energies are summed over fixed chunks of buckets and the chunks are then added in
+    // order, so that the sums do not depend on the number of threads.
+    const int64_t chunk   = 16;
+    const int64_t nchunks = (list.numBuckets() + chunk - 1)/chunk;
+    vector<double> intraPartial(nchunks), extraPartial(nchunks);
+
+    int64_t nrClose = 0, sameTypeClose = 0;
+
+    const int *typesSubvol = list.type.data();
+    int64_t b;
+#pragma omp parallel for schedule(dynamic) reduction(+:nrClose,sameTypeClose)
+    for (b = 0; b < nchunks; b++) {
+        double intra = 0.0, extra = 0.0;
+        auto visit = [&](int64_t i1, int64_t i2, float currDist) {
+            nrClose++;
+            if (typesSubvol[i1]*typesSubvol[i2]>0) {
+                sameTypeClose++;
+                intra += fmin(100.0,spatialRange/currDist);
+            }
+            else {
+                extra += fmin(100.0,spatialRange/currDist);
+            }
+        };
+        list.forEachClosePair(b*chunk, std::min(list.numBuckets(), (b+1)*chunk), visit);
+        intraPartial[b] = intra;
+        extraPartial[b] = extra;
+    }
+
+    double intraClusterEnergy = 0.0, extraClusterEnergy = 0.0;
+    for (b = 0; b < nchunks; b++) {
+        intraClusterEnergy += intraPartial[b];
+        extraClusterEnergy += extraPartial[b];
+    }
+
+    st.nrClose            = nrClose;
+    st.sameTypeClose      = sameTypeClose;
+    st.diffTypeClose      = nrClose - sameTypeClose;
+    st.intraClusterEnergy = intraClusterEnergy;
+    st.extraClusterEnergy = extraClusterEnergy;
+    st.energy             = (extraClusterEnergy-intraClusterEnergy)/(1.0+100.0*nrClose);
+    st.correctness        = ((float)st.diffTypeClose)/(nrClose+1.0);
+    st.avgNeighbors       = st.nrCellsSubVol ? ((float)sameTypeClose/st.nrCellsSubVol) : 0.0f;
+}
+
+cluster_stats analyzeClustering(const CellStore &cells, int64_t n, float spatialRange, int64_t targetN) {
+    analyzeClustering_sw.reset();
+    // Computes the energy and the correctness criterion of the clustering in one pass over the pairs of
+    // cells within a subvolume comprising approximately targetN cells. The first rank evaluates the
+    // subvolume gathered from all ranks and sends the result to the others.
+    cluster_stats st;
+
+    const int64_t nTotal = sumOverRanks(n);
+    CellList list;
+    st.nrCellsSubVol = extractClusterCells(cells, n, nTotal, spatialRange, targetN, list);
+    if(targetN == 0)
+        targetN = nTotal;
+
+    if(quiet < 1)
+        printf("number of cells in subvolume: %lld\n", (long long int)st.nrCellsSubVol);
+
+    closePairStats(list, spatialRange, st);
+    st.criterion = evaluateCriterion(st, targetN);
+    broadcastFromRoot(&st, sizeof(st));
+
+    analyzeClustering_sw.mark();
+    return st;
+}
@@ -0,0 +1,148 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "util.hpp"
+#include "cells.hpp"
+#include "grid.hpp"
+#include "diffusion.hpp"
+#include "spectral.hpp"
+#include "neighbors.hpp"
+
+// The kernels of a time step of either phase and the clustering analysis,
+// shared by the simulation and the bench target. Each kernel times itself
+// with its stopwatch and records its analytic work for the roofline report.
+
+extern int     quiet;         // the higher, the less is printed to stdout
+extern bool    deterministic; // identical results for any number of threads
+extern int64_t sortEvery;     // time steps between sorts of the cells in Z-order, 0 for none
+
+extern stopwatch produceSubstances_sw;
+extern stopwatch runDiffusionStep_sw;
+extern stopwatch runDecayStep_sw;
+extern stopwatch runDiffusionDecayStep_sw;
+extern stopwatch cellMovementAndDuplication_sw;
+extern stopwatch runDiffusionClusterStep_sw;
+extern stopwatch analyzeClustering_sw;
+extern stopwatch sortCells_sw;
+
+extern int64_t cellUpdates;  // cells moved, summed over the time steps
+extern int64_t voxelUpdates; // voxels of both substances advanced by diffusion and decay, summed over the time steps
+
+// where runDiffusionClusterStep evaluates the gradients
+enum gradient_field
+{
+    GRADIENT_FIELD_AUTO,  // per voxel from GRADIENT_FIELD_DENSITY cells per voxel on, else per cell
+    GRADIENT_FIELD_CELL,  // for every cell
+    GRADIENT_FIELD_VOXEL, // once per voxel, in a sweep over the grid
+};
+
+// Cells per voxel of the slab from which the sweep over the voxels is faster than evaluating every
+// cell, measured with the runDiffusionClusterStep and directionField kernels of the bench target.
+// With the vector row kernels a voxel costs about a seventh of a cell, without them about half.
+static const double GRADIENT_FIELD_DENSITY        = 0.2;
+static const double GRADIENT_FIELD_DENSITY_SCALAR = 0.5;
+
+extern gradient_field gradientField;
+extern double         gradientFieldDensity; // for the kernels selected
+extern int64_t        gradientFieldCalls;   // calls of runDiffusionClusterStep that evaluated per voxel
+
+// a cell of the subvolume the clustering is evaluated on
+struct subvolume_cell
+{
+    float    x, y, z;
+    int      type;
+    uint32_t id;
+
+    bool operator<(const subvolume_cell &o) const { return id < o.id; }
+};
+
+// result of the clustering analysis of a subvolume
+struct cluster_stats
+{
+    float   energy;             // the smaller this value, the better the clustering
+    bool    criterion;          // true if the cells in the subvolume are arranged as clusters
+    int64_t nrCellsSubVol;      // number of cells in the subvolume
+    int64_t nrClose;            // number of pairs of cells closer than spatialRange
+    int64_t sameTypeClose;      // ... of which are of the same type
+    int64_t diffTypeClose;      // ... of which are of opposite types
+    double  intraClusterEnergy; // energy of the close pairs of the same type
+    double  extraClusterEnergy; // energy of the close pairs of opposite types
+    float   correctness;        // fraction of close pairs of opposite types
+    float   avgNeighbors;       // close pairs of the same type per cell
+};
+
+// adds the substance of every cell to its voxel
+void produceSubstances(ConcentrationGrid &Conc, const CellStore &cells, int L, int n);
+
+// one time step of diffusion, and one of decay, of both substances
+void runDiffusionStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, float D);
+void runDecayStep(ConcentrationGrid &Conc, float mu);
+
+// one time step of diffusion and decay in a single sweep, on cache-sized tiles if blocked
+void runDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params, bool blocked);
+
+// runDiffusionDecayStep on the active blocks of Conc only
+void runActiveDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, const cdc_params &params);
+
+// all time steps recorded in batch, with their production, in one pass over the grid
+void runTemporalDiffusionDecayStep(ConcentrationGrid &Conc, ConcentrationGrid &nextConc, ProductionBatch &batch, const cdc_params &params);
+void recordProduction(ProductionBatch &batch, const CellStore &cells, int n);
+
+// steps time steps of diffusion and decay at once, implicitly or in the cosine basis
+void runAdiDiffusionDecayStep(ConcentrationGrid &Conc, const cdc_params &params, int64_t steps);
+void runSpectralDiffusionDecayStep(SpectralPropagator &spectral, ConcentrationGrid &Conc, ConcentrationGrid &nextConc,
+                                   const cdc_params &params, int64_t steps);
+
+// moves the first n cells randomly and appends their daughters; returns the new number of cells
+int cellMovementAndDuplication(CellStore &cells, float pathThreshold, int divThreshold, int n, uint64_t seed, int64_t step);
+void clampToUnitCube(CellStore &cells, int n);
+
+// the movement of the first cc cells along the gradients, into movX, movY and movZ
+void runDiffusionClusterStep(const ConcentrationGrid &Conc, CellStore &cells, int cc, int L, float speed);
+void applyMovement(CellStore &cells, int n);
+
+// sorts the cells in Z-order after step steps of either phase, if a sort is due
+void sortCells(CellStore &cells, int64_t n, int64_t L, int64_t step);
+
+// the cells of all ranks in the central subvolume of about targetN cells, on the first rank, by id
+void gatherSubvolume(const CellStore &cells, int64_t n, int64_t nTotal, int64_t targetN, std::vector<subvolume_cell> &sub);
+
+// whether st describes clusters; without explain, nothing is printed
+bool evaluateCriterion(const cluster_stats &st, int64_t targetN, bool explain = true);
+
+// fills in all of st but the criterion from the close pairs of list; st.nrCellsSubVol must be set
+void closePairStats(const CellList &list, float spatialRange, cluster_stats &st);
+
+// energy and criterion of the clustering of the subvolume of about targetN cells, on all ranks
+cluster_stats analyzeClustering(const CellStore &cells, int64_t n, float spatialRange, int64_t targetN);
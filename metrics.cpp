@@ -0,0 +1,290 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include "metrics.hpp"
+
+using namespace std;
+
+static const int METRICS_VERSION = 1;
+
+// value of the p-quantile of the sorted samples v, by the nearest-rank method
+static double quantile(const vector<double> &v, double p)
+{
+    int64_t rank = (int64_t)ceil(p*v.size());
+    if(rank < 1)
+        rank = 1;
+    return v[rank - 1];
+}
+
+sample_stats summarize(const double *samples, int64_t count)
+{
+    sample_stats st;
+    memset(&st, 0, sizeof(st));
+    st.count = count;
+    if(count == 0)
+        return st;
+
+    vector<double> v(samples, samples + count);
+    sort(v.begin(), v.end());
+    for(int64_t i = 0; i < count; i++)
+        st.total += v[i];
+    st.min    = v.front();
+    st.median = quantile(v, 0.5);
+    st.p99    = quantile(v, 0.99);
+    st.max    = v.back();
+    return st;
+}
+
+int64_t maxResidentBytes()
+{
+    struct rusage ru;
+    if(getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return (int64_t)ru.ru_maxrss*1024; // Linux reports kilobytes
+}
+
+void metrics_report::addKernel(const char *name, const stopwatch *sw)
+{
+    kernel k;
+    k.name = name;
+    k.sw   = sw;
+    kernels.push_back(k);
+}
+
+void metrics_report::beginPhase(const char *name)
+{
+    phase p;
+    p.name         = name;
+    p.elapsed      = 0;
+    p.cellUpdates  = 0;
+    p.voxelUpdates = 0;
+    for(size_t k = 0; k < kernels.size(); k++)
+        p.first.push_back(kernels[k].sw->samples.size());
+    phases.push_back(p);
+}
+
+void metrics_report::endPhase(double elapsed, int64_t cellUpdates, int64_t voxelUpdates)
+{
+    phase &p = phases.back();
+    p.elapsed      = elapsed;
+    p.cellUpdates  = cellUpdates;
+    p.voxelUpdates = voxelUpdates;
+    for(size_t k = 0; k < kernels.size(); k++)
+        p.end.push_back(kernels[k].sw->samples.size());
+}
+
+void metrics_report::addResult(const char *key, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list val;
+    va_start(val, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, val);
+    va_end(val);
+    results.push_back(make_pair(string(key), string(buffer)));
+}
+
+static bool isNumber(const string &s)
+{
+    if(s.empty())
+        return false;
+    char *end;
+    const double v = strtod(s.c_str(), &end);
+    return *end == 0 && std::isfinite(v);
+}
+
+static void jsonString(FILE *f, const string &s)
+{
+    fputc('"', f);
+    for(size_t i = 0; i < s.size(); i++){
+        const unsigned char c = s[i];
+        if(c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if(c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void jsonObject(FILE *f, const char *name, const key_values &kv)
+{
+    fprintf(f, "  \"%s\": {", name);
+    for(size_t i = 0; i < kv.size(); i++){
+        fprintf(f, "%s\n    ", i ? "," : "");
+        jsonString(f, kv[i].first);
+        fprintf(f, ": ");
+        if(isNumber(kv[i].second))
+            fprintf(f, "%s", kv[i].second.c_str());
+        else
+            jsonString(f, kv[i].second);
+    }
+    fprintf(f, "\n  },\n");
+}
+
+static double perSecond(int64_t count, double elapsed)
+{
+    return elapsed > 0 ? count/elapsed : 0.0;
+}
+
+void metrics_report::writeJson(FILE *f) const
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"format\": \"cell_clustering-metrics\",\n");
+    fprintf(f, "  \"version\": %d,\n", METRICS_VERSION);
+    jsonObject(f, "system", system);
+    jsonObject(f, "params", params);
+    jsonObject(f, "results", results);
+    fprintf(f, "  \"max_resident_bytes\": %lld,\n", (long long int)maxResidentBytes());
+    fprintf(f, "  \"phases\": [");
+    for(size_t i = 0; i < phases.size(); i++){
+        const phase &p = phases[i];
+        fprintf(f, "%s\n    {\n", i ? "," : "");
+        fprintf(f, "      \"name\": ");
+        jsonString(f, p.name);
+        fprintf(f, ",\n");
+        fprintf(f, "      \"time_s\": %.9e,\n", p.elapsed);
+        fprintf(f, "      \"cell_updates\": %lld,\n", (long long int)p.cellUpdates);
+        fprintf(f, "      \"cells_per_s\": %.9e,\n", perSecond(p.cellUpdates, p.elapsed));
+        fprintf(f, "      \"voxel_updates\": %lld,\n", (long long int)p.voxelUpdates);
+        fprintf(f, "      \"voxel_updates_per_s\": %.9e,\n", perSecond(p.voxelUpdates, p.elapsed));
+        fprintf(f, "      \"kernels\": {");
+        bool first = true;
+        for(size_t k = 0; k < kernels.size() && k < p.end.size(); k++){
+            const sample_stats st = summarize(kernels[k].sw->samples.data() + p.first[k], p.end[k] - p.first[k]);
+            if(!st.count)
+                continue;
+            fprintf(f, "%s\n        ", first ? "" : ",");
+            jsonString(f, kernels[k].name);
+            fprintf(f, ": {\"calls\": %lld, \"total_s\": %.9e, \"min_s\": %.9e, \"median_s\": %.9e, \"p99_s\": %.9e, \"max_s\": %.9e}",
+                    (long long int)st.count, st.total, st.min, st.median, st.p99, st.max);
+            first = false;
+        }
+        fprintf(f, "\n      }\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static void csvField(FILE *f, const string &s)
+{
+    if(s.find_first_of(",\"\n") == string::npos){
+        fputs(s.c_str(), f);
+        return;
+    }
+    fputc('"', f);
+    for(size_t i = 0; i < s.size(); i++){
+        if(s[i] == '"')
+            fputc('"', f);
+        fputc(s[i], f);
+    }
+    fputc('"', f);
+}
+
+static void csvRow(FILE *f, const char *section, const string &phase, const string &name, const char *metric, const string &value)
+{
+    fprintf(f, "%s,", section);
+    csvField(f, phase);
+    fputc(',', f);
+    csvField(f, name);
+    fprintf(f, ",%s,", metric);
+    csvField(f, value);
+    fputc('\n', f);
+}
+
+static string number(double v)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9e", v);
+    return buffer;
+}
+
+static string number(int64_t v)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%lld", (long long int)v);
+    return buffer;
+}
+
+// one row per figure: section,phase,name,metric,value
+void metrics_report::writeCsv(FILE *f) const
+{
+    fprintf(f, "section,phase,name,metric,value\n");
+    csvRow(f, "format", "", "cell_clustering-metrics", "version", number((int64_t)METRICS_VERSION));
+    for(size_t i = 0; i < system.size(); i++)
+        csvRow(f, "system", "", system[i].first, "value", system[i].second);
+    for(size_t i = 0; i < params.size(); i++)
+        csvRow(f, "params", "", params[i].first, "value", params[i].second);
+    for(size_t i = 0; i < results.size(); i++)
+        csvRow(f, "results", "", results[i].first, "value", results[i].second);
+    csvRow(f, "memory", "", "", "max_resident_bytes", number(maxResidentBytes()));
+    for(size_t i = 0; i < phases.size(); i++){
+        const phase &p = phases[i];
+        csvRow(f, "phase", p.name, "", "time_s", number(p.elapsed));
+        csvRow(f, "phase", p.name, "", "cell_updates", number(p.cellUpdates));
+        csvRow(f, "phase", p.name, "", "cells_per_s", number(perSecond(p.cellUpdates, p.elapsed)));
+        csvRow(f, "phase", p.name, "", "voxel_updates", number(p.voxelUpdates));
+        csvRow(f, "phase", p.name, "", "voxel_updates_per_s", number(perSecond(p.voxelUpdates, p.elapsed)));
+        for(size_t k = 0; k < kernels.size() && k < p.end.size(); k++){
+            const sample_stats st = summarize(kernels[k].sw->samples.data() + p.first[k], p.end[k] - p.first[k]);
+            if(!st.count)
+                continue;
+            csvRow(f, "kernel", p.name, kernels[k].name, "calls", number(st.count));
+            csvRow(f, "kernel", p.name, kernels[k].name, "total_s", number(st.total));
+            csvRow(f, "kernel", p.name, kernels[k].name, "min_s", number(st.min));
+            csvRow(f, "kernel", p.name, kernels[k].name, "median_s", number(st.median));
+            csvRow(f, "kernel", p.name, kernels[k].name, "p99_s", number(st.p99));
+            csvRow(f, "kernel", p.name, kernels[k].name, "max_s", number(st.max));
+        }
+    }
+}
+
+void metrics_report::write(const char *path) const
+{
+    FILE *f = fopen(path, "w");
+    if(!f)
+        die("Can't open %s for writing!\n", path);
+
+    const size_t len = strlen(path);
+    if(len >= 4 && strcmp(path + len - 4, ".csv") == 0)
+        writeCsv(f);
+    else
+        writeJson(f);
+
+    if(fclose(f) != 0)
+        die("Could not write %s: %s\n", path, strerror(errno));
+}
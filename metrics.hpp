@@ -0,0 +1,102 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+// distribution of the intervals a stopwatch recorded
+struct sample_stats
+{
+    int64_t count;
+    double  total;
+    double  min;
+    double  median;
+    double  p99;
+    double  max;
+};
+
+sample_stats summarize(const double *samples, int64_t count);
+
+// Machine-readable report of a run: the system configuration, the
+// parameters, the results and, per phase, the distribution of the time of
+// every call of each kernel along with the throughput of the phase. The
+// kernels are the stopwatches registered with addKernel(); the samples a
+// stopwatch records between beginPhase() and endPhase() belong to that phase.
+class metrics_report
+{
+public:
+    void addKernel(const char *name, const stopwatch *sw);
+
+    void beginPhase(const char *name);
+
+    // closes the current phase; cellUpdates and voxelUpdates count the cells moved and the
+    // voxels advanced by diffusion and decay, summed over the time steps of the phase
+    void endPhase(double elapsed, int64_t cellUpdates, int64_t voxelUpdates);
+
+    void setSystem(const key_values &kv) { system = kv; }
+    void setParams(const key_values &kv) { params = kv; }
+    void addResult(const char *key, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+    // writes CSV if path ends in .csv, JSON otherwise
+    void write(const char *path) const;
+
+private:
+    struct kernel
+    {
+        std::string      name;
+        const stopwatch *sw;
+    };
+
+    struct phase
+    {
+        std::string          name;
+        double               elapsed;
+        int64_t              cellUpdates;
+        int64_t              voxelUpdates;
+        std::vector<int64_t> first; // per kernel, the samples [first, end) belong to the phase
+        std::vector<int64_t> end;
+    };
+
+    void writeJson(FILE *f) const;
+    void writeCsv(FILE *f) const;
+
+    std::vector<kernel> kernels;
+    std::vector<phase>  phases;
+    key_values          system;
+    key_values          params;
+    key_values          results;
+};
+
+// peak resident memory of this process in bytes
+int64_t maxResidentBytes();
@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+
+#include "neighbors.hpp"
+
+using namespace std;
+
+void CellList::build(const float *px, const float *py, const float *pz, const int *ptype, int64_t m_, float range_)
+{
+    m     = m_;
+    range = range_;
+
+    float lo[3] = {  INFINITY,  INFINITY,  INFINITY };
+    float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for(int64_t i = 0; i < m; i++){
+        lo[0] = min(lo[0], px[i]); hi[0] = max(hi[0], px[i]);
+        lo[1] = min(lo[1], py[i]); hi[1] = max(hi[1], py[i]);
+        lo[2] = min(lo[2], pz[i]); hi[2] = max(hi[2], pz[i]);
+    }
+
+    // as many buckets as fit with a side of at least range, with some slack against rounding
+    float scale[3];
+    for(int d = 0; d < 3; d++){
+        const float extent = (m > 0) ? hi[d] - lo[d] : 0.0f;
+        nb[d]    = max((int64_t)1, (int64_t)floor(extent/(range*1.001f)));
+        scale[d] = (extent > 0) ? nb[d]/extent : 0.0f;
+    }
+
+    vector<int64_t> bucket(m);
+    start.assign(numBuckets() + 1, 0);
+    for(int64_t i = 0; i < m; i++){
+        const int64_t bx = min((int64_t)((px[i]-lo[0])*scale[0]), nb[0]-1);
+        const int64_t by = min((int64_t)((py[i]-lo[1])*scale[1]), nb[1]-1);
+        const int64_t bz = min((int64_t)((pz[i]-lo[2])*scale[2]), nb[2]-1);
+        bucket[i] = (bx*nb[1] + by)*nb[2] + bz;
+        start[bucket[i]+1]++;
+    }
+    for(int64_t b = 0; b < numBuckets(); b++)
+        start[b+1] += start[b];
+
+    x.resize(m);
+    y.resize(m);
+    z.resize(m);
+    type.resize(m);
+    vector<int64_t> cursor(start.begin(), start.end()-1);
+    for(int64_t i = 0; i < m; i++){
+        const int64_t s = cursor[bucket[i]]++;
+        x[s]    = px[i];
+        y[s]    = py[i];
+        z[s]    = pz[i];
+        type[s] = ptype[i];
+    }
+}
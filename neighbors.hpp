@@ -0,0 +1,105 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+// Uniform grid of buckets over a set of points, with buckets at least 'range'
+// wide in every dimension so that all pairs closer than range lie in the same
+// or in adjacent buckets. The points are stored sorted by bucket, which makes
+// the pair search O(m*k) for m points with k neighbours each instead of O(m^2).
+class CellList
+{
+public:
+    CellList() : m(0), range(0) {}
+
+    // sorts the m points into buckets
+    void build(const float *px, const float *py, const float *pz, const int *ptype, int64_t m, float range);
+
+    int64_t size() const       { return m; }
+    int64_t numBuckets() const { return nb[0]*nb[1]*nb[2]; }
+
+    // Calls visit(i, j, dist) for every pair i < j, of indices into the sorted arrays, whose
+    // points are closer than range, where i lies in a bucket within [bucketBegin, bucketEnd).
+    // Every pair is visited exactly once over the whole bucket range.
+    template<class V> void forEachClosePair(int64_t bucketBegin, int64_t bucketEnd, V &visit) const;
+
+    template<class V> void forEachClosePair(V &visit) const
+    {
+        forEachClosePair(0, numBuckets(), visit);
+    }
+
+    // the points sorted by bucket
+    std::vector<float> x, y, z;
+    std::vector<int>   type;
+
+private:
+    int64_t m;
+    float   range;
+    int64_t nb[3];                // buckets per dimension
+    std::vector<int64_t> start;   // first point of every bucket, numBuckets()+1 entries
+};
+
+template<class V> void CellList::forEachClosePair(int64_t bucketBegin, int64_t bucketEnd, V &visit) const
+{
+    for(int64_t b = bucketBegin; b < bucketEnd; b++){
+        const int64_t bx = b/(nb[1]*nb[2]);
+        const int64_t by = (b/nb[2])%nb[1];
+        const int64_t bz = b%nb[2];
+
+        // the bucket itself and the 13 neighbours that come after it in lexicographic order
+        for(int d = 13; d < 27; d++){
+            const int64_t ox = bx + d/9 - 1;
+            const int64_t oy = by + (d/3)%3 - 1;
+            const int64_t oz = bz + d%3 - 1;
+            if(ox < 0 || ox >= nb[0] || oy < 0 || oy >= nb[1] || oz < 0 || oz >= nb[2])
+                continue;
+            const int64_t o = (ox*nb[1] + oy)*nb[2] + oz;
+
+            for(int64_t i = start[b]; i < start[b+1]; i++){
+                const int64_t j0 = (o == b) ? i+1 : start[o];
+                for(int64_t j = j0; j < start[o+1]; j++){
+                    float d2 = 0, t;
+                    t = x[j]-x[i];
+                    d2 = d2 + t*t;
+                    t = y[j]-y[i];
+                    d2 = d2 + t*t;
+                    t = z[j]-z[i];
+                    d2 = d2 + t*t;
+                    const float dist = std::sqrt(d2);
+                    if(dist < range)
+                        visit(i, j, dist);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,241 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <omp.h>
+
+#include "perf.hpp"
+
+using namespace std;
+
+bool perf_counting = false;
+
+static vector<int> perfFds;          // [thread*PERF_EVENTS + event], -1 if not open
+static bool        perfOpened[PERF_EVENTS];
+
+static const uint64_t perfConfig[PERF_EVENTS] =
+{
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, // references that miss the last-level cache
+};
+
+const char *perf_event_name(perf_event_id e)
+{
+    switch(e){
+    case PERF_CYCLES:       return "cycles";
+    case PERF_INSTRUCTIONS: return "instructions";
+    case PERF_LLC_MISSES:   return "llc-misses";
+    default:                return "unknown";
+    }
+}
+
+// counts event e of the calling thread, in user space only
+static int openEvent(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = perfConfig[e];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int perfOpen()
+{
+    const int threads = omp_get_max_threads();
+    perfFds.assign(threads*PERF_EVENTS, -1);
+
+#pragma omp parallel
+    {
+        const int t = omp_get_thread_num();
+        for(int e = 0; e < PERF_EVENTS; e++)
+            perfFds[t*PERF_EVENTS + e] = openEvent(e);
+    }
+
+    // an event is only used if it could be opened on every thread
+    int available = 0;
+    for(int e = 0; e < PERF_EVENTS; e++){
+        perfOpened[e] = true;
+        for(int t = 0; t < threads; t++)
+            perfOpened[e] = perfOpened[e] && perfFds[t*PERF_EVENTS + e] >= 0;
+        if(!perfOpened[e]){
+            for(int t = 0; t < threads; t++){
+                if(perfFds[t*PERF_EVENTS + e] >= 0)
+                    close(perfFds[t*PERF_EVENTS + e]);
+                perfFds[t*PERF_EVENTS + e] = -1;
+            }
+        }
+        available += perfOpened[e];
+    }
+
+    perf_counting = available > 0;
+    return available;
+}
+
+bool perfAvailable(perf_event_id e)
+{
+    return perfOpened[e];
+}
+
+void perf_read(uint64_t v[PERF_EVENTS])
+{
+    const int threads = (int)perfFds.size()/PERF_EVENTS;
+    for(int e = 0; e < PERF_EVENTS; e++){
+        v[e] = 0;
+        if(!perfOpened[e])
+            continue;
+        for(int t = 0; t < threads; t++){
+            // value, time enabled and time running; the value is scaled up if the counter was multiplexed
+            uint64_t r[3];
+            if(read(perfFds[t*PERF_EVENTS + e], r, sizeof(r)) != (ssize_t)sizeof(r) || r[2] == 0)
+                continue;
+            v[e] += r[2] < r[1] ? (uint64_t)((double)r[0]*r[1]/r[2]) : r[0];
+        }
+    }
+}
+
+// Independent chains of a*m + c in registers, enough of them to cover the latency of the FMA
+// units. Every iteration is FMA_CHAINS*width multiply-adds, i.e. twice as many flops.
+static const int FMA_CHAINS = 12;
+
+#define DEFINE_FMA_LOOP(name, attribute, width)                                 \
+    attribute static float name(int64_t iterations)                             \
+    {                                                                            \
+        typedef float vec __attribute__((vector_size(width*4)));                 \
+        vec a[FMA_CHAINS];                                                       \
+        for(int j = 0; j < FMA_CHAINS; j++)                                      \
+            for(int k = 0; k < width; k++)                                       \
+                a[j][k] = 1.0f + j + k;                                          \
+        vec m, c;                                                                \
+        for(int k = 0; k < width; k++){                                          \
+            m[k] = 0.999999f;                                                    \
+            c[k] = 1e-6f;                                                        \
+        }                                                                        \
+        for(int64_t i = 0; i < iterations; i++){                                 \
+            for(int j = 0; j < FMA_CHAINS; j++)                                  \
+                a[j] = a[j]*m + c;                                               \
+            __asm__ volatile("" : "+v"(m)); /* keeps the loop from being folded */ \
+        }                                                                        \
+        float sum = 0;                                                           \
+        for(int j = 0; j < FMA_CHAINS; j++)                                      \
+            for(int k = 0; k < width; k++)                                       \
+                sum += a[j][k];                                                  \
+        return sum;                                                              \
+    }
+
+DEFINE_FMA_LOOP(fmaLoopAVX512, __attribute__((target("avx512f,fma"))), 16)
+DEFINE_FMA_LOOP(fmaLoopAVX2,   __attribute__((target("avx2,fma"))),     8)
+DEFINE_FMA_LOOP(fmaLoopSSE,    ,                                        4)
+
+static double peakGflops(simd_level level)
+{
+    const int64_t iterations = 20000000;
+    const int     width      = level == SIMD_AVX512 ? 16 : level == SIMD_AVX2 ? 8 : 4;
+
+    double best = 0;
+    for(int rep = 0; rep < 3; rep++){
+        float sink = 0;
+        stopwatch sw;
+        sw.reset();
+#pragma omp parallel reduction(+:sink)
+        {
+            switch(level){
+            case SIMD_AVX512: sink += fmaLoopAVX512(iterations); break;
+            case SIMD_AVX2:   sink += fmaLoopAVX2(iterations);   break;
+            default:          sink += fmaLoopSSE(iterations);    break;
+            }
+        }
+        const double t = sw.mark();
+        if(sink == 0) // never true, but the compiler cannot know
+            fprintf(stderr, " ");
+        best = max(best, 2.0*FMA_CHAINS*width*iterations*omp_get_max_threads()/t*1e-9);
+    }
+    return best;
+}
+
+static double peakGbs()
+{
+    // three arrays of together 1.5 times the last-level cache, but at least 64 MiB each and at
+    // most an eighth of the memory all together
+    int64_t llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if(llc <= 0)
+        llc = 32 << 20;
+    const int64_t memory = (int64_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+    int64_t bytes = max((int64_t)64 << 20, llc/2);
+    if(memory > 0)
+        bytes = min(bytes, memory/24);
+    const int64_t n = bytes/sizeof(float);
+
+    float *a = (float*)alloc_aligned(n*sizeof(float), 64);
+    float *b = (float*)alloc_aligned(n*sizeof(float), 64);
+    float *c = (float*)alloc_aligned(n*sizeof(float), 64);
+
+#pragma omp parallel for schedule(static)
+    for(int64_t i = 0; i < n; i++){
+        a[i] = 0.0f;
+        b[i] = 1.0f;
+        c[i] = 2.0f;
+    }
+
+    double best = 0;
+    for(int rep = 0; rep < 3; rep++){
+        stopwatch sw;
+        sw.reset();
+#pragma omp parallel for schedule(static)
+        for(int64_t i = 0; i < n; i++)
+            a[i] = b[i] + 3.0f*c[i];
+        const double t = sw.mark();
+        best = max(best, 3.0*n*sizeof(float)/t*1e-9); // the STREAM convention counts no write-allocate
+    }
+
+    free(a);
+    free(b);
+    free(c);
+    return best;
+}
+
+roofline measureRoofline(simd_level level)
+{
+    roofline r;
+    r.gflops = peakGflops(level);
+    r.gbs    = peakGbs();
+    return r;
+}
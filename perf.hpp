@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+#include "util.hpp"
+
+// Hardware event counters and the roofline of the machine. The counters
+// are opened with perf_event_open on every OpenMP thread, so a stopwatch
+// counts the events of all threads while it runs; perf_read() sums them.
+
+// opens cycles, instructions and last-level cache misses on every OpenMP thread and sets
+// perf_counting; returns the number of events available, which may be 0 e.g. in a VM or with a
+// restrictive kernel.perf_event_paranoid
+int perfOpen();
+
+// true if event e could be opened
+bool perfAvailable(perf_event_id e);
+
+const char *perf_event_name(perf_event_id e);
+
+// peak floating-point rate and memory bandwidth of all OpenMP threads together
+struct roofline
+{
+    double gflops; // fp32 FMAs at the widest vector width of level
+    double gbs;    // STREAM triad on buffers much larger than the last-level cache
+};
+
+roofline measureRoofline(simd_level level);
@@ -0,0 +1,86 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11). Every
+// draw is a pure function of (seed, step, cell id, draw index), so cells can
+// draw their random numbers in any order, on any thread and in vector batches
+// and still get the same values for any number of threads.
+
+static inline void philoxMulhilo(uint32_t a, uint32_t b, uint32_t *hi, uint32_t *lo)
+{
+    const uint64_t p = (uint64_t)a*b;
+    *hi = (uint32_t)(p >> 32);
+    *lo = (uint32_t)p;
+}
+
+// applies the ten Philox rounds to the counter c under the key (k0, k1)
+static inline void philox4x32(uint32_t c[4], uint32_t k0, uint32_t k1)
+{
+    for(int r = 0; r < 10; r++){
+        uint32_t hi0, lo0, hi1, lo1;
+        philoxMulhilo(0xD2511F53u, c[0], &hi0, &lo0);
+        philoxMulhilo(0xCD9E8D57u, c[2], &hi1, &lo1);
+        const uint32_t c0 = hi1 ^ c[1] ^ k0;
+        const uint32_t c2 = hi0 ^ c[3] ^ k1;
+        c[0] = c0;
+        c[1] = lo1;
+        c[2] = c2;
+        c[3] = lo0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// maps 32 random bits to a float in [0,1)
+static inline float philoxToFloat(uint32_t u)
+{
+    return (u >> 8)*(1.0f/16777216.0f);
+}
+
+// four independent uniform floats in [0,1) for draw 'draw' of cell 'cell' in time step 'step'
+static inline void randomFloats4(uint64_t seed, uint32_t step, uint32_t cell, uint32_t draw, float out[4])
+{
+    uint32_t c[4] = { cell, step, draw, 0 };
+    philox4x32(c, (uint32_t)seed, (uint32_t)(seed >> 32));
+    out[0] = philoxToFloat(c[0]);
+    out[1] = philoxToFloat(c[1]);
+    out[2] = philoxToFloat(c[2]);
+    out[3] = philoxToFloat(c[3]);
+}
+
+// draw indices used by the cells
+enum rng_draw
+{
+    RNG_DRAW_MOVEMENT = 0, // random movement in phase 1
+    RNG_DRAW_DIVISION = 1, // offset of a daughter cell
+};
@@ -0,0 +1,468 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "util.hpp"
+#include "snapshot.hpp"
+
+using namespace std;
+
+static const size_t LZ_MIN_MATCH  = 4;
+static const size_t LZ_TAIL       = 12;    // the last bytes of the input are always literals
+static const size_t LZ_MAX_OFFSET = 65535;
+static const int    LZ_HASH_BITS  = 16;
+
+static void putLength(vector<uint8_t> &out, size_t len)
+{
+    for(; len >= 255; len -= 255)
+        out.push_back(255);
+    out.push_back((uint8_t)len);
+}
+
+// appends the literals in[0, lit) and, if len > 0, a match of len bytes at offset
+static void putSequence(vector<uint8_t> &out, const uint8_t *in, size_t lit, size_t offset, size_t len)
+{
+    const size_t m = len ? len - LZ_MIN_MATCH : 0;
+    out.push_back((uint8_t)((min(lit, (size_t)15) << 4) | min(m, (size_t)15)));
+    if(lit >= 15)
+        putLength(out, lit - 15);
+    out.insert(out.end(), in, in + lit);
+    if(!len)
+        return;
+    out.push_back((uint8_t)offset);
+    out.push_back((uint8_t)(offset >> 8));
+    if(m >= 15)
+        putLength(out, m - 15);
+}
+
+void lzCompress(const uint8_t *in, size_t size, vector<uint8_t> &out)
+{
+    out.clear();
+    vector<uint32_t> table((size_t)1 << LZ_HASH_BITS, 0); // 1 + position of the last 4 bytes with that hash
+
+    const size_t end = size > LZ_TAIL ? size - LZ_TAIL : 0;
+    size_t anchor = 0, i = 0;
+    while(i < end){
+        uint32_t v;
+        memcpy(&v, in + i, sizeof(v));
+        uint32_t &slot = table[(v*2654435761u) >> (32 - LZ_HASH_BITS)];
+        const size_t candidate = slot;
+        slot = (uint32_t)(i + 1);
+
+        if(candidate && i - (candidate - 1) <= LZ_MAX_OFFSET && memcmp(in + candidate - 1, in + i, LZ_MIN_MATCH) == 0){
+            const size_t m = candidate - 1;
+            size_t len = LZ_MIN_MATCH;
+            while(i + len < end && in[m + len] == in[i + len])
+                len++;
+            putSequence(out, in + anchor, i - anchor, i - m, len);
+            i     += len;
+            anchor = i;
+        }
+        else
+            i++;
+    }
+    putSequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+// reads the extension bytes of a length
+static bool getLength(const uint8_t *in, size_t size, size_t &ip, size_t &len)
+{
+    uint8_t b;
+    do{
+        if(ip >= size)
+            return false;
+        b    = in[ip++];
+        len += b;
+    }
+    while(b == 255);
+    return true;
+}
+
+bool lzDecompress(const uint8_t *in, size_t size, uint8_t *out, size_t outSize)
+{
+    size_t ip = 0, op = 0;
+    while(ip < size){
+        const uint8_t token = in[ip++];
+
+        size_t lit = token >> 4;
+        if(lit == 15 && !getLength(in, size, ip, lit))
+            return false;
+        if(lit > size - ip || lit > outSize - op)
+            return false;
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if(ip == size)
+            break; // the last sequence has no match
+
+        if(size - ip < 2)
+            return false;
+        const size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if(len == 15 && !getLength(in, size, ip, len))
+            return false;
+        len += LZ_MIN_MATCH;
+        if(offset == 0 || offset > op || len > outSize - op)
+            return false;
+        for(size_t k = 0; k < len; k++) // the match may overlap what it produces
+            out[op + k] = out[op + k - offset];
+        op += len;
+    }
+    return op == outSize;
+}
+
+static uint64_t fnv1a(const char *p, size_t bytes)
+{
+    uint64_t h = 14695981039346656037ull;
+    for(size_t i = 0; i < bytes; i++){
+        h ^= (uint8_t)p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// The payload holds x, y, z and id of the n cells and the downsampled grid as
+// 4-byte words, followed by the n types as bytes.
+static size_t payloadBytes(int64_t n, int64_t gridL)
+{
+    return 16*n + 8*gridL*gridL*gridL + n;
+}
+
+// splits the 4-byte words of raw into byte planes, XORed with prev if it is given
+static void encodePayload(const char *raw, const char *prev, size_t bytes, int64_t n, char *out)
+{
+    const size_t words = (bytes - n)/4;
+    for(size_t w = 0; w < words; w++)
+        for(int b = 0; b < 4; b++)
+            out[b*words + w] = prev ? raw[4*w + b] ^ prev[4*w + b] : raw[4*w + b];
+    for(size_t c = 4*words; c < bytes; c++)
+        out[c] = prev ? raw[c] ^ prev[c] : raw[c];
+}
+
+static void decodePayload(const char *enc, const char *prev, size_t bytes, int64_t n, char *out)
+{
+    const size_t words = (bytes - n)/4;
+    for(size_t w = 0; w < words; w++)
+        for(int b = 0; b < 4; b++)
+            out[4*w + b] = prev ? enc[b*words + w] ^ prev[4*w + b] : enc[b*words + w];
+    for(size_t c = 4*words; c < bytes; c++)
+        out[c] = prev ? enc[c] ^ prev[c] : enc[c];
+}
+
+static bool validChunk(const snapshot_chunk_header &h)
+{
+    return memcmp(h.magic, SNAPSHOT_CHUNK_MAGIC, sizeof(h.magic)) == 0 && h.headerBytes == sizeof(h) &&
+           h.n >= 0 && h.gridL >= 0 && h.rawBytes == payloadBytes(h.n, h.gridL);
+}
+
+SnapshotWriter::SnapshotWriter(const char *path, int64_t gridFactor, int buffers)
+    : path(path), gridFactor(gridFactor), buffers(buffers), busy(false), stop(false),
+      sinceKeyframe(0), written_(0), dropped_(0), rawBytes_(0), fileBytes_(0), pinned_(true), captureTime_(0)
+{
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+        die("Could not open snapshot file %s: %s\n", path, strerror(errno));
+    struct stat sb;
+    if(fstat(fd, &sb) != 0)
+        die("Could not stat snapshot file %s: %s\n", path, strerror(errno));
+
+    if(sb.st_size == 0){
+        snapshot_file_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+        h.version     = SNAPSHOT_VERSION;
+        h.byteOrder   = SNAPSHOT_BYTEORDER;
+        h.headerBytes = sizeof(h);
+        if(::write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h))
+            die("Could not write snapshot file %s: %s\n", path, strerror(errno));
+    }
+    else{
+        // appends after the last complete chunk; a chunk cut short by a crash is dropped
+        snapshot_file_header h;
+        if(pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+            die("%s is not a snapshot file!\n", path);
+        if(h.byteOrder != SNAPSHOT_BYTEORDER)
+            die("Snapshot file %s was written on a host of another byte order!\n", path);
+        if(h.version != SNAPSHOT_VERSION || h.headerBytes != sizeof(h))
+            die("Snapshot file %s has version %u, expected %u!\n", path, h.version, SNAPSHOT_VERSION);
+
+        off_t end = sizeof(h);
+        snapshot_chunk_header c;
+        while(pread(fd, &c, sizeof(c), end) == (ssize_t)sizeof(c) && validChunk(c) &&
+              end + (off_t)sizeof(c) + (off_t)c.compressedBytes <= sb.st_size)
+            end += sizeof(c) + c.compressedBytes;
+        if(end < sb.st_size && ftruncate(fd, end) != 0)
+            die("Could not truncate snapshot file %s: %s\n", path, strerror(errno));
+        if(lseek(fd, end, SEEK_SET) != end)
+            die("Could not seek in snapshot file %s: %s\n", path, strerror(errno));
+    }
+
+    for(size_t b = 0; b < this->buffers.size(); b++){
+        this->buffers[b].data     = 0;
+        this->buffers[b].capacity = 0;
+        free_.push_back(&this->buffers[b]);
+    }
+
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&wake, 0);
+    pthread_cond_init(&idle, 0);
+    if(pthread_create(&thread, 0, run, this) != 0)
+        die("Could not start the snapshot writer!\n");
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, 0);
+
+    if(close(fd) != 0)
+        die("Could not write snapshot file %s: %s\n", path, strerror(errno));
+    for(size_t b = 0; b < buffers.size(); b++){
+        if(buffers[b].data)
+            munlock(buffers[b].data, buffers[b].capacity);
+        free(buffers[b].data);
+    }
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+}
+
+bool SnapshotWriter::capture(int phase, int64_t step, const CellStore &cells, int64_t n, const ConcentrationGrid &Conc)
+{
+    stopwatch sw;
+    sw.reset();
+
+    pthread_mutex_lock(&lock);
+    staging *s = 0;
+    if(!free_.empty()){
+        s = free_.back();
+        free_.pop_back();
+    }
+    pthread_mutex_unlock(&lock);
+    if(!s){
+        dropped_++;
+        return false;
+    }
+
+    const int64_t L     = Conc.size();
+    const int64_t f     = gridFactor;
+    const int64_t gridL = f ? (L + f - 1)/f : 0;
+
+    snapshot_chunk_header &h = s->header;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_CHUNK_MAGIC, sizeof(h.magic));
+    h.headerBytes = sizeof(h);
+    h.phase       = phase;
+    h.step        = step;
+    h.n           = n;
+    h.L           = L;
+    h.gridL       = gridL;
+    h.rawBytes    = payloadBytes(n, gridL);
+
+    if(s->capacity < h.rawBytes){
+        // staging buffers are locked in memory, so that copying to them never faults
+        if(s->data)
+            munlock(s->data, s->capacity);
+        free(s->data);
+        s->capacity = h.rawBytes + h.rawBytes/4;
+        s->data     = (char*)alloc_aligned(s->capacity, CELL_ALIGN);
+        if(mlock(s->data, s->capacity) != 0)
+            pinned_ = false;
+    }
+
+    char *p = s->data;
+    memcpy(p,       cells.x,  n*sizeof(float));
+    memcpy(p + 4*n, cells.y,  n*sizeof(float));
+    memcpy(p + 8*n, cells.z,  n*sizeof(float));
+    memcpy(p + 12*n, cells.id, n*sizeof(uint32_t));
+
+    float *grid = (float*)(p + 16*n);
+#pragma omp parallel for collapse(2)
+    for(int64_t bi = 0; bi < gridL; bi++){
+        for(int64_t bj = 0; bj < gridL; bj++){
+            for(int sub = 0; sub < 2; sub++){
+                for(int64_t bk = 0; bk < gridL; bk++){
+                    double sum = 0;
+                    int64_t voxels = 0;
+                    for(int64_t i = bi*f; i < min(L, (bi+1)*f); i++)
+                        for(int64_t j = bj*f; j < min(L, (bj+1)*f); j++)
+                            for(int64_t k = bk*f; k < min(L, (bk+1)*f); k++){
+                                sum += Conc.get(sub, i, j, k);
+                                voxels++;
+                            }
+                    grid[((sub*gridL + bi)*gridL + bj)*gridL + bk] = (float)(sum/voxels);
+                }
+            }
+        }
+    }
+
+    int8_t *type = (int8_t*)(p + 16*n + 8*gridL*gridL*gridL);
+    for(int64_t c = 0; c < n; c++)
+        type[c] = (int8_t)cells.type[c];
+
+    pthread_mutex_lock(&lock);
+    pending.push_back(s);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    captureTime_ += sw.mark();
+    return true;
+}
+
+void SnapshotWriter::flush()
+{
+    pthread_mutex_lock(&lock);
+    while(!pending.empty() || busy)
+        pthread_cond_wait(&idle, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void *SnapshotWriter::run(void *self)
+{
+    SnapshotWriter &w = *(SnapshotWriter*)self;
+    pthread_mutex_lock(&w.lock);
+    for(;;){
+        while(w.pending.empty() && !w.stop)
+            pthread_cond_wait(&w.wake, &w.lock);
+        if(w.pending.empty())
+            break;
+        staging *s = w.pending.front();
+        w.pending.erase(w.pending.begin());
+        w.busy = true;
+        pthread_mutex_unlock(&w.lock);
+
+        w.write(*s);
+
+        pthread_mutex_lock(&w.lock);
+        w.free_.push_back(s);
+        w.busy = false;
+        pthread_cond_broadcast(&w.idle);
+    }
+    pthread_mutex_unlock(&w.lock);
+    return 0;
+}
+
+void SnapshotWriter::write(staging &s)
+{
+    snapshot_chunk_header &h = s.header;
+
+    const bool isDelta = written_ > 0 && sinceKeyframe < SNAPSHOT_KEYFRAME - 1 && last.n == h.n && last.gridL == h.gridL;
+    h.flags = isDelta ? SNAPSHOT_DELTA : 0;
+    sinceKeyframe = isDelta ? sinceKeyframe + 1 : 0;
+
+    delta.resize(h.rawBytes);
+    encodePayload(s.data, isDelta ? previous.data() : 0, h.rawBytes, h.n, delta.data());
+    h.checksum = fnv1a(delta.data(), h.rawBytes);
+    lzCompress((const uint8_t*)delta.data(), h.rawBytes, compressed);
+    h.compressedBytes = compressed.size();
+
+    iovec v[2];
+    v[0].iov_base = &h;
+    v[0].iov_len  = sizeof(h);
+    v[1].iov_base = compressed.data();
+    v[1].iov_len  = compressed.size();
+    const ssize_t bytes = sizeof(h) + compressed.size();
+    if(writev(fd, v, 2) != bytes)
+        die("Could not write snapshot file %s: %s\n", path, strerror(errno));
+
+    previous.assign(s.data, s.data + h.rawBytes);
+    last = h;
+    written_++;
+    rawBytes_  += h.rawBytes;
+    fileBytes_ += bytes;
+}
+
+SnapshotReader::SnapshotReader(const char *path)
+    : path(path)
+{
+    file = fopen(path, "rb");
+    if(!file)
+        die("Could not open snapshot file %s: %s\n", path, strerror(errno));
+
+    snapshot_file_header h;
+    if(fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+        die("%s is not a snapshot file!\n", path);
+    if(h.byteOrder != SNAPSHOT_BYTEORDER)
+        die("Snapshot file %s was written on a host of another byte order!\n", path);
+    if(h.version != SNAPSHOT_VERSION || h.headerBytes != sizeof(h))
+        die("Snapshot file %s has version %u, expected %u!\n", path, h.version, SNAPSHOT_VERSION);
+}
+
+SnapshotReader::~SnapshotReader()
+{
+    fclose(file);
+}
+
+bool SnapshotReader::next(snapshot_frame &f)
+{
+    snapshot_chunk_header h;
+    if(fread(&h, sizeof(h), 1, file) != 1)
+        return false;
+    if(!validChunk(h) || ((h.flags & SNAPSHOT_DELTA) && previous.size() != h.rawBytes))
+        die("Snapshot file %s is corrupt!\n", path);
+
+    compressed.resize(h.compressedBytes);
+    if(fread(compressed.data(), 1, h.compressedBytes, file) != h.compressedBytes)
+        die("Snapshot file %s is truncated!\n", path);
+    payload.resize(h.rawBytes);
+    if(!lzDecompress(compressed.data(), h.compressedBytes, (uint8_t*)payload.data(), h.rawBytes) ||
+       fnv1a(payload.data(), h.rawBytes) != h.checksum)
+        die("Snapshot file %s is corrupt!\n", path);
+
+    vector<char> raw(h.rawBytes);
+    decodePayload(payload.data(), (h.flags & SNAPSHOT_DELTA) ? previous.data() : 0, h.rawBytes, h.n, raw.data());
+    previous.swap(raw);
+
+    const char *p = previous.data();
+    const int64_t n = h.n, cells = h.gridL*h.gridL*h.gridL;
+    f.phase = h.phase;
+    f.step  = h.step;
+    f.n     = n;
+    f.L     = h.L;
+    f.gridL = h.gridL;
+    f.x.assign((const float*)p, (const float*)p + n);
+    f.y.assign((const float*)(p + 4*n), (const float*)(p + 4*n) + n);
+    f.z.assign((const float*)(p + 8*n), (const float*)(p + 8*n) + n);
+    f.id.assign((const uint32_t*)(p + 12*n), (const uint32_t*)(p + 12*n) + n);
+    f.grid.assign((const float*)(p + 16*n), (const float*)(p + 16*n) + 2*cells);
+    f.type.assign((const int8_t*)(p + 16*n + 8*cells), (const int8_t*)(p + 16*n + 8*cells) + n);
+    return true;
+}
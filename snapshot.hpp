@@ -0,0 +1,199 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <pthread.h>
+
+#include "cells.hpp"
+#include "grid.hpp"
+
+// Snapshots record the trajectory of a run: every few time steps the
+// positions, ids and types of the cells and optionally the concentrations,
+// averaged over blocks of f^3 voxels.
+//
+// The compute loop only copies a snapshot into a free staging buffer; a
+// background thread compresses and appends it to the file. If all buffers are
+// still waiting for the disk, the snapshot is dropped rather than waited for.
+//
+// The file is a header followed by self-contained chunks, one per snapshot,
+// so a file can be appended to by a restarted run. The payload of a chunk is
+// the arrays x, y, z and id of the cells, their types as bytes and the two
+// downsampled substances. A delta chunk stores the 4-byte arrays XORed with
+// the previous chunk and split into byte planes, which leaves the high bytes
+// of positions that moved little mostly zero; the payload is then compressed
+// with an LZ77 coder in the sequence format of LZ4. Files are written in the
+// byte order of the host, which the header records.
+
+static const char     SNAPSHOT_MAGIC[8]       = "CDCSNAP";
+static const char     SNAPSHOT_CHUNK_MAGIC[4] = "CHK";
+static const uint32_t SNAPSHOT_VERSION        = 1;
+static const uint32_t SNAPSHOT_BYTEORDER      = 0x01020304;
+static const int      SNAPSHOT_KEYFRAME       = 16; // every that many chunks one is not a delta
+
+enum snapshot_flags
+{
+    SNAPSHOT_DELTA = 1, // the payload is relative to the previous chunk of the file
+};
+
+struct snapshot_file_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t headerBytes;
+    uint32_t reserved;
+};
+
+struct snapshot_chunk_header
+{
+    char     magic[4];
+    uint32_t headerBytes;
+    int32_t  phase;           // 1 or 2
+    uint32_t flags;           // snapshot_flags
+    int64_t  step;            // time steps of the phase done
+    int64_t  n;               // number of cells
+    int64_t  L;               // edge of the full grid
+    int64_t  gridL;           // edge of the downsampled grid, 0 without concentrations
+    uint64_t rawBytes;        // size of the payload
+    uint64_t compressedBytes; // size of the payload in the file, which follows the header
+    uint64_t checksum;        // FNV-1a of the payload as stored, before compression
+};
+
+// one snapshot, decoded
+struct snapshot_frame
+{
+    int     phase;
+    int64_t step;
+    int64_t n;
+    int64_t L;
+    int64_t gridL;
+    std::vector<float>    x, y, z;
+    std::vector<uint32_t> id;
+    std::vector<int8_t>   type;
+    std::vector<float>    grid; // both substances, gridL^3 each, i slowest
+};
+
+class SnapshotWriter
+{
+public:
+    // appends to path, or creates it. Concentrations are averaged over blocks
+    // of gridFactor^3 voxels, 0 records no concentrations. Up to buffers
+    // snapshots wait for the disk at a time.
+    SnapshotWriter(const char *path, int64_t gridFactor, int buffers);
+
+    // writes the snapshots still waiting and closes the file
+    ~SnapshotWriter();
+
+    // copies the first n cells and Conc to a staging buffer for the writer
+    // thread; returns false if no buffer was free and the snapshot is dropped
+    bool capture(int phase, int64_t step, const CellStore &cells, int64_t n, const ConcentrationGrid &Conc);
+
+    // waits until the writer thread has written all captured snapshots
+    void flush();
+
+    int64_t written() const          { return written_; }
+    int64_t dropped() const          { return dropped_; }
+    uint64_t rawBytes() const        { return rawBytes_; }
+    uint64_t fileBytes() const       { return fileBytes_; }
+    bool pinned() const              { return pinned_; }
+    double captureTime() const       { return captureTime_; }
+
+private:
+    struct staging
+    {
+        snapshot_chunk_header header;
+        char  *data;
+        size_t capacity;
+    };
+
+    SnapshotWriter(const SnapshotWriter &);
+    SnapshotWriter &operator=(const SnapshotWriter &);
+
+    static void *run(void *self);
+    void write(staging &s);
+
+    const char *path;
+    int64_t     gridFactor;
+    int         fd;
+
+    std::vector<staging>  buffers;
+    std::vector<staging*> free_;    // buffers the compute loop may fill
+    std::vector<staging*> pending;  // buffers waiting for the writer thread, oldest first
+    bool                  busy;     // the writer thread holds a buffer
+    bool                  stop;
+    pthread_mutex_t       lock;
+    pthread_cond_t        wake;     // signalled when a buffer is pending or stop is set
+    pthread_cond_t        idle;     // signalled when a buffer is returned
+    pthread_t             thread;
+
+    // state of the writer thread
+    std::vector<char>     previous; // payload of the last chunk written
+    snapshot_chunk_header last;
+    int                   sinceKeyframe;
+    std::vector<char>     delta;
+    std::vector<uint8_t>  compressed;
+
+    int64_t  written_;
+    int64_t  dropped_;
+    uint64_t rawBytes_;
+    uint64_t fileBytes_;
+    bool     pinned_;
+    double   captureTime_;
+};
+
+// Reads the snapshots of a file in order.
+class SnapshotReader
+{
+public:
+    explicit SnapshotReader(const char *path);
+    ~SnapshotReader();
+
+    // decodes the next snapshot into f; false at the end of the file
+    bool next(snapshot_frame &f);
+
+private:
+    SnapshotReader(const SnapshotReader &);
+    SnapshotReader &operator=(const SnapshotReader &);
+
+    const char           *path;
+    FILE                 *file;
+    std::vector<char>     previous;
+    std::vector<uint8_t>  compressed;
+    std::vector<char>     payload;
+};
+
+// LZ77 compression into the sequence format of LZ4, with offsets of up to 64 KiB
+void lzCompress(const uint8_t *in, size_t size, std::vector<uint8_t> &out);
+
+// decompresses exactly outSize bytes; false if in is corrupt
+bool lzDecompress(const uint8_t *in, size_t size, uint8_t *out, size_t outSize);
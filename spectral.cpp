@@ -0,0 +1,257 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+
+#include "util.hpp"
+#include "spectral.hpp"
+
+using namespace std;
+
+SpectralPropagator::SpectralPropagator(int64_t L)
+    : L(L)
+{
+    for(int64_t n = L, p = 2; n > 1; p++)
+        for(; n % p == 0; n /= p)
+            factors.push_back((int)p);
+
+    shiftCos.resize(L);
+    shiftSin.resize(L);
+    lambda.resize(L);
+    for(int64_t m = 0; m < L; m++){
+        shiftCos[m] = cos(M_PI*m/(2.0*L));
+        shiftSin[m] = sin(M_PI*m/(2.0*L));
+        lambda[m]   = -4*shiftSin[m]*shiftSin[m];
+    }
+}
+
+// In-place DFT of the B lines in w.xr/w.xi with exponent sign*2*pi*i/L. Every
+// stage of radix p turns the remaining length n into n/p and the stride s into
+// s*p, so that the output comes out in natural order without a reordering.
+void SpectralPropagator::fft(lines &w, int64_t B, int sign) const
+{
+    double *xr = w.xr.data(), *xi = w.xi.data(), *yr = w.yr.data(), *yi = w.yi.data();
+    int64_t n = L, s = 1;
+    for(size_t f = 0; f < factors.size(); f++){
+        const int     p = factors[f];
+        const int64_t m = n/p;
+        vector<double> rootCos(p*p), rootSin(p*p); // of the p-point DFT
+        for(int jr = 0; jr < p*p; jr++){
+            rootCos[jr] = cos(sign*2*M_PI*(jr/p)*(jr%p)/p);
+            rootSin[jr] = sin(sign*2*M_PI*(jr/p)*(jr%p)/p);
+        }
+        for(int64_t q = 0; q < m; q++){
+            for(int j = 0; j < p; j++){
+                const double tr = cos(sign*2*M_PI*q*j/n), ti = sin(sign*2*M_PI*q*j/n);
+                for(int64_t t = 0; t < s; t++){
+                    double *__restrict__ dr = yr + (t + s*(p*q + j))*B;
+                    double *__restrict__ di = yi + (t + s*(p*q + j))*B;
+                    const double *__restrict__ ar = xr + (t + s*q)*B;
+                    const double *__restrict__ ai = xi + (t + s*q)*B;
+                    for(int64_t b = 0; b < B; b++){
+                        dr[b] = ar[b];
+                        di[b] = ai[b];
+                    }
+                    for(int r = 1; r < p; r++){
+                        const double cr = rootCos[j*p + r], ci = rootSin[j*p + r];
+                        const double *__restrict__ sr = xr + (t + s*(q + r*m))*B;
+                        const double *__restrict__ si = xi + (t + s*(q + r*m))*B;
+                        for(int64_t b = 0; b < B; b++){
+                            dr[b] += sr[b]*cr - si[b]*ci;
+                            di[b] += sr[b]*ci + si[b]*cr;
+                        }
+                    }
+                    if(q*j == 0)
+                        continue;
+                    for(int64_t b = 0; b < B; b++){
+                        const double re = dr[b];
+                        dr[b] = re*tr - di[b]*ti;
+                        di[b] = re*ti + di[b]*tr;
+                    }
+                }
+            }
+        }
+        swap(xr, yr);
+        swap(xi, yi);
+        n  = m;
+        s *= p;
+    }
+    if(xr != w.xr.data()){
+        copy(xr, xr + L*B, w.xr.begin());
+        copy(xi, xi + L*B, w.xi.begin());
+    }
+}
+
+// X[m] = sum_n x[n] cos(pi m (2n+1)/2L) for B lines of x, voxel-major, in place.
+// As the lines are real, line b and line b+h share one complex FFT as real and
+// imaginary part, and their spectra are separated by their symmetry.
+void SpectralPropagator::forwardDct(double *x, lines &w, int64_t B) const
+{
+    const int64_t h = (B + 1)/2;
+    for(int64_t n = 0; n < L; n++){
+        const int64_t v = n % 2 ? L-1 - n/2 : n/2; // even voxels first, then odd ones backwards
+        const double *src = x + n*B;
+        double *vr = &w.xr[v*h], *vi = &w.xi[v*h];
+        for(int64_t b = 0; b < h; b++){
+            vr[b] = src[b];
+            vi[b] = b + h < B ? src[b + h] : 0.0;
+        }
+    }
+
+    fft(w, h, -1);
+
+    for(int64_t m = 0; m < L; m++){
+        const double c = shiftCos[m]/2, s = shiftSin[m]/2;
+        const double *Vr = &w.xr[m*h], *Vi = &w.xi[m*h];
+        const double *Wr = &w.xr[(L-m)%L*h], *Wi = &w.xi[(L-m)%L*h];
+        double *X = x + m*B;
+        for(int64_t b = 0; b < h; b++){
+            X[b] = (Vr[b] + Wr[b])*c + (Vi[b] - Wi[b])*s;
+            if(b + h < B)
+                X[b + h] = (Vi[b] + Wi[b])*c + (Wr[b] - Vr[b])*s;
+        }
+    }
+}
+
+// the inverse of forwardDct, again with two lines per complex FFT
+void SpectralPropagator::inverseDct(double *x, lines &w, int64_t B) const
+{
+    const int64_t h = (B + 1)/2;
+    for(int64_t m = 0; m < L; m++){
+        const double c = shiftCos[m], s = shiftSin[m];
+        const double *X = x + m*B, *Y = x + (L-m)*B;
+        double *vr = &w.xr[m*h], *vi = &w.xi[m*h];
+        for(int64_t b = 0; b < h; b++){
+            // the spectra of both lines, (X[m] - i X[L-m]) e^(i pi m/2L), combined as first + i second
+            const double r1 = X[b], i1 = m ? -Y[b] : 0.0;
+            const double r2 = b + h < B ? X[b + h] : 0.0, i2 = m && b + h < B ? -Y[b + h] : 0.0;
+            vr[b] = (r1*c - i1*s) - (r2*s + i2*c);
+            vi[b] = (r1*s + i1*c) + (r2*c - i2*s);
+        }
+    }
+
+    fft(w, h, 1);
+
+    const double scale = 1.0/L;
+    for(int64_t n = 0; n < L; n++){
+        const int64_t v = n % 2 ? L-1 - n/2 : n/2;
+        const double *vr = &w.xr[v*h], *vi = &w.xi[v*h];
+        double *dst = x + n*B;
+        for(int64_t b = 0; b < h; b++){
+            dst[b] = vr[b]*scale;
+            if(b + h < B)
+                dst[b + h] = vi[b]*scale;
+        }
+    }
+}
+
+// x^k by repeated squaring, a few multiplications where pow would dominate the pass
+static inline double power(double x, int64_t k)
+{
+    double r = 1;
+    for(; k; k >>= 1, x *= x)
+        if(k & 1)
+            r *= x;
+    return r;
+}
+
+void SpectralPropagator::advance(ConcentrationGrid &Conc, ConcentrationGrid &scratch, float D, float mu, int64_t steps)
+{
+    if(scratch.rawBytes() < L*L*L*sizeof(double))
+        die("The spectral engine needs an fp32 scratch grid of edge %lld!\n", (long long int)L);
+
+    const int64_t rs = Conc.rowStride();
+    const int64_t ps = Conc.planeStride();
+    double *field = (double*)scratch.raw(); // one substance, plane-major without padding
+    const double decay = 1.0 - mu, d = D/6.0;
+
+    for(int s = 0; s < 2; s++){
+        float *u = &Conc.at(s, 0, 0, 0);
+
+        // pass 0 transforms along x, with the rows of a given j of all planes as lines, pass 1 along
+        // y, with the rows of a plane, and passes 3 and 4 invert them. Pass 2 transposes every
+        // plane, so that its rows are the lines, and transforms along z, multiplies and inverts.
+        // Only passes 0 and 4 touch Conc; the partial transforms stay in double in field.
+        for(int pass = 0; pass < 5; pass++){
+#pragma omp parallel
+            {
+                lines w;
+                w.xr.resize(L*L);
+                w.xi.resize(L*L);
+                w.yr.resize(L*L);
+                w.yi.resize(L*L);
+                vector<double> x(L*L);
+
+                int64_t o;
+#pragma omp for schedule(static)
+                for(o = 0; o < L; o++){
+                    if(pass == 2){
+                        double *plane = &field[o*L*L];
+                        for(int64_t j = 0; j < L; j++)
+                            for(int64_t k = 0; k < L; k++)
+                                x[k*L + j] = plane[j*L + k];
+                        forwardDct(x.data(), w, L);
+                        for(int64_t k = 0; k < L; k++)
+                            for(int64_t j = 0; j < L; j++)
+                                x[k*L + j] *= power(decay*(1.0 + d*(lambda[o] + lambda[j] + lambda[k])), steps);
+                        inverseDct(x.data(), w, L);
+                        for(int64_t j = 0; j < L; j++)
+                            for(int64_t k = 0; k < L; k++)
+                                plane[j*L + k] = x[k*L + j];
+                        continue;
+                    }
+
+                    // line i of the batch in the grid and in the field
+                    const bool    acrossPlanes = pass == 0 || pass == 4;
+                    float  *base   = u + (acrossPlanes ? o*rs : o*ps);
+                    double *fbase  = &field[acrossPlanes ? o*L : o*L*L];
+                    const int64_t stride  = acrossPlanes ? ps : rs;
+                    const int64_t fstride = acrossPlanes ? L*L : L;
+
+                    for(int64_t i = 0; i < L; i++)
+                        for(int64_t k = 0; k < L; k++)
+                            x[i*L + k] = pass == 0 ? base[i*stride + k] : fbase[i*fstride + k];
+                    if(pass < 2)
+                        forwardDct(x.data(), w, L);
+                    else
+                        inverseDct(x.data(), w, L);
+                    for(int64_t i = 0; i < L; i++)
+                        for(int64_t k = 0; k < L; k++){
+                            if(pass == 4)
+                                base[i*stride + k] = (float)max(x[i*L + k], 0.0);
+                            else
+                                fbase[i*fstride + k] = x[i*L + k];
+                        }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "grid.hpp"
+
+// Diffusion and decay without production are linear, and with the mirrored
+// boundaries of the stencil the discrete Laplacian of a line of L voxels has
+// the cosine vectors of the DCT-II as eigenvectors, with eigenvalues
+// -4 sin^2(pi m/2L). In that basis one explicit time step multiplies mode
+// (a,b,c) by (1-mu)(1 + D/6 (lambda_a + lambda_b + lambda_c)), so any number
+// of steps costs one forward and one inverse 3D transform.
+//
+// The transforms are DCT-IIs computed with an L-point complex FFT of
+// permuted input (Makhoul 1980). The FFT is a mixed-radix Stockham FFT over
+// the prime factors of L, applied to a batch of lines at once so that its
+// inner loops run over adjacent lines and vectorize. Lines are transformed in
+// double precision, and so are the partial transforms in between, which are
+// kept in the storage of a second grid instead of a buffer of their own. The
+// multiplier of a mode is computed from the 1-D eigenvalues where it is applied.
+class SpectralPropagator
+{
+public:
+    explicit SpectralPropagator(int64_t L);
+
+    // applies steps time steps of diffusion with D and decay with mu to both
+    // substances of Conc, as the explicit stencil would without production.
+    // Negative values left by rounding are set to zero. Only fp32 storage on
+    // a single rank is supported. The contents of scratch, a grid of the same
+    // size, are overwritten.
+    void advance(ConcentrationGrid &Conc, ConcentrationGrid &scratch, float D, float mu, int64_t steps);
+
+private:
+    struct lines // scratch for a batch of B lines of L voxels, voxel-major
+    {
+        std::vector<double> xr, xi, yr, yi;
+    };
+
+    void fft(lines &w, int64_t B, int sign) const;
+    void forwardDct(double *x, lines &w, int64_t B) const;
+    void inverseDct(double *x, lines &w, int64_t B) const;
+
+    int64_t L;
+    std::vector<int>    factors; // prime factors of L, the radices of the FFT stages
+    std::vector<double> shiftCos, shiftSin; // cos and sin of pi m/2L
+    std::vector<double> lambda;             // eigenvalues of the Laplacian of a line, -4 sin^2(pi m/2L)
+};
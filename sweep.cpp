@@ -0,0 +1,213 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sched.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <omp.h>
+
+#include "sweep.hpp"
+
+using namespace std;
+
+vector<sweep_run> readSweep(const char *path, const cdc_params &base)
+{
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        die("Can't open %s for reading!\n", path);
+
+    vector<sweep_run> runs;
+    char buffer[1024];
+    int line = 0;
+    while (fgets(buffer, 1024, fp) == buffer)
+    {
+        line++;
+        sweep_run run;
+        vector<char*> kvs;
+        for(char *tok = strtok(buffer, " \t\r\n"); tok; tok = strtok(0, " \t\r\n")){
+            if(kvs.empty() && tok[0] == '#')
+                break;
+            if(!run.overrides.empty())
+                run.overrides += ' ';
+            run.overrides += tok;
+            kvs.push_back(strdup(tok));
+        }
+        if(kvs.empty())
+            continue;
+
+        run.params = override_params(base, kvs);
+        for(size_t i = 0; i < kvs.size(); i++)
+            free(kvs[i]);
+
+        const cdc_params &p = run.params;
+        if(p.L != base.L || p.divThreshold != base.divThreshold || p.pathThreshold != base.pathThreshold ||
+           p.seed != base.seed || p.timeTile != base.timeTile || p.activeBlock != base.activeBlock)
+            die("Line %d of %s changes a parameter of phase 1 or of the grid!\n", line, path);
+
+        runs.push_back(run);
+    }
+    fclose(fp);
+
+    if(runs.empty())
+        die("%s holds no runs!\n", path);
+    return runs;
+}
+
+static vector<int> allowedCpus()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    vector<int> cpus;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0){
+        for(int c = 0; c < CPU_SETSIZE; c++)
+            if(CPU_ISSET(c, &set))
+                cpus.push_back(c);
+    }
+    if(cpus.empty())
+        cpus.push_back(0);
+    return cpus;
+}
+
+int availableCpus()
+{
+    return (int)allowedCpus().size();
+}
+
+static string cpuList(const vector<int> &cpus)
+{
+    string s;
+    char buffer[32];
+    for(size_t i = 0; i < cpus.size(); ){
+        size_t j = i;
+        while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+        if(j > i)
+            snprintf(buffer, sizeof(buffer), "%s%d-%d", s.empty() ? "" : ",", cpus[i], cpus[j]);
+        else
+            snprintf(buffer, sizeof(buffer), "%s%d", s.empty() ? "" : ",", cpus[i]);
+        s += buffer;
+        i = j + 1;
+    }
+    return s;
+}
+
+void forkSweep(const vector<sweep_run> &runs, int jobs, sweep_fn fn, void *ctx,
+               vector<sweep_result> &results, vector<string> &cpus)
+{
+    const int nruns = (int)runs.size();
+    if(jobs > nruns)
+        jobs = nruns;
+
+    // split the CPUs into one group per job; with more jobs than CPUs the groups share them
+    const vector<int> all = allowedCpus();
+    const int C = (int)all.size();
+    vector<vector<int> > groups(jobs);
+    for(int g = 0; g < jobs; g++){
+        if(jobs <= C)
+            groups[g].assign(all.begin() + (int64_t)g*C/jobs, all.begin() + (int64_t)(g + 1)*C/jobs);
+        else
+            groups[g].push_back(all[g % C]);
+    }
+
+    sweep_result failed;
+    memset(&failed, 0, sizeof(failed));
+    failed.status = 1;
+    results.assign(nruns, failed);
+    cpus.assign(nruns, string());
+
+    vector<pid_t> slotPid(jobs, 0);
+    vector<int>   slotRun(jobs, -1);
+    vector<int>   slotFd(jobs, -1);
+
+    // anything buffered would otherwise be written again by every child
+    fflush(stdout);
+    fflush(stderr);
+
+    int next = 0, running = 0;
+    while(next < nruns || running > 0){
+        // start runs on the free groups
+        for(int g = 0; g < jobs && next < nruns; g++){
+            if(slotPid[g])
+                continue;
+
+            int fd[2];
+            if(pipe(fd) != 0)
+                die("Could not create a pipe for sweep run %d: %s\n", next, strerror(errno));
+
+            const pid_t pid = fork();
+            if(pid < 0)
+                die("Could not fork sweep run %d: %s\n", next, strerror(errno));
+            if(pid == 0){
+                close(fd[0]);
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for(size_t i = 0; i < groups[g].size(); i++)
+                    CPU_SET(groups[g][i], &set);
+                sched_setaffinity(0, sizeof(set), &set);
+                omp_set_num_threads((int)groups[g].size());
+
+                sweep_result r = fn(runs[next], ctx);
+                r.status = 0;
+                const bool sent = write(fd[1], &r, sizeof(r)) == (ssize_t)sizeof(r);
+                fflush(stdout);
+                _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+
+            close(fd[1]);
+            slotPid[g] = pid;
+            slotRun[g] = next;
+            slotFd[g]  = fd[0];
+            cpus[next] = cpuList(groups[g]);
+            next++;
+            running++;
+        }
+
+        // collect a finished run; its result fits into the pipe buffer, so it is waiting there
+        int status;
+        const pid_t pid = wait(&status);
+        if(pid < 0)
+            die("Could not wait for the sweep runs: %s\n", strerror(errno));
+        for(int g = 0; g < jobs; g++){
+            if(slotPid[g] != pid)
+                continue;
+            sweep_result r;
+            if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS &&
+               read(slotFd[g], &r, sizeof(r)) == (ssize_t)sizeof(r))
+                results[slotRun[g]] = r;
+            close(slotFd[g]);
+            slotPid[g] = 0;
+            running--;
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2015, Newcastle University (United Kingdom)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+// A sweep runs phase 2 once per parameter set on top of a single phase-1
+// result: every run is a fork()ed child that shares the phase-1 state with
+// the parent copy-on-write.
+
+struct sweep_run
+{
+    std::string overrides; // the <param>=<value> pairs of the run, as given
+    cdc_params  params;
+};
+
+// Reads one run per line of path: whitespace-separated <param>=<value>
+// overrides of base. Empty lines and lines starting with '#' are skipped.
+// Parameters of phase 1 and of the grid may not be overridden.
+std::vector<sweep_run> readSweep(const char *path, const cdc_params &base);
+
+struct sweep_result
+{
+    int     status;        // 0 if the run completed
+    int     criterion;
+    double  energy;
+    int64_t nrCellsSubVol;
+    double  phase2Time;
+};
+
+typedef sweep_result (*sweep_fn)(const sweep_run &run, void *ctx);
+
+// Runs fn on every run in a child process, at most jobs at a time. The CPUs
+// this process may run on are split into jobs contiguous groups, and every
+// child is bound to a free group and runs as many OpenMP threads as it has
+// CPUs. results[i] and cpus[i] receive the result of run i and the CPUs it
+// ran on.
+void forkSweep(const std::vector<sweep_run> &runs, int jobs, sweep_fn fn, void *ctx,
+               std::vector<sweep_result> &results, std::vector<std::string> &cpus);
+
+// number of CPUs this process may run on
+int availableCpus();
@@ -35,6 +35,9 @@
 #include <cstdlib>
 #include <cstdarg>
 #include <cmath>
+#ifdef CDC_MPI
+#include <mpi.h>
+#endif
 
 #include "util.hpp"
 
@@ -44,9 +47,24 @@ void die(const char *fmt, ...)
     va_start(val, fmt);
     vfprintf(stderr, fmt, val);
     va_end(val);
+#ifdef CDC_MPI
+    // take the other ranks down too instead of leaving them waiting for this one
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if(initialized)
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
     exit(EXIT_FAILURE);
 }
 
+void *alloc_aligned(size_t bytes, size_t alignment)
+{
+    void *res = 0;
+    if(posix_memalign(&res, alignment, bytes ? bytes : alignment) != 0)
+        die("Failed to allocate %zu bytes aligned to %zu!\n", bytes, alignment);
+    return res;
+}
+
 static char *format_uname()
 {
     utsname un;
@@ -64,7 +82,55 @@ static void cpuid(const unsigned info, unsigned *eax, unsigned *ebx, unsigned *e
 {
     __asm__("cpuid;"
             :"=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
-            :"a" (info));
+            :"a" (info), "c" (0));
+}
+
+static unsigned long long xgetbv(const unsigned index)
+{
+    unsigned eax, edx;
+    __asm__("xgetbv;"
+            :"=a" (eax), "=d" (edx)
+            :"c" (index));
+    return ((unsigned long long)edx << 32) | eax;
+}
+
+simd_level cpu_simd_level()
+{
+    unsigned max, a, b, c, d;
+    cpuid(0, &max, &b, &c, &d);
+    if(max < 7)
+        return SIMD_SCALAR;
+
+    // the OS has to save the vector registers on context switches, see the Intel SDM 13.3
+    cpuid(1, &a, &b, &c, &d);
+    const bool osxsave = (c >> 27) & 1;
+    const bool avx     = (c >> 28) & 1;
+    const bool f16c    = (c >> 29) & 1; // used by the AVX2 kernels for fp16 grids
+    if(!osxsave || !avx)
+        return SIMD_SCALAR;
+    const unsigned long long xcr0 = xgetbv(0);
+
+    cpuid(7, &a, &b, &c, &d);
+    const bool avx2    = (b >> 5) & 1;
+    const bool avx512f = (b >> 16) & 1;
+
+    if(avx512f && (xcr0 & 0xE6) == 0xE6)
+        return SIMD_AVX512;
+    if(avx2 && f16c && (xcr0 & 0x6) == 0x6)
+        return SIMD_AVX2;
+    return SIMD_SCALAR;
+}
+
+const char *simd_level_name(simd_level l)
+{
+    switch(l){
+    case SIMD_AVX512:
+        return "avx512";
+    case SIMD_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
 }
 
 static void vendorid(char id[13])
@@ -117,26 +183,58 @@ static void cpu_info(cpuinfo *ci)
         ci->display_model = ci->model;
 }
 
-void print_sys_config(FILE *o)
+// appends key = printf(fmt, ...) to kv
+static void add_kv(key_values &kv, const char *key, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void add_kv(key_values &kv, const char *key, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list val;
+    va_start(val, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, val);
+    va_end(val);
+    kv.push_back(std::make_pair(std::string(key), std::string(buffer)));
+}
+
+static void print_kv(const key_values &kv, FILE *o)
+{
+    for(size_t i = 0; i < kv.size(); i++)
+        fprintf(o, "%-35s = %s\n", kv[i].first.c_str(), kv[i].second.c_str());
+}
+
+static const char *env_or_null(const char *name)
+{
+    const char *v = getenv(name);
+    return v ? v : "(null)";
+}
+
+key_values sys_config()
 {
-    fprintf(o, "%-35s = %s\n", "BUILD_HOST", BUILD_HOST);
-    fprintf(o, "%-35s = %s\n", "COMPILER_VERSION", COMPILER_VERSION);
-    fprintf(o, "%-35s = %s\n", "GLIBC_VERSION", gnu_get_libc_version ());
-    fprintf(o, "%-35s = %s %s\n", "BUILD_DATE", __DATE__, __TIME__);
+    key_values kv;
+    add_kv(kv, "BUILD_HOST", "%s", BUILD_HOST);
+    add_kv(kv, "COMPILER_VERSION", "%s", COMPILER_VERSION);
+    add_kv(kv, "GLIBC_VERSION", "%s", gnu_get_libc_version ());
+    add_kv(kv, "BUILD_DATE", "%s %s", __DATE__, __TIME__);
     char *host = format_uname();
-    fprintf(o, "%-35s = %s\n", "HOST", host);
+    add_kv(kv, "HOST", "%s", host);
     free(host);
     char vid[13];
     vendorid(vid);
     char pb[49];
     proc_brand(pb);
-    fprintf(o, "%-35s = %s %s\n", "CPU", vid, pb);
+    add_kv(kv, "CPU", "%s %s", vid, pb);
     cpuinfo ci;
     cpu_info(&ci);
-    fprintf(o, "%-35s = %s\n", "LD_PRELOAD", getenv("LD_PRELOAD"));
-    fprintf(o, "%-35s = Family %u Model %u Stepping %u\n", "CPUINFO", ci.display_family, ci.display_model, ci.stepping);
-    fprintf(o, "%-35s = %s\n", "KMP_AFFINITY", getenv("KMP_AFFINITY"));
-    fprintf(o, "%-35s = %s\n", "KMP_BLOCKTIME", getenv("KMP_BLOCKTIME"));
+    add_kv(kv, "LD_PRELOAD", "%s", env_or_null("LD_PRELOAD"));
+    add_kv(kv, "CPUINFO", "Family %u Model %u Stepping %u", ci.display_family, ci.display_model, ci.stepping);
+    add_kv(kv, "KMP_AFFINITY", "%s", env_or_null("KMP_AFFINITY"));
+    add_kv(kv, "KMP_BLOCKTIME", "%s", env_or_null("KMP_BLOCKTIME"));
+    return kv;
+}
+
+void print_sys_config(FILE *o)
+{
+    print_kv(sys_config(), o);
 }
 
 char *read_kv(char **argv, int in_ind, int *optind)
@@ -255,9 +353,119 @@ static bool cdc_set_kv(cdc_params *params, char *kvstr, unsigned stage)
         params->have_spatialScale = stage;
         return true;
     }
+    // tuning parameters of the grid engines
+    if (strcmp(pkey, "tileX") == 0) {
+        if(params->have_tileX >= stage)
+            die("Found duplicate tileX!");
+        sscanf(pval, "%lld", (long long int*)&params->tileX);
+        params->have_tileX = stage;
+        return true;
+    }
+    if (strcmp(pkey, "tileY") == 0) {
+        if(params->have_tileY >= stage)
+            die("Found duplicate tileY!");
+        sscanf(pval, "%lld", (long long int*)&params->tileY);
+        params->have_tileY = stage;
+        return true;
+    }
+    if (strcmp(pkey, "tileZ") == 0) {
+        if(params->have_tileZ >= stage)
+            die("Found duplicate tileZ!");
+        sscanf(pval, "%lld", (long long int*)&params->tileZ);
+        params->have_tileZ = stage;
+        return true;
+    }
+    if (strcmp(pkey, "timeTile") == 0) {
+        if(params->have_timeTile >= stage)
+            die("Found duplicate timeTile!");
+        sscanf(pval, "%u", &params->timeTile);
+        params->have_timeTile = stage;
+        return true;
+    }
+    if (strcmp(pkey, "activeBlock") == 0) {
+        if(params->have_activeBlock >= stage)
+            die("Found duplicate activeBlock!");
+        sscanf(pval, "%lld", (long long int*)&params->activeBlock);
+        params->have_activeBlock = stage;
+        return true;
+    }
+    if (strcmp(pkey, "activeEpsilon") == 0) {
+        if(params->have_activeEpsilon >= stage)
+            die("Found duplicate activeEpsilon!");
+        sscanf(pval, "%f", &params->activeEpsilon);
+        params->have_activeEpsilon = stage;
+        return true;
+    }
+    if (strcmp(pkey, "targetN") == 0) {
+        if(params->have_targetN >= stage)
+            die("Found duplicate targetN!");
+        sscanf(pval, "%lld", (long long int*)&params->targetN);
+        params->have_targetN = stage;
+        return true;
+    }
+    if (strcmp(pkey, "seed") == 0) {
+        if(params->have_seed >= stage)
+            die("Found duplicate seed!");
+        sscanf(pval, "%llu", (long long unsigned int*)&params->seed);
+        params->have_seed = stage;
+        return true;
+    }
     return false;
 }
 
+// checks that the required parameters are set, fills in the defaults of the optional ones
+// and derives the others
+static void complete_params(cdc_params &params)
+{
+    if(!params.have_speed)
+        die("Missing speed parameter!\n");
+    if(!params.have_T)
+        die("Missing T parameter!\n");
+    if(!params.have_L)
+        die("Missing L parameter!\n");
+    if(!params.have_D)
+        die("Missing D parameter!\n");
+    if(!params.have_mu)
+        die("Missing mu parameter!\n");
+    if(!params.have_divThreshold)
+        die("Missing divThreshold parameter!\n");
+    if(params.divThreshold > 32)
+        die("divThreshold must not exceed 32, cell ids hold one bit per division!\n");
+    if(!params.have_spatialScale)
+        die("Missing spatialScale parameter!\n");
+    if(!params.have_pathThreshold)
+        die("Missing pathThreshold parameter!\n");
+
+    // optional parameters
+    if(!params.have_tileX)
+        params.tileX = 64;
+    if(!params.have_tileY)
+        params.tileY = 16;
+    if(!params.have_tileZ)
+        params.tileZ = 256;
+    if(!params.have_timeTile)
+        params.timeTile = 4;
+    if(!params.have_activeBlock)
+        params.activeBlock = 16;
+    if(!params.have_activeEpsilon)
+        params.activeEpsilon = 0;
+    if(!params.have_seed)
+        params.seed = 1;
+    if(!params.have_targetN)
+        params.targetN = 10000;
+    if(params.targetN < 0)
+        die("targetN must not be negative!\n");
+    if(params.tileX < 1 || params.tileY < 1 || params.tileZ < 1 || params.timeTile < 1)
+        die("Tile sizes must be positive!\n");
+    if(params.activeBlock < 1)
+        die("activeBlock must be positive!\n");
+    if(params.activeEpsilon < 0)
+        die("activeEpsilon must not be negative!\n");
+
+    params.finalNumberCells = powf(2.0f,params.divThreshold);
+    params.spatialRange     = params.spatialScale*powf(1.0f/((float)(params.finalNumberCells)), 1.0f/3.0f);
+}
+
 cdc_params get_params(const char *input_file, std::vector<char*> &candidate_kvs, int quiet)
 {
     FILE *fp = fopen(input_file, "r");
@@ -275,6 +483,14 @@ cdc_params get_params(const char *input_file, std::vector<char*> &candidate_kvs,
     params.have_divThreshold  = 0;
     params.have_spatialScale  = 0;
     params.have_pathThreshold = 0;
+    params.have_tileX         = 0;
+    params.have_tileY         = 0;
+    params.have_tileZ         = 0;
+    params.have_timeTile      = 0;
+    params.have_activeBlock   = 0;
+    params.have_activeEpsilon = 0;
+    params.have_targetN       = 0;
+    params.have_seed          = 0;
 
     while (fgets(buffer, 1024, fp) == buffer)
     {
@@ -296,42 +512,50 @@ cdc_params get_params(const char *input_file, std::vector<char*> &candidate_kvs,
         free(candidate_kvs[i]);
     }
 
-    if(!params.have_speed)
-        die("Missing speed parameter!\n");
-    if(!params.have_T)
-        die("Missing T parameter!\n");
-    if(!params.have_L)
-        die("Missing L parameter!\n");
-    if(!params.have_D)
-        die("Missing D parameter!\n");
-    if(!params.have_mu)
-        die("Missing mu parameter!\n");
-    if(!params.have_divThreshold)
-        die("Missing divThreshold parameter!\n");
-    if(!params.have_spatialScale)
-        die("Missing spatialScale parameter!\n");
-    if(!params.have_pathThreshold)
-        die("Missing pathThreshold parameter!\n");
-
-    params.finalNumberCells = powf(2.0f,params.divThreshold);
-    params.spatialRange     = params.spatialScale*powf(1.0f/((float)(params.finalNumberCells)), 1.0f/3.0f);
+    complete_params(params);
 
     candidate_kvs.clear();
     return params;
 }
 
+cdc_params override_params(const cdc_params &base, std::vector<char*> &kvs)
+{
+    cdc_params params = base;
+    for(int64_t i = 0; i < (int64_t)kvs.size(); ++i)
+    {
+        if(!cdc_set_kv(&params, kvs[i], 3))
+            die("Unknown parameter %s!\n", kvs[i]);
+    }
+
+    complete_params(params);
+    return params;
+}
+
+key_values params_config(const cdc_params *p)
+{
+    key_values kv;
+    add_kv(kv, "N_INITIAL", "%llu", 1ULL);
+    add_kv(kv, "SPEED", "%le", p->speed);
+    add_kv(kv, "T", "%llu", (long long int)p->T);
+    add_kv(kv, "L", "%llu", (long long int)p->L);
+    add_kv(kv, "D", "%le", p->D);
+    add_kv(kv, "MU", "%le", p->mu);
+    add_kv(kv, "FINALNUMBERCELLS", "%lu", p->finalNumberCells);
+    add_kv(kv, "SPATIALSCALE", "%le", p->spatialScale);
+    add_kv(kv, "SPATIALRANGE", "%le", p->spatialRange);
+    add_kv(kv, "PATHTHRESHOLD", "%le", p->pathThreshold);
+    add_kv(kv, "DIVTHRESHOLD", "%u", p->divThreshold);
+    add_kv(kv, "TILE", "%lld x %lld x %lld", (long long int)p->tileX, (long long int)p->tileY, (long long int)p->tileZ);
+    add_kv(kv, "TIMETILE", "%u", p->timeTile);
+    add_kv(kv, "ACTIVEBLOCK", "%lld", (long long int)p->activeBlock);
+    add_kv(kv, "ACTIVEEPSILON", "%le", p->activeEpsilon);
+    add_kv(kv, "TARGETN", "%lld", (long long int)p->targetN);
+    add_kv(kv, "SEED", "%llu", (long long unsigned int)p->seed);
+    return kv;
+}
+
 void print_params(const cdc_params *p, FILE *out)
 {
-    fprintf(out, "%-35s = %llu\n", "N_INITIAL", 1ULL);
-    fprintf(out, "%-35s = %le\n",  "SPEED", p->speed);
-    fprintf(out, "%-35s = %llu\n", "T", (long long int)p->T);
-    fprintf(out, "%-35s = %llu\n", "L", (long long int)p->L);
-    fprintf(out, "%-35s = %le\n",  "D", p->D);
-    fprintf(out, "%-35s = %le\n",  "MU", p->mu);
-    fprintf(out, "%-35s = %lu\n",  "FINALNUMBERCELLS", p->finalNumberCells);
-    fprintf(out, "%-35s = %le\n",  "SPATIALSCALE", p->spatialScale);
-    fprintf(out, "%-35s = %le\n",  "SPATIALRANGE", p->spatialRange);
-    fprintf(out, "%-35s = %le\n",  "PATHTHRESHOLD", p->pathThreshold);
-    fprintf(out, "%-35s = %u\n",   "DIVTHRESHOLD", p->divThreshold);
+    print_kv(params_config(p), out);
     fprintf(out, "------------------------------------------\n");
 }
@@ -30,6 +30,10 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <utility>
 #include <vector>
 
 struct cdc_params
@@ -50,21 +54,62 @@ struct cdc_params
     unsigned have_spatialScale;
     float    pathThreshold;
     unsigned have_pathThreshold;
+    int64_t  tileX;
+    unsigned have_tileX;
+    int64_t  tileY;
+    unsigned have_tileY;
+    int64_t  tileZ;
+    unsigned have_tileZ;
+    unsigned timeTile;
+    unsigned have_timeTile;
+    int64_t  activeBlock;
+    unsigned have_activeBlock;
+    float    activeEpsilon;
+    unsigned have_activeEpsilon;
+    int64_t  targetN;
+    unsigned have_targetN;
+    uint64_t seed;
+    unsigned have_seed;
     int64_t  finalNumberCells;
     float    spatialRange;
 };
 
+// hardware events counted while a stopwatch runs, see perf.hpp
+enum perf_event_id
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_EVENTS
+};
+
+extern bool perf_counting; // set once the counters are open
+void perf_read(uint64_t v[PERF_EVENTS]);
+
 struct stopwatch
 {
     stopwatch()
     {
         elapsed = 0.0;
         count = 0;
+        flops = 0.0;
+        bytes = 0.0;
+        for(int e = 0; e < PERF_EVENTS; e++)
+            counters[e] = counterStart[e] = 0;
     }
 
     void reset()
     {
         clock_gettime(CLOCK_MONOTONIC, &last);
+        if(perf_counting)
+            perf_read(counterStart);
+    }
+
+    // adds the analytic floating-point operations and memory traffic of the interval being timed
+    void work(double f, double b)
+    {
+        flops += f;
+        bytes += b;
     }
 
     double average() const
@@ -80,20 +125,56 @@ struct stopwatch
         elapsed += interval;
         last = now;
         ++count;
+        samples.push_back(interval);
+        if(perf_counting){
+            uint64_t v[PERF_EVENTS];
+            perf_read(v);
+            for(int e = 0; e < PERF_EVENTS; e++){
+                counters[e]     += v[e] - counterStart[e];
+                counterStart[e]  = v[e];
+            }
+        }
         return interval;
     }
     struct timespec last;
 
     int64_t count;
     double elapsed;
+    std::vector<double> samples; // every interval, in the order they were marked
+    double flops;                // analytic work of all intervals, see work()
+    double bytes;
+    uint64_t counters[PERF_EVENTS]; // events of all intervals, if perf_counting
+    uint64_t counterStart[PERF_EVENTS];
 };
 
+// ordered <key, value> pairs of a report, as they are printed
+typedef std::vector<std::pair<std::string, std::string> > key_values;
+
 char *read_kv(char *argv[], int in_ind, int *optind);
 
 cdc_params get_params(const char *input_file, std::vector<char*> &candidate_kvs, int quiet);
 
+// params with the <param>=<value> pairs of kvs applied on top; each param may appear once in kvs
+cdc_params override_params(const cdc_params &base, std::vector<char*> &kvs);
+
 void print_params(const cdc_params *p, FILE *out);
+key_values params_config(const cdc_params *p);
 
 void die(const char *fmt, ...);
 
+void *alloc_aligned(size_t bytes, size_t alignment);
+
 void print_sys_config(FILE *o);
+key_values sys_config();
+
+// widest vector instruction set supported by both the CPU and the OS
+enum simd_level
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512,
+};
+
+simd_level cpu_simd_level();
+
+const char *simd_level_name(simd_level l);